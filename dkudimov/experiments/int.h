@@ -1,10 +1,12 @@
 #include <unordered_map>
+#include <algorithm>
 #include <string_view>
 #include <cstring>
 #include <memory>
 #include <iostream>
 #include <vector>
 #include <optional>
+#include <stdexcept>
 
 template <typename TMoveObserver, typename THasher = std::hash<std::string_view>>
 class TStringHashMapWithIterators;
@@ -51,8 +53,9 @@ public:
         Node* cur = reinterpret_cast<Node*>(head_);
         while (cur)
         {
+            Node* next = cur->next_;
             cur->~Node();
-            cur = cur->next_;
+            cur = next;
         }
     }
 
@@ -67,7 +70,7 @@ public:
 
         if (FreeSpace() <= total_size)
         {
-            throw;
+            throw std::runtime_error("no space");
         }
 
         Node* new_node = new(free_area_begin_) Node{tail_, nullptr, key.size(), value.size()};
@@ -134,7 +137,7 @@ public:
 private:
     std::unordered_map<std::string_view, Node*, THasher> hash_map_;
 
-    std::unique_ptr<std::byte> buffer_ = nullptr;
+    std::unique_ptr<std::byte[]> buffer_ = nullptr;
     const std::byte* buffer_end_ = nullptr;
     std::byte* free_area_begin_ = nullptr;
 
@@ -204,6 +207,16 @@ public:
         return hash_map_.Get(key);
     }
 
+    size_t FreeSpace() const
+    {
+        return hash_map_.FreeSpace();
+    }
+
+    size_t TotalSpace() const
+    {
+        return hash_map_.TotalSpace();
+    }
+
 private:
     TStringHashMap<TMoveObserver, THasher> hash_map_;
     // vector[index] -> &value
@@ -215,9 +228,9 @@ private:
 
 class TCleaner {
 public:
-    void OnElementAdd(size_t index, Node* valueView)
+    void OnElementAdd(size_t index, [[maybe_unused]] Node* valueView)
     {
-        if (index > stats_.size())
+        if (index >= stats_.size())
         {
             stats_.resize(index + 1);
         }
@@ -259,7 +272,7 @@ public:
 private:
 
     std::vector<EntryStat> stats_;
-    size_t cur_epoch_;
+    size_t cur_epoch_ = 0;
 };
 
 
@@ -287,6 +300,16 @@ private:
          return result;
      }
 
+     size_t FreeSpace() const
+     {
+         return str_hash_map_.FreeSpace();
+     }
+
+     size_t TotalSpace() const
+     {
+         return str_hash_map_.TotalSpace();
+     }
+
      // Упрощение - делать все в Insert. Если места мало - падать
 //     void DoHeavyWork()
 
@@ -300,7 +323,7 @@ private:
  class TStateCache {
  public:
 
-     TStateCache(size_t size, size_t epochsToMandatoryStore, TCleaner& cleaner) :
+     TStateCache(size_t size, [[maybe_unused]] size_t epochsToMandatoryStore, TCleaner& cleaner) :
      str_cache_{size, cleaner},
      cleaner_{cleaner}
      {
@@ -322,6 +345,16 @@ private:
          cleaner_.set_epoch(epoch);
      }
 
+     size_t FreeSpace() const
+     {
+         return str_cache_.FreeSpace();
+     }
+
+     size_t TotalSpace() const
+     {
+         return str_cache_.TotalSpace();
+     }
+
  private:
      TStringCache<TCleaner> str_cache_;
      TCleaner& cleaner_;
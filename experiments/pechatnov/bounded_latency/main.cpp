@@ -3,6 +3,16 @@
 #include <span>
 #include <unordered_map>
 #include <cstring>
+#include <cassert>
+#include <stdexcept>
+
+#include "../one_block/mmap_buffer.h"
+
+#ifdef NDEBUG
+    #define verify(flag) do { if (!(flag)) { abort(); } } while (false)
+#else
+    #define verify assert
+#endif
 
 using namespace std::literals::string_view_literals;
 
@@ -54,6 +64,16 @@ public:
     {
         return ElementsCount_;
     }
+
+    double FillRate()
+    {
+        return 0;
+    }
+
+    uint64_t DefragmentatedBytes()
+    {
+        return 0;
+    }
 private:
     // Easy
     TIndex CurrentIndex_ = 0;
@@ -71,14 +91,18 @@ public:
     static inline constexpr TIndex NilIndex = static_cast<TIndex>(-1);
     static inline constexpr TValue NilValue = {static_cast<char*>(nullptr), 0u};
 
-    TBlobStringsStorage(uint64_t bufferSize)
-    {
-        Data_.resize(bufferSize);
-    }
+    TBlobStringsStorage(uint64_t bufferSize, TBufferOptions bufferOptions = TBufferOptions())
+        : Data_(bufferSize, bufferOptions)
+    { }
 
     std::pair<TValue, TIndex> Allocate(uint64_t size)
     {
+        const uint64_t fullSize = sizeof(THeader) + RoundValueSize(size);
+        if (fullSize > Data_.size() - OccupiedSpace_) {
+            throw std::runtime_error("no space");
+        }
         ElementsCount_ += 1;
+        OccupiedSpace_ += fullSize;
         const auto idx = AllocateIndex();
         // std::cerr << "Allocated index (Index: " << idx << ")" << std::endl;
         Insert(idx, rand(), size, RootIndex_, Data_.data(), Data_.data() + Data_.size());
@@ -99,6 +123,7 @@ public:
         if (index >= Positions_.size() || Positions_[index] < 0) {
             return false;
         }
+        OccupiedSpace_ -= sizeof(THeader) + RoundValueSize(GetHeader(index).ValueSize);
         Erase(index, RootIndex_);
         FreeIndex(index);
         --ElementsCount_;
@@ -110,15 +135,34 @@ public:
     {
         return ElementsCount_;
     }
+
+    double FillRate()
+    {
+        return static_cast<double>(OccupiedSpace_) / Data_.size();
+    }
+
+    uint64_t DefragmentatedBytes()
+    {
+        return DefragmentatedBytes_;
+    }
 private:
 
-    struct __attribute__ ((__packed__)) alignas(TIndex) THeader {
+    static constexpr uint64_t RoundValueSize(uint64_t valueSize)
+    {
+        return (valueSize + 3) & ~3ull;
+    }
+
+    struct __attribute__ ((__packed__)) TPackedFields {
         uint64_t LeftInnerFreeSpace : 37; // Computable.
         uint64_t RightInnerFreeSpace : 37; // Computable.
         uint64_t FirstSubtreeOffset : 37; // Computable.
         uint64_t LastSubtreeOffset : 37; // Computable.
         uint64_t ValueSize : 37; // Const.
         uint64_t HeapPriority : 39; // Const.
+    };
+
+    // Tree links are kept out of the packed part: they are passed around as `TIndex&`.
+    struct THeader : TPackedFields {
         TIndex LeftIndex; // Tree structure.
         TIndex RightIndex; // Tree structure.
 
@@ -323,10 +367,9 @@ private:
 
     char* HardSplit(uint64_t size, TIndex root, TIndex& left, TIndex& right, char* first, char* last)
     {
-        const uint64_t freeSpace = GetFreeSpace(root, first, last);
-        assert(freeSpace >= size);
+        assert(GetFreeSpace(root, first, last) >= size);
         if (root == NilIndex) {
-            assert(last - first >= size);
+            assert(static_cast<uint64_t>(last - first) >= size);
             left = NilIndex;
             right = NilIndex;
             return first;
@@ -376,6 +419,7 @@ private:
         if (first != header.GetFirstPosition()) {
             Positions_[root] = first - Data_.data();
             std::memmove(first, header.GetFirstPosition(), fullSize); // Now `header` is invalid.
+            DefragmentatedBytes_ += fullSize;
         }
         first += fullSize;
     }
@@ -425,7 +469,7 @@ private:
     }
 
 private:
-    std::vector<char> Data_;
+    TMmapBuffer Data_;
 
     // Overhead per one element is sizeof(char*) * 3 / 2 = 12.
     // Positions_[idx] >= 0 -> it is a position of idx node in Data_,
@@ -435,6 +479,8 @@ private:
     TIndex FirstFreeIndex_ = NilIndex;
 
     uint64_t ElementsCount_ = 0;
+    uint64_t OccupiedSpace_ = 0;
+    uint64_t DefragmentatedBytes_ = 0;
 };
 
 using TStringsStorage = TBlobStringsStorage;
@@ -453,7 +499,7 @@ void SS_SimpleTest()
     static auto check = [&](TStringsStorage::TIndex index) {
         auto value = storage.Get(index);
         for (auto& e : value) {
-            assert(e == index);
+            verify(e == static_cast<char>(index));
         }
     };
 
@@ -503,7 +549,10 @@ public:
 
         const uint64_t keyHash = Hash(key);
         const uint64_t bucket = keyHash % HashTable_.size();
-        EraseFromBucket(bucket, keyHash, key); // Remove old element if exists.
+        auto erasedIdx = EraseFromBucket(bucket, keyHash, key); // Remove old element if exists.
+        if (erasedIdx != NilIndex) {
+            Storage_.Free(erasedIdx);
+        }
 
         auto [sval, idx] = Storage_.Allocate(CalculateSize(key.size(), valueSize));
         THeader& header = GetHeader(sval);
@@ -546,8 +595,7 @@ public:
         if (erasedIdx == NilIndex) {
             return false;
         }
-        bool success = Storage_.Free(erasedIdx);
-        assert(success);
+        verify(Storage_.Free(erasedIdx));
         return true;;
     }
 
@@ -561,13 +609,27 @@ public:
         auto erasedIdx = EraseFromBucket(header.KeyHash % HashTable_.size(), header.KeyHash, GetKey(sval));
         assert(index == erasedIdx);
 
-        bool success = Storage_.Free(erasedIdx);
-        assert(success);
+        verify(Storage_.Free(erasedIdx));
         return true;
     }
 
+    uint64_t ElementsCount()
+    {
+        return Storage_.ElementsCount();
+    }
+
+    double FillRate()
+    {
+        return Storage_.FillRate();
+    }
+
+    uint64_t DefragmentatedBytes()
+    {
+        return Storage_.DefragmentatedBytes();
+    }
+
 private:
-    struct __attribute__ ((__packed__)) alignas(TIndex) THeader
+    struct __attribute__ ((__packed__, __aligned__(alignof(TIndex)))) THeader
     {
         static constexpr uint64_t KeyHashMask = (1ull << 56) - 1;
 
@@ -669,16 +731,16 @@ private:
 void SSHM_SimpleTest()
 {
     TStrStrHashMap m(1000000);
-    auto [val1, idx1] = m.Put("key1", "value1");
-    assert(m.Get("key1").first == "value1"sv);
+    m.Put("key1", "value1");
+    verify(m.Get("key1").first == "value1"sv);
     auto [val2, idx2] = m.Put("key2", "value2");
-    assert(m.Get("key2").first == "value2"sv);
-    assert(m.Erase("key1"));
-    assert(m.Get("key1").first.data() == nullptr);
-    assert(!m.Erase("key1"));
-    assert(m.Erase(idx2));
-    assert(m.Get("key2").first.data() == nullptr);
-    assert(!m.Erase(idx2));
+    verify(m.Get("key2").first == "value2"sv);
+    verify(m.Erase("key1"));
+    verify(m.Get("key1").first.data() == nullptr);
+    verify(!m.Erase("key1"));
+    verify(m.Erase(idx2));
+    verify(m.Get("key2").first.data() == nullptr);
+    verify(!m.Erase(idx2));
 
     for (int i = 0; i < 98; ++i) {
         auto val = m.PutUnitialized(std::to_string(i), 10000).first;
@@ -689,11 +751,11 @@ void SSHM_SimpleTest()
     for (int i = 0; i < 98; ++i) {
         auto val = m.Get(std::to_string(i)).first;
         for (auto& e : val) {
-            assert(e == i);
+            verify(e == i);
         }
     }
     for (int i = 0; i < 98; i += 2) {
-        assert(m.Erase(std::to_string(i)));
+        verify(m.Erase(std::to_string(i)));
     }
     for (int i = 0; i < 98; i += 2) {
         auto val = m.PutUnitialized(std::to_string(i), 10000).first;
@@ -704,11 +766,11 @@ void SSHM_SimpleTest()
     for (int i = 0; i < 98; ++i) {
         auto val = m.Get(std::to_string(i)).first;
         for (auto& e : val) {
-            assert(e == i);
+            verify(e == i);
         }
     }
     for (int i = 0; i < 98; i += 2) {
-        assert(m.Erase(std::to_string(i)));
+        verify(m.Erase(std::to_string(i)));
     }
     for (int i = 100; i < 120; ++i) {
         auto val = m.PutUnitialized(std::to_string(i), 20000).first;
@@ -719,12 +781,12 @@ void SSHM_SimpleTest()
     for (int i = 1; i < 98; i += 2) {
         auto val = m.Get(std::to_string(i)).first;
         for (auto& e : val) {
-            assert(e == i);
+            verify(e == i);
         }
     }
 }
 
-
+#ifndef EXPERIMENT_NO_MAIN
 int main()
 {
     std::cerr << "Start tests" << std::endl;
@@ -736,3 +798,4 @@ int main()
     std::cerr << "Finish" << std::endl;
     return 0;
 }
+#endif
@@ -0,0 +1,1000 @@
+// Epoch-segmented storage for LRA (least recently added) eviction by epochs, as in dkudimov TStateCache.
+// The buffer is split into fixed-size segments, a segment holds allocations of one epoch, appended one after another.
+// An expired epoch is dropped by returning its segments to the free list whole, without visiting its elements,
+// so it costs O(segments of the epoch) and does not depend on the cache size. Indexes of dropped elements stay taken
+// until the owner frees them, so the owner can invalidate its references to them lazily.
+
+#ifndef EXPERIMENT_NO_MAIN
+#define EXPERIMENT_NO_MAIN
+#define EPOCH_STORAGE_MAIN
+#endif
+
+#include "../one_block/main.cpp"
+
+#include <deque>
+#include <algorithm>
+
+class TEpochStringsStorage
+{
+public:
+    // Allocations never cross segment borders, so it also bounds the value size.
+    static constexpr uint64_t SegmentSize = 1 << 20;
+
+    using TIndex = uint32_t;
+    using TValue = std::span<char>;
+    static inline constexpr TIndex NilIndex = static_cast<TIndex>(-1);
+    static inline constexpr TValue NilValue = {static_cast<char*>(nullptr), 0u};
+
+    // `compactionBytesPerAllocation` bounds bytes moved out of sparse segments when `Allocate` needs a new segment,
+    // 0 means compaction only by `DoHeavyWork`.
+    TEpochStringsStorage(uint64_t bufferSize, uint64_t compactionBytesPerAllocation = 0,
+                         TBufferOptions bufferOptions = TBufferOptions())
+        : CompactionBytesPerAllocation_(compactionBytesPerAllocation)
+    {
+        if (bufferSize < SegmentSize) {
+            throw std::runtime_error("too small buffer size");
+        }
+        Data_ = TMmapBuffer(bufferSize / SegmentSize * SegmentSize, bufferOptions);
+        Segments_.resize(Data_.size() / SegmentSize);
+        Clear();
+    }
+
+    // Following allocations go to `epoch`. Epochs never go back.
+    void StartEpoch(uint64_t epoch)
+    {
+        if (epoch < CurrentEpoch()) {
+            throw std::runtime_error("epoch goes back");
+        }
+        if (epoch > CurrentEpoch()) {
+            // Only the current epoch keeps an open segment, so an old epoch does not hold an empty one.
+            SetOpenSegment(Epochs_.back(), NilSegment);
+            Epochs_.push_back(TEpoch{.Epoch = epoch});
+        }
+    }
+
+    uint64_t CurrentEpoch()
+    {
+        return Epochs_.back().Epoch;
+    }
+
+    uint64_t OldestEpoch()
+    {
+        return Epochs_.front().Epoch;
+    }
+
+    // Calls `func(index)` for every element allocated in `epoch`. `func` may free the element.
+    template <typename TFunc>
+    void ForEachInEpoch(uint64_t epoch, TFunc&& func)
+    {
+        auto it = std::lower_bound(Epochs_.begin(), Epochs_.end(), epoch,
+            [](const TEpoch& e, uint64_t epoch) { return e.Epoch < epoch; });
+        if (it == Epochs_.end() || it->Epoch != epoch) {
+            return;
+        }
+        uint32_t segmentIdx = it->FirstSegment;
+        while (segmentIdx != NilSegment) {
+            TSegment& segment = Segments_[segmentIdx];
+            const uint32_t nextSegmentIdx = segment.Next; // Segment is released when its last element is freed.
+            char* start = Data_.data() + segmentIdx * SegmentSize;
+            // Emptied open segment is reset to zero used bytes, that stops the loop too.
+            for (uint64_t pos = 0; pos < segment.UsedBytes;) {
+                THeader& header = *reinterpret_cast<THeader*>(start + pos);
+                pos += header.GetFullSize();
+                if (header.OwnIndex != NilIndex) {
+                    func(header.OwnIndex);
+                }
+            }
+            segmentIdx = nextSegmentIdx;
+        }
+    }
+
+    // Drops the oldest epoch with all its elements in O(its segments), elements are not visited.
+    // Their indexes are not reused until `Free`, `Get` returns NilValue for them. The current epoch is never dropped.
+    bool DropOldestEpoch()
+    {
+        if (Epochs_.size() == 1) {
+            return false;
+        }
+        TEpoch& epoch = Epochs_.front();
+        while (epoch.FirstSegment != NilSegment) {
+            OccupiedSpace_ -= Segments_[epoch.FirstSegment].LiveBytes;
+            ReleaseSegment(epoch.FirstSegment);
+        }
+        ElementsCount_ -= epoch.ElementsCount;
+        Epochs_.pop_front();
+        return true;
+    }
+
+    // Element was allocated in a dropped epoch and its index is not freed yet.
+    bool IsDropped(TIndex index)
+    {
+        return index < Positions_.size() && Positions_[index] >= 0 && IndexEpochs_[index] < OldestEpoch();
+    }
+
+    // Releases segments of the oldest epoch if it has no elements left. The current epoch is never released.
+    bool PopOldestEpoch()
+    {
+        TEpoch& epoch = Epochs_.front();
+        if (Epochs_.size() == 1 || epoch.ElementsCount != 0) {
+            return false;
+        }
+        while (epoch.FirstSegment != NilSegment) {
+            ReleaseSegment(epoch.FirstSegment);
+        }
+        Epochs_.pop_front();
+        return true;
+    }
+
+    bool HasSpaceFor(uint64_t size)
+    {
+        const uint64_t fullSize = GetFullSize(size);
+        return fullSize <= SegmentSize && (FitsOpenSegment(Epochs_.back(), fullSize) || FirstFreeSegment_ != NilSegment);
+    }
+
+    std::pair<TValue, TIndex> Allocate(uint64_t size)
+    {
+        const uint64_t fullSize = GetFullSize(size);
+        if (fullSize > SegmentSize) {
+            throw std::runtime_error("too large value");
+        }
+        TEpoch& epoch = Epochs_.back();
+        if (!FitsOpenSegment(epoch, fullSize) && CompactionBytesPerAllocation_ != 0) {
+            Compact(CompactionBytesPerAllocation_); // May also squeeze a segment of the epoch and open it.
+        }
+        if (!FitsOpenSegment(epoch, fullSize)) {
+            if (FirstFreeSegment_ == NilSegment) {
+                throw std::runtime_error("no space");
+            }
+            OpenSegment(epoch);
+        }
+
+        const auto idx = AllocateIndex();
+        THeader& header = Append(epoch, fullSize);
+        header.ValueSize = size;
+        header.OwnIndex = idx;
+        Positions_[idx] = reinterpret_cast<char*>(&header) - Data_.data();
+        IndexEpochs_[idx] = epoch.Epoch;
+        ++epoch.ElementsCount;
+        ++ElementsCount_;
+        return {GetValue(idx), idx};
+    }
+
+    TValue Get(TIndex index)
+    {
+        if (index >= Positions_.size() || Positions_[index] < 0 || IndexEpochs_[index] < OldestEpoch()) {
+            return NilValue;
+        }
+        return GetValue(index);
+    }
+
+    // Index of a dropped element is only returned to the free list, the result is false as the element is gone.
+    bool Free(TIndex index)
+    {
+        if (index >= Positions_.size() || Positions_[index] < 0) {
+            return false;
+        }
+        if (IsDropped(index)) {
+            FreeIndex(index);
+            return false;
+        }
+        const uint32_t segmentIdx = Positions_[index] / SegmentSize;
+        TSegment& segment = Segments_[segmentIdx];
+        THeader& header = GetHeader(index);
+        header.OwnIndex = NilIndex; // Space stays in the segment until it is emptied or compacted.
+        segment.LiveBytes -= header.GetFullSize();
+        OccupiedSpace_ -= header.GetFullSize();
+        --segment.Epoch->ElementsCount;
+        --ElementsCount_;
+        FreeIndex(index);
+
+        if (segment.LiveBytes == 0) {
+            if (segment.Epoch == &Epochs_.back() && segmentIdx == segment.Epoch->OpenSegment) {
+                segment.UsedBytes = 0;
+            } else {
+                ReleaseSegment(segmentIdx);
+            }
+        } else {
+            MaybeMarkSparse(segmentIdx);
+        }
+        return true;
+    }
+
+    uint64_t ElementsCount()
+    {
+        return ElementsCount_;
+    }
+
+    // Current epoch is kept.
+    void Clear()
+    {
+        const uint64_t epoch = Epochs_.empty() ? 0 : CurrentEpoch();
+        ElementsCount_ = 0;
+        OccupiedSpace_ = 0;
+        Positions_.clear();
+        IndexEpochs_.clear();
+        FirstFreeIndex_ = NilIndex;
+        Epochs_.clear();
+        Epochs_.push_back(TEpoch{.Epoch = epoch});
+        SparseSegments_.clear();
+        FirstFreeSegment_ = NilSegment;
+        for (uint32_t i = Segments_.size(); i-- > 0;) {
+            Segments_[i] = TSegment{.Next = FirstFreeSegment_};
+            FirstFreeSegment_ = i;
+        }
+    }
+
+    double FillRate()
+    {
+        return static_cast<double>(OccupiedSpace_) / Data_.size();
+    }
+
+    uint64_t DefragmentatedBytes()
+    {
+        return DefragmentatedBytes_;
+    }
+
+    // Moves elements out of sparse segments for about `byteBudget` bytes.
+    // Returns false when there is nothing to compact or no free segment to compact to.
+    bool DoHeavyWork(uint64_t byteBudget)
+    {
+        return Compact(byteBudget);
+    }
+
+private:
+    static constexpr uint32_t NilSegment = static_cast<uint32_t>(-1);
+    // Segment is compacted when less than 1/SparseRatio of it is alive.
+    static constexpr uint64_t SparseRatio = 2;
+
+    struct THeader
+    {
+        uint32_t ValueSize;
+        TIndex OwnIndex; // NilIndex for freed elements.
+
+        uint64_t GetFullSize()
+        {
+            return GetFullSize(ValueSize);
+        }
+
+        static uint64_t GetFullSize(uint64_t valueSize)
+        {
+            return sizeof(THeader) + ((valueSize + 3) & ~3ull); // Values are aligned as the map header needs.
+        }
+    };
+
+    struct TEpoch
+    {
+        uint64_t Epoch = 0;
+        uint64_t ElementsCount = 0;
+        uint32_t FirstSegment = NilSegment;
+        // The one allocations are appended to. Old epochs get one only to compact their sparse segments.
+        uint32_t OpenSegment = NilSegment;
+    };
+
+    struct TSegment
+    {
+        TEpoch* Epoch = nullptr; // Null for free segments. Epochs_ is a deque, so pointers survive push_back/pop_front.
+        uint32_t UsedBytes = 0;
+        uint32_t LiveBytes = 0;
+        uint32_t Prev = NilSegment; // In the list of the epoch.
+        uint32_t Next = NilSegment; // In the list of the epoch or in the free list.
+        bool InSparseList = false;
+    };
+
+    static uint64_t GetFullSize(uint64_t valueSize)
+    {
+        return THeader::GetFullSize(valueSize);
+    }
+
+    bool FitsOpenSegment(TEpoch& epoch, uint64_t fullSize)
+    {
+        return epoch.OpenSegment != NilSegment && Segments_[epoch.OpenSegment].UsedBytes + fullSize <= SegmentSize;
+    }
+
+    THeader& Append(TEpoch& epoch, uint64_t fullSize)
+    {
+        TSegment& segment = Segments_[epoch.OpenSegment];
+        THeader& header = *reinterpret_cast<THeader*>(Data_.data() + epoch.OpenSegment * SegmentSize + segment.UsedBytes);
+        segment.UsedBytes += fullSize;
+        segment.LiveBytes += fullSize;
+        OccupiedSpace_ += fullSize;
+        return header;
+    }
+
+    void OpenSegment(TEpoch& epoch)
+    {
+        const uint32_t segmentIdx = FirstFreeSegment_;
+        TSegment& segment = Segments_[segmentIdx];
+        FirstFreeSegment_ = segment.Next;
+        segment = TSegment{.Epoch = &epoch, .Next = epoch.FirstSegment, .InSparseList = segment.InSparseList};
+        if (epoch.FirstSegment != NilSegment) {
+            Segments_[epoch.FirstSegment].Prev = segmentIdx;
+        }
+        epoch.FirstSegment = segmentIdx;
+        SetOpenSegment(epoch, segmentIdx);
+    }
+
+    void SetOpenSegment(TEpoch& epoch, uint32_t segmentIdx)
+    {
+        const uint32_t closedSegmentIdx = std::exchange(epoch.OpenSegment, segmentIdx);
+        if (closedSegmentIdx == NilSegment || closedSegmentIdx == segmentIdx) {
+            return;
+        }
+        if (Segments_[closedSegmentIdx].LiveBytes == 0) {
+            ReleaseSegment(closedSegmentIdx);
+        } else {
+            MaybeMarkSparse(closedSegmentIdx);
+        }
+    }
+
+    void ReleaseSegment(uint32_t segmentIdx)
+    {
+        TSegment& segment = Segments_[segmentIdx];
+        TEpoch& epoch = *segment.Epoch;
+        (segment.Prev == NilSegment ? epoch.FirstSegment : Segments_[segment.Prev].Next) = segment.Next;
+        if (segment.Next != NilSegment) {
+            Segments_[segment.Next].Prev = segment.Prev;
+        }
+        if (epoch.OpenSegment == segmentIdx) {
+            epoch.OpenSegment = NilSegment;
+        }
+        // Stays in SparseSegments_ if it is there, `Compact` skips it while it is free.
+        segment = TSegment{.Next = FirstFreeSegment_, .InSparseList = segment.InSparseList};
+        FirstFreeSegment_ = segmentIdx;
+    }
+
+    bool IsSparse(uint32_t segmentIdx)
+    {
+        const TSegment& segment = Segments_[segmentIdx];
+        return segment.Epoch != nullptr && segment.Epoch->OpenSegment != segmentIdx
+            && segment.LiveBytes * SparseRatio < SegmentSize;
+    }
+
+    void MaybeMarkSparse(uint32_t segmentIdx)
+    {
+        TSegment& segment = Segments_[segmentIdx];
+        if (!segment.InSparseList && IsSparse(segmentIdx)) {
+            segment.InSparseList = true;
+            SparseSegments_.push_back(segmentIdx);
+        }
+    }
+
+    // Moves live elements of sparse segments to open segments of the same epochs, so epochs stay grouped.
+    // A sparse segment goes to the open segment, or to a new one that it frees in exchange.
+    // Without free segments it is squeezed in place and opened, so the next sparse segment of the epoch fits into it.
+    bool Compact(uint64_t byteBudget)
+    {
+        uint64_t movedBytes = 0;
+        while (!SparseSegments_.empty() && movedBytes < byteBudget) {
+            const uint32_t segmentIdx = SparseSegments_.back();
+            SparseSegments_.pop_back();
+            Segments_[segmentIdx].InSparseList = false;
+            if (!IsSparse(segmentIdx)) {
+                continue; // Released, reopened or refilled since it was marked.
+            }
+            TEpoch& epoch = *Segments_[segmentIdx].Epoch;
+            if (FitsOpenSegment(epoch, Segments_[segmentIdx].LiveBytes)) {
+                movedBytes += MoveLiveElements(segmentIdx, epoch);
+                ReleaseSegment(segmentIdx);
+            } else if (FirstFreeSegment_ != NilSegment) {
+                OpenSegment(epoch);
+                movedBytes += MoveLiveElements(segmentIdx, epoch);
+                ReleaseSegment(segmentIdx);
+            } else {
+                SetOpenSegment(epoch, segmentIdx);
+                movedBytes += MoveLiveElements(segmentIdx, epoch);
+            }
+        }
+        return !SparseSegments_.empty();
+    }
+
+    // Appends live elements of the segment to the open segment of `epoch`, that may be the segment itself.
+    uint64_t MoveLiveElements(uint32_t segmentIdx, TEpoch& epoch)
+    {
+        TSegment& segment = Segments_[segmentIdx];
+        const uint64_t usedBytes = segment.UsedBytes;
+        if (epoch.OpenSegment == segmentIdx) {
+            OccupiedSpace_ -= segment.LiveBytes; // Append counts them again.
+            segment.UsedBytes = 0;
+            segment.LiveBytes = 0;
+        }
+        char* start = Data_.data() + segmentIdx * SegmentSize;
+        uint64_t movedBytes = 0;
+        for (uint64_t pos = 0; pos < usedBytes;) {
+            THeader& header = *reinterpret_cast<THeader*>(start + pos);
+            const uint64_t fullSize = header.GetFullSize();
+            pos += fullSize;
+            if (header.OwnIndex == NilIndex) {
+                continue;
+            }
+            THeader& newHeader = Append(epoch, fullSize);
+            if (&newHeader == &header) {
+                continue;
+            }
+            std::memmove(&newHeader, &header, fullSize); // Overlaps when squeezed in place.
+            Positions_[newHeader.OwnIndex] = reinterpret_cast<char*>(&newHeader) - Data_.data();
+            movedBytes += fullSize;
+            if (epoch.OpenSegment != segmentIdx) {
+                OccupiedSpace_ -= fullSize;
+            }
+        }
+        DefragmentatedBytes_ += movedBytes;
+        return movedBytes;
+    }
+
+    TIndex AllocateIndex()
+    {
+        if (FirstFreeIndex_ == NilIndex) {
+            TIndex idx = Positions_.size();
+            Positions_.resize(std::max<size_t>(Positions_.size(), 2u) * 3 / 2);
+            IndexEpochs_.resize(Positions_.size());
+            for (; idx < Positions_.size(); idx++) {
+                FreeIndex(idx);
+            }
+        }
+        auto idx = FirstFreeIndex_;
+        FirstFreeIndex_ = -(Positions_[idx] + 2);
+        return idx;
+    }
+
+    void FreeIndex(TIndex index)
+    {
+        Positions_[index] = -static_cast<int64_t>(FirstFreeIndex_ + 2);
+        FirstFreeIndex_ = index;
+    }
+
+    THeader& GetHeader(TIndex index)
+    {
+        assert(index < Positions_.size() && Positions_[index] >= 0);
+        return *reinterpret_cast<THeader*>(Data_.data() + Positions_[index]);
+    }
+
+    TValue GetValue(TIndex index)
+    {
+        return {Data_.data() + Positions_[index] + sizeof(THeader), GetHeader(index).ValueSize};
+    }
+
+private:
+    const uint64_t CompactionBytesPerAllocation_;
+    TMmapBuffer Data_;
+    std::vector<TSegment> Segments_;
+    uint32_t FirstFreeSegment_ = NilSegment;
+    std::vector<uint32_t> SparseSegments_; // Candidates for compaction, may be stale.
+    std::deque<TEpoch> Epochs_; // The oldest first. Never empty, the last one is current.
+    std::vector<int64_t> Positions_; // Negative values encode the free index list.
+    std::vector<uint64_t> IndexEpochs_; // Epoch of the element, to tell dropped ones.
+    TIndex FirstFreeIndex_ = NilIndex;
+    uint64_t ElementsCount_ = 0;
+    uint64_t OccupiedSpace_ = 0;
+    uint64_t DefragmentatedBytes_ = 0;
+};
+
+// LRA cache by epochs with TStateCache interface. Elements of the last `epochsToMandatoryStore` epochs are kept,
+// older epochs are dropped whole, the oldest first, when there is no space for a new element.
+// The index is open addressing over storage indexes. A dropped epoch leaves stale slots, they are released lazily:
+// when a probe passes them or on rehash. So the drop itself does not touch the index.
+template <typename THasher = std::hash<std::string_view>>
+class TEpochStateCache
+{
+public:
+    using TIndex = TEpochStringsStorage::TIndex;
+    using TValue = TEpochStringsStorage::TValue;
+
+    TEpochStateCache(uint64_t bufferSize, uint64_t epochsToMandatoryStore, uint64_t compactionBytesPerAllocation = 0,
+                     THasher hasher = THasher())
+        : Storage_(bufferSize, compactionBytesPerAllocation)
+        , Hasher_(std::move(hasher))
+        , EpochsToMandatoryStore_(epochsToMandatoryStore)
+    {
+        if (epochsToMandatoryStore == 0) {
+            throw std::runtime_error("current epoch must be stored");
+        }
+        Slots_.assign(MinSlotsCount, TSlot{});
+    }
+
+    // Throws "no space" if mandatory epochs take all the buffer.
+    void Insert(std::string_view key, std::string_view value, uint64_t epoch)
+    {
+        if (epoch > CurrentEpoch()) {
+            StartNewEpoch(epoch);
+        }
+        const uint64_t keyHash = Hasher_(key);
+        EraseSlot(FindSlot(keyHash, key)); // Reinserted element belongs to the current epoch, and its space may be enough.
+        const uint64_t size = sizeof(THeader) + key.size() + value.size();
+        while (!Storage_.HasSpaceFor(size) && DropOldestExpiredEpoch()) {
+        }
+
+        if ((FullSlotsCount_ + DeletedSlotsCount_ + 1) * 8 > Slots_.size() * 7) {
+            // Stale slots are released by rehash, so grow only if live elements take more than a half of the max load.
+            Rehash((Storage_.ElementsCount() + 1) * 2 * 8 > Slots_.size() * 7 ? Slots_.size() * 2 : Slots_.size());
+        }
+
+        auto [sval, idx] = Storage_.Allocate(size);
+        GetHeader(sval).KeySize = key.size();
+        std::memcpy(sval.data() + sizeof(THeader), key.data(), key.size());
+        std::memcpy(sval.data() + sizeof(THeader) + key.size(), value.data(), value.size());
+        InsertSlot(keyHash, idx);
+    }
+
+    std::optional<std::string_view> Get(std::string_view key)
+    {
+        const TSlot* slot = FindSlot(Hasher_(key), key);
+        if (slot == nullptr) {
+            return std::nullopt;
+        }
+        return GetValue(Storage_.Get(slot->Index));
+    }
+
+    bool Erase(std::string_view key)
+    {
+        return EraseSlot(FindSlot(Hasher_(key), key));
+    }
+
+    void StartNewEpoch(uint64_t epoch)
+    {
+        Storage_.StartEpoch(epoch);
+        while (Storage_.PopOldestEpoch()) { // Epochs emptied by reinserts only hold open segments.
+        }
+    }
+
+    uint64_t CurrentEpoch()
+    {
+        return Storage_.CurrentEpoch();
+    }
+
+    // O(segments of the dropped epoch), its elements are not visited. Returns false if the oldest epoch is mandatory.
+    bool DropOldestExpiredEpoch()
+    {
+        if (CurrentEpoch() - Storage_.OldestEpoch() < EpochsToMandatoryStore_) {
+            return false;
+        }
+        const bool dropped = Storage_.DropOldestEpoch();
+        verify(dropped);
+        return true;
+    }
+
+    uint64_t ElementsCount()
+    {
+        return Storage_.ElementsCount();
+    }
+
+    double FillRate()
+    {
+        return Storage_.FillRate();
+    }
+
+    uint64_t DefragmentatedBytes()
+    {
+        return Storage_.DefragmentatedBytes();
+    }
+
+    bool DoHeavyWork(uint64_t byteBudget)
+    {
+        return Storage_.DoHeavyWork(byteBudget);
+    }
+
+    // Slots, including stale ones of dropped elements.
+    uint64_t IndexBytes()
+    {
+        return Slots_.capacity() * sizeof(TSlot);
+    }
+
+private:
+    static constexpr uint64_t MinSlotsCount = 16;
+    static constexpr TIndex EmptySlot = TEpochStringsStorage::NilIndex;
+    static constexpr TIndex DeletedSlot = TEpochStringsStorage::NilIndex - 1;
+
+    struct THeader
+    {
+        uint32_t KeySize;
+    };
+
+    // Hash is kept in the slot, so rehash does not read entries and does not need them for stale slots.
+    struct TSlot
+    {
+        uint64_t KeyHash = 0;
+        TIndex Index = EmptySlot;
+    };
+
+    THeader& GetHeader(TValue svalue)
+    {
+        return *reinterpret_cast<THeader*>(svalue.data());
+    }
+
+    std::string_view GetKey(TValue svalue)
+    {
+        return {svalue.data() + sizeof(THeader), GetHeader(svalue).KeySize};
+    }
+
+    std::string_view GetValue(TValue svalue)
+    {
+        const uint64_t offset = sizeof(THeader) + GetHeader(svalue).KeySize;
+        return {svalue.data() + offset, svalue.size() - offset};
+    }
+
+    bool IsFull(const TSlot& slot)
+    {
+        return slot.Index != EmptySlot && slot.Index != DeletedSlot;
+    }
+
+    // Turns the slot of a dropped element into a deleted one and frees its storage index.
+    bool ReleaseIfDropped(TSlot& slot)
+    {
+        if (!Storage_.IsDropped(slot.Index)) {
+            return false;
+        }
+        Storage_.Free(slot.Index);
+        slot.Index = DeletedSlot;
+        --FullSlotsCount_;
+        ++DeletedSlotsCount_;
+        return true;
+    }
+
+    // Linear probing, stops on an empty slot. Stale slots on the way are released.
+    TSlot* FindSlot(uint64_t keyHash, std::string_view key)
+    {
+        const uint64_t mask = Slots_.size() - 1;
+        for (uint64_t pos = keyHash & mask; ; pos = (pos + 1) & mask) {
+            TSlot& slot = Slots_[pos];
+            if (slot.Index == EmptySlot) {
+                return nullptr;
+            }
+            if (slot.Index == DeletedSlot || ReleaseIfDropped(slot)) {
+                continue;
+            }
+            if (slot.KeyHash == keyHash && GetKey(Storage_.Get(slot.Index)) == key) {
+                return &slot;
+            }
+        }
+    }
+
+    bool EraseSlot(TSlot* slot)
+    {
+        if (slot == nullptr) {
+            return false;
+        }
+        verify(Storage_.Free(slot->Index));
+        slot->Index = DeletedSlot;
+        --FullSlotsCount_;
+        ++DeletedSlotsCount_;
+        return true;
+    }
+
+    void InsertSlot(uint64_t keyHash, TIndex idx)
+    {
+        const uint64_t mask = Slots_.size() - 1;
+        for (uint64_t pos = keyHash & mask; ; pos = (pos + 1) & mask) {
+            TSlot& slot = Slots_[pos];
+            if (!IsFull(slot) || ReleaseIfDropped(slot)) {
+                DeletedSlotsCount_ -= slot.Index == DeletedSlot;
+                slot = TSlot{.KeyHash = keyHash, .Index = idx};
+                ++FullSlotsCount_;
+                return;
+            }
+        }
+    }
+
+    void Rehash(uint64_t slotsCount)
+    {
+        auto oldSlots = std::move(Slots_);
+        Slots_.assign(slotsCount, TSlot{});
+        FullSlotsCount_ = 0;
+        DeletedSlotsCount_ = 0;
+        for (const TSlot& slot : oldSlots) {
+            if (!IsFull(slot)) {
+                continue;
+            }
+            if (Storage_.IsDropped(slot.Index)) {
+                Storage_.Free(slot.Index);
+                continue;
+            }
+            InsertSlot(slot.KeyHash, slot.Index);
+        }
+    }
+
+private:
+    TEpochStringsStorage Storage_;
+    THasher Hasher_;
+    const uint64_t EpochsToMandatoryStore_;
+    std::vector<TSlot> Slots_; // Power of two.
+    uint64_t FullSlotsCount_ = 0; // Live and stale.
+    uint64_t DeletedSlotsCount_ = 0;
+};
+
+void ES_SimpleTest()
+{
+    TEpochStringsStorage storage(4 * TEpochStringsStorage::SegmentSize);
+    bool thrown = false;
+    try {
+        storage.Allocate(TEpochStringsStorage::SegmentSize);
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    verify(thrown);
+
+    std::vector<std::vector<TEpochStringsStorage::TIndex>> epochIndexes(3);
+    for (uint64_t epoch = 0; epoch < epochIndexes.size(); ++epoch) {
+        storage.StartEpoch(epoch);
+        for (int i = 0; i < 100; ++i) {
+            auto [val, idx] = storage.Allocate(1000 + i);
+            std::fill(val.begin(), val.end(), static_cast<char>(epoch * 100 + i));
+            epochIndexes[epoch].push_back(idx);
+        }
+    }
+    verify(storage.ElementsCount() == 300);
+    verify(storage.OldestEpoch() == 0 && storage.CurrentEpoch() == 2);
+
+    // Every second element of epoch 1 is freed, only the rest is visited.
+    for (size_t i = 0; i < epochIndexes[1].size(); i += 2) {
+        verify(storage.Free(epochIndexes[1][i]));
+        verify(!storage.Free(epochIndexes[1][i]));
+    }
+    std::vector<TEpochStringsStorage::TIndex> visited;
+    storage.ForEachInEpoch(1, [&](auto idx) { visited.push_back(idx); });
+    verify(visited.size() == 50);
+    for (size_t i = 0; i < visited.size(); ++i) {
+        verify(visited[i] == epochIndexes[1][i * 2 + 1]);
+    }
+
+    // Epoch is popped only when it is empty.
+    verify(!storage.PopOldestEpoch());
+    storage.ForEachInEpoch(0, [&](auto idx) { verify(storage.Free(idx)); });
+    verify(storage.PopOldestEpoch());
+    verify(storage.OldestEpoch() == 1);
+    verify(storage.ElementsCount() == 150);
+
+    for (uint64_t epoch = 1; epoch < epochIndexes.size(); ++epoch) {
+        for (size_t i = epoch == 1 ? 1 : 0; i < epochIndexes[epoch].size(); i += epoch == 1 ? 2 : 1) {
+            auto val = storage.Get(epochIndexes[epoch][i]);
+            verify(val.size() == 1000 + i);
+            for (char c : val) {
+                verify(c == static_cast<char>(epoch * 100 + i));
+            }
+        }
+    }
+
+    // Space of the dropped epoch is reused, until all segments are taken.
+    storage.StartEpoch(3);
+    uint64_t allocated = 0;
+    while (storage.HasSpaceFor(100'000)) {
+        storage.Allocate(100'000);
+        ++allocated;
+    }
+    verify(allocated >= 20);
+    thrown = false;
+    try {
+        storage.Allocate(100'000);
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    verify(thrown);
+}
+
+void ES_CompactionTest()
+{
+    srand(45);
+    TEpochStringsStorage storage(8 * TEpochStringsStorage::SegmentSize, 64 << 10);
+    struct TExpected
+    {
+        TEpochStringsStorage::TIndex Index;
+        uint64_t Size;
+        char Fill;
+    };
+    std::vector<TExpected> expected;
+    for (int i = 0; i < 200'000; ++i) {
+        if (i % 20'000 == 0) {
+            storage.StartEpoch(i / 20'000);
+        }
+        const uint64_t size = rand() % 2000;
+        // Random frees leave sparse segments, that are compacted to get space.
+        while (!storage.HasSpaceFor(size) && !expected.empty()) {
+            std::swap(expected[rand() % expected.size()], expected.back());
+            verify(storage.Free(expected.back().Index));
+            expected.pop_back();
+            storage.DoHeavyWork(64 << 10);
+        }
+        auto [val, idx] = storage.Allocate(size);
+        std::fill(val.begin(), val.end(), static_cast<char>(i));
+        expected.push_back({idx, size, static_cast<char>(i)});
+    }
+    verify(storage.DefragmentatedBytes() > 0);
+    verify(storage.ElementsCount() == expected.size());
+    for (auto& e : expected) {
+        auto val = storage.Get(e.Index);
+        verify(val.size() == e.Size);
+        for (char c : val) {
+            verify(c == e.Fill);
+        }
+    }
+    std::cerr << "ES_CompactionTest (FillRate: " << storage.FillRate()
+        << ", DefragmentatedBytes: " << storage.DefragmentatedBytes() << ")" << std::endl;
+}
+
+void ES_DropEpochTest()
+{
+    TEpochStringsStorage storage(8 * TEpochStringsStorage::SegmentSize);
+    std::vector<std::vector<TEpochStringsStorage::TIndex>> epochIndexes(3);
+    for (uint64_t epoch = 0; epoch < epochIndexes.size(); ++epoch) {
+        storage.StartEpoch(epoch);
+        for (int i = 0; i < 1000; ++i) {
+            auto [val, idx] = storage.Allocate(2000);
+            std::fill(val.begin(), val.end(), static_cast<char>(epoch));
+            epochIndexes[epoch].push_back(idx);
+        }
+    }
+    const double fillRate = storage.FillRate();
+
+    // Elements of the dropped epoch are gone, but their indexes are not reused until freed.
+    verify(storage.DropOldestEpoch());
+    verify(storage.OldestEpoch() == 1);
+    verify(storage.ElementsCount() == 2000);
+    verify(std::abs(storage.FillRate() - fillRate * 2 / 3) < 1e-9);
+    for (auto idx : epochIndexes[0]) {
+        verify(storage.IsDropped(idx));
+        verify(storage.Get(idx).data() == nullptr);
+    }
+    storage.StartEpoch(3);
+    for (int i = 0; i < 100; ++i) {
+        const auto idx = storage.Allocate(2000).second;
+        verify(!storage.IsDropped(idx));
+        verify(std::find(epochIndexes[0].begin(), epochIndexes[0].end(), idx) == epochIndexes[0].end());
+    }
+    for (auto idx : epochIndexes[0]) {
+        verify(!storage.Free(idx));
+        verify(!storage.IsDropped(idx));
+    }
+    verify(storage.Allocate(2000).second == epochIndexes[0].back()); // Freed indexes are reused.
+
+    for (uint64_t epoch = 1; epoch < epochIndexes.size(); ++epoch) {
+        for (auto idx : epochIndexes[epoch]) {
+            for (char c : storage.Get(idx)) {
+                verify(c == static_cast<char>(epoch));
+            }
+        }
+    }
+
+    // The current epoch is never dropped.
+    verify(storage.DropOldestEpoch() && storage.DropOldestEpoch());
+    verify(!storage.DropOldestEpoch());
+    verify(storage.ElementsCount() == 101);
+}
+
+void ESC_LraTest()
+{
+    TEpochStateCache<> cache(16 * TEpochStringsStorage::SegmentSize, 2);
+    const std::string value(10'000, 'v');
+    const int epochElements = 300; // About 3 MB, so the buffer holds 5 epochs.
+    for (int epoch = 1; epoch <= 20; ++epoch) {
+        for (int i = 0; i < epochElements; ++i) {
+            cache.Insert(std::to_string(epoch * epochElements + i), value, epoch);
+        }
+        // Keys of the previous epoch are reinserted, so they move to the current one.
+        if (epoch > 1) {
+            for (int i = 0; i < epochElements / 2; ++i) {
+                const auto key = std::to_string((epoch - 1) * epochElements + i);
+                if (cache.Get(key)) {
+                    cache.Insert(key, value, epoch);
+                }
+            }
+        }
+        for (int i = 0; i < epochElements; ++i) {
+            verify(cache.Get(std::to_string(epoch * epochElements + i)) == value);
+            if (epoch > 1) {
+                verify(cache.Get(std::to_string((epoch - 1) * epochElements + i)) == value);
+            }
+        }
+    }
+    verify(!cache.Get(std::to_string(epochElements)));
+    verify(!cache.Erase(std::to_string(epochElements)));
+    verify(cache.ElementsCount() * value.size() < 16 * TEpochStringsStorage::SegmentSize);
+
+    // Stale slots of dropped epochs are reused, so the index is sized by live elements, not by all inserted keys.
+    const std::string smallValue(1000, 's');
+    for (int epoch = 21; epoch <= 60; ++epoch) {
+        for (int i = 0; i < 5000; ++i) {
+            cache.Insert(std::to_string(epoch * 5000 + i), smallValue, epoch);
+        }
+        verify(cache.Get(std::to_string(epoch * 5000)) == smallValue);
+    }
+    verify(cache.ElementsCount() < 16 * TEpochStringsStorage::SegmentSize / smallValue.size());
+    verify(cache.IndexBytes() <= (64 << 10) * 16);
+
+    TEpochStateCache<> smallCache(2 * TEpochStringsStorage::SegmentSize, 1);
+    bool thrown = false;
+    try {
+        for (int i = 0; i < 1000; ++i) {
+            smallCache.Insert(std::to_string(i), value, 1); // Single mandatory epoch does not fit.
+        }
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    verify(thrown);
+}
+
+#ifdef EPOCH_STORAGE_MAIN
+#include "../../../dkudimov/experiments/int.h"
+
+// Both sides expire the same data: one epoch of `EpochBytes` in 100 byte values, out of a full cache of `bufferSize`.
+static constexpr uint64_t EpochBytes = 16 << 20;
+static constexpr uint64_t ValueSize = 100;
+
+// `Now` has millisecond resolution, a bulk drop takes microseconds.
+double PreciseNow()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Fixed epoch size and growing cache size. The drop frees segments of the epoch, O(16 segments) here,
+// so it stays flat. Stale index slots are released by later inserts, their cost is in SecondsPerInsert.
+void BenchmarkDropEpoch(uint64_t bufferSize)
+{
+    const uint64_t epochsCount = bufferSize / EpochBytes * 7 / 8; // Epoch takes one more segment for tails.
+    TEpochStateCache<> cache(bufferSize, epochsCount);
+    const std::string value(ValueSize, 'v');
+    uint64_t key = 0;
+    double dropTime = 0;
+    double insertTime = 0;
+    uint64_t droppedEpochs = 0;
+    for (uint64_t epoch = 1; epoch <= epochsCount * 2; ++epoch) {
+        cache.StartNewEpoch(epoch);
+        auto start = PreciseNow();
+        while (cache.DropOldestExpiredEpoch()) {
+            ++droppedEpochs;
+        }
+        dropTime += PreciseNow() - start;
+        start = PreciseNow();
+        for (uint64_t bytes = 0; bytes < EpochBytes; bytes += value.size() + 32) {
+            cache.Insert(std::to_string(key++), value, epoch);
+        }
+        insertTime += PreciseNow() - start;
+    }
+    std::cerr << "DropEpoch (BufferSize: " << bufferSize << ", Elements: " << cache.ElementsCount()
+        << ", DroppedEpochs: " << droppedEpochs << ", SecondsPerDrop: " << dropTime / droppedEpochs
+        << ", SecondsPerInsert: " << insertTime / key << ")" << std::endl;
+}
+
+// dkudimov TStateCache side. Its TCleaner cannot name an expired entry (GetElementToRemove returns an epoch)
+// and TStateCache never removes anything, so its cheapest expiry is erasing the epoch entries one by one
+// by their iterators from the underlying TStringHashMapWithIterators, without any scan to find them.
+void BenchmarkStateCacheExpiry(uint64_t bufferSize)
+{
+    const uint64_t epochsCount = bufferSize / EpochBytes * 7 / 8;
+    TCleaner cleaner;
+    TStringHashMapWithIterators<TCleaner> map(bufferSize, cleaner);
+    const std::string value(ValueSize, 'v');
+    std::vector<uint64_t> epochFirstIter;
+    uint64_t key = 0;
+    for (uint64_t epoch = 1; epoch <= epochsCount; ++epoch) {
+        cleaner.set_epoch(epoch);
+        epochFirstIter.push_back(key);
+        for (uint64_t bytes = 0; bytes < EpochBytes; bytes += value.size() + 32) {
+            verify(map.Insert(std::to_string(key), value) == key);
+            ++key;
+        }
+    }
+    epochFirstIter.push_back(key);
+    auto start = PreciseNow();
+    for (uint64_t iter = epochFirstIter[0]; iter < epochFirstIter[1]; ++iter) {
+        map.Erase(iter);
+    }
+    const double dropTime = PreciseNow() - start;
+    std::cerr << "StateCacheExpiry (BufferSize: " << bufferSize << ", Elements: " << key
+        << ", DroppedElements: " << epochFirstIter[1] << ", SecondsPerDrop: " << dropTime << ")" << std::endl;
+}
+
+int main()
+{
+    std::cerr << RunDesc << "\nStart tests" << std::endl;
+    ES_SimpleTest();
+    ES_CompactionTest();
+    ES_DropEpochTest();
+    ESC_LraTest();
+    std::cerr << "Finish tests" << std::endl;
+
+    for (uint64_t bufferSize : {64ull << 20, 256ull << 20, 1024ull << 20}) {
+        BenchmarkDropEpoch(bufferSize);
+        BenchmarkStateCacheExpiry(bufferSize);
+    }
+    std::cerr << "Finish" << std::endl;
+    return 0;
+}
+#endif
@@ -1,11 +1,32 @@
 #include <iostream>
+
 #include <chrono>
 #include <vector>
 #include <span>
 #include <unordered_map>
 #include <map>
 #include <cstring>
+#include <cassert>
+#include <optional>
+#include <limits>
+#include <stdexcept>
 #include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <utility>
+#include <memory>
+#include <array>
+#include <cstdio>
+#include <string>
+#include <bit>
+#include <algorithm>
+
+// Upstream wyhash.h, final version 4.2, vendored as is (The Unlicense, see wyhash.LICENSE).
+// It and mmap_buffer.h are included before experiments that are included into namespaces (see trace_replay).
+#include "wyhash.h"
+#include "mmap_buffer.h"
 
 #ifdef NDEBUG
     #define verify(flag) do { if (!(flag)) { abort(); } } while (false)
@@ -31,19 +52,76 @@ double Rss()
     return (size_t)info.resident_size / 1e6;
 }
 #else
+#include <unistd.h>
 double Rss()
 {
-    int64_t s = 0;
+    long long s = 0;
     FILE* f = fopen("/proc/self/statm", "r");
     if (!f) {
         return 0;
     }
-    fscanf(f, "%lld", &s);
+    fscanf(f, "%*d %lld", &s); // Second field is resident pages.
     fclose(f);
-    return s / 1e6;
+    return s * sysconf(_SC_PAGESIZE) / 1e6;
 }
 #endif
 
+// Snapshot file helpers, all errors are exceptions.
+using TFile = std::unique_ptr<FILE, int (*)(FILE*)>;
+
+TFile OpenFile(const std::string& path, const char* mode)
+{
+    TFile f(fopen(path.c_str(), mode), &fclose);
+    if (!f) {
+        throw std::runtime_error("can not open " + path);
+    }
+    return f;
+}
+
+void WriteToFile(FILE* f, const void* data, uint64_t size)
+{
+    if (size != 0 && fwrite(data, 1, size, f) != size) {
+        throw std::runtime_error("snapshot write failed");
+    }
+}
+
+void ReadFromFile(FILE* f, void* data, uint64_t size)
+{
+    if (size != 0 && fread(data, 1, size, f) != size) {
+        throw std::runtime_error("snapshot is truncated");
+    }
+}
+
+void SeekFile(FILE* f, uint64_t offset)
+{
+    if (fseeko(f, offset, SEEK_SET) != 0) {
+        throw std::runtime_error("snapshot seek failed");
+    }
+}
+
+uint64_t TellFile(FILE* f)
+{
+    const off_t offset = ftello(f);
+    if (offset < 0) {
+        throw std::runtime_error("snapshot tell failed");
+    }
+    return offset;
+}
+
+// Throws unless `count` items of `itemSize` bytes from `offset` are in the file.
+// Sizes come from the snapshot, so they are checked before reading or mapping, a mapping past the end would be SIGBUS.
+void CheckFileHas(FILE* f, uint64_t offset, uint64_t count, uint64_t itemSize = 1)
+{
+    struct stat st;
+    if (fstat(fileno(f), &st) != 0) {
+        throw std::runtime_error("snapshot stat failed");
+    }
+    const uint64_t fileSize = st.st_size;
+    if (offset > fileSize || count > (fileSize - offset) / itemSize) {
+        throw std::runtime_error("snapshot is truncated");
+    }
+}
+
 
 using namespace std::literals::string_view_literals;
 
@@ -51,6 +129,24 @@ bool operator==(std::span<char> a, std::string_view b) {
     return std::string_view(a.data(), a.size()) == b;
 }
 
+// Default evictor of `Allocate` in storages with compaction: every element is moved.
+// An evictor is asked about every unpinned element that compaction passes, true means the owner has forgotten
+// the element and the storage frees it in place, so its space joins the free run without a copy.
+struct TMoveAllElements
+{
+    bool operator()(uint32_t)
+    {
+        return false;
+    }
+};
+
+// Pin state of an element, see `Pin` in storages. Pins are rare and short, so they are kept aside of elements.
+struct TPinState
+{
+    uint64_t Count = 0;
+    bool FreeOnUnpin = false;
+};
+
 class TTrivialStringsStorage
 {
 public:
@@ -59,7 +155,7 @@ public:
     static inline constexpr TIndex NilIndex = static_cast<TIndex>(-1);
     static inline constexpr TValue NilValue = {static_cast<char*>(nullptr), 0u};
 
-    TTrivialStringsStorage(uint64_t)
+    TTrivialStringsStorage(uint64_t, uint64_t = 0)
     { }
 
     std::pair<TValue, TIndex> Allocate(uint64_t size)
@@ -83,11 +179,20 @@ public:
         return {d->data(), d->size()};
     }
 
+    bool HasSpaceFor(uint64_t)
+    {
+        return true;
+    }
+
     bool Free(TIndex index)
     {
         if (!Data_[index].has_value()) {
             return false;
         }
+        if (auto it = Pins_.find(index); it != Pins_.end()) {
+            it->second.FreeOnUnpin = true;
+            return true;
+        }
         Data_[index].reset();
         FreeIndex(index);
         return true;
@@ -101,8 +206,10 @@ public:
     void Clear()
     {
         CurrentIndex_ = 0;
+        ClockHand_ = 0;
         Data_.clear();
         FreeIndexes_.clear();
+        Pins_.clear();
     }
 
     double FillRate()
@@ -114,6 +221,99 @@ public:
     {
         return 0;
     }
+
+    bool DoHeavyWork(uint64_t)
+    {
+        return false;
+    }
+
+    void Touch(TIndex)
+    { }
+
+    // No counters and no addresses: FIFO by index. Pinned elements are skipped.
+    std::optional<TIndex> NextClockVictim()
+    {
+        if (ElementsCount() <= Pins_.size()) {
+            return std::nullopt;
+        }
+        do {
+            ClockHand_ = (ClockHand_ + 1) % CurrentIndex_;
+        } while (!Data_[ClockHand_].has_value() || Pins_.contains(ClockHand_));
+        return ClockHand_;
+    }
+
+    void PrefetchIndex(TIndex index)
+    {
+        __builtin_prefetch(Data_.data() + index);
+    }
+
+    void PrefetchValue(TIndex index)
+    {
+        __builtin_prefetch(Data_[index]->data());
+    }
+
+    // Values never move here, so pins only defer `Free`.
+    void Pin(TIndex index)
+    {
+        assert(Get(index).data() != nullptr);
+        ++Pins_[index].Count;
+    }
+
+    void Unpin(TIndex index)
+    {
+        auto it = Pins_.find(index);
+        assert(it != Pins_.end());
+        if (--it->second.Count == 0) {
+            const bool free = it->second.FreeOnUnpin;
+            Pins_.erase(it);
+            if (free) {
+                Free(index);
+            }
+        }
+    }
+
+    template <typename TFunc>
+    void ForEachIndex(TFunc&& func)
+    {
+        for (TIndex idx = 0; idx < CurrentIndex_; ++idx) {
+            if (Data_[idx].has_value()) {
+                func(idx);
+            }
+        }
+    }
+
+    // Element by element, the same format is read by `Load`. Size -1 is a free index.
+    void Save(FILE* f)
+    {
+        WriteToFile(f, &CurrentIndex_, sizeof(CurrentIndex_));
+        for (TIndex idx = 0; idx < CurrentIndex_; ++idx) {
+            const int64_t size = Data_[idx].has_value() ? Data_[idx]->size() : -1;
+            WriteToFile(f, &size, sizeof(size));
+            if (size > 0) {
+                WriteToFile(f, Data_[idx]->data(), size);
+            }
+        }
+    }
+
+    void Load(FILE* f)
+    {
+        Clear();
+        TIndex count = 0;
+        ReadFromFile(f, &count, sizeof(count));
+        std::vector<TIndex> freeIndexes;
+        for (TIndex idx = 0; idx < count; ++idx) {
+            int64_t size = 0;
+            ReadFromFile(f, &size, sizeof(size));
+            auto value = Allocate(std::max<int64_t>(size, 0)).first;
+            if (size < 0) {
+                freeIndexes.push_back(idx);
+            }
+            ReadFromFile(f, value.data(), value.size());
+        }
+        for (auto idx : freeIndexes) {
+            Free(idx);
+        }
+    }
 private:
     TIndex AllocateIndex()
     {
@@ -135,15 +335,54 @@ private:
 
 private:
     TIndex CurrentIndex_ = 0;
+    TIndex ClockHand_ = 0;
     std::vector<TIndex> FreeIndexes_;
     std::vector<std::optional<std::vector<char>>> Data_;
+    std::unordered_map<TIndex, TPinState> Pins_;
+};
+
+// Size classes (ranks) of free gaps in the blob storage. `Get` is monotonic and sizes of one class differ
+// by less than 1/2^bits, where bits are `MantissaBits` in general, `FineBits` in [64 B, 4 KB), where most values are,
+// and `CoarseBits` from 64 KB, where a few percent of waste does not matter and fewer classes keep the lists short.
+// `Layout` goes to snapshots, as rank lists depend on the classes.
+template <int MantissaBits = 4, int FineBits = MantissaBits, int CoarseBits = MantissaBits>
+struct TLogSizeClasses
+{
+    static_assert(MantissaBits <= 8 && FineBits <= 8 && CoarseBits <= 8);
+
+    static constexpr uint64_t Layout = MantissaBits | (FineBits << 4) | (CoarseBits << 8);
+
+    static constexpr int Get(uint64_t x)
+    {
+        const int lg = x ? 64 - __builtin_clzll(x) : 0;
+        const int bits = GetBits(lg);
+        // Bits after the leading one, small sizes are shifted up, so classes below 2^bits are sparse.
+        const uint64_t mantissa = lg > bits ? x >> (lg - 1 - bits) : x << (bits + 1 - lg);
+        return GetOffset(lg) + static_cast<int>(mantissa & ((1ull << bits) - 1));
+    }
+
+private:
+    static constexpr int GetBits(int lg)
+    {
+        return lg >= 7 && lg <= 12 ? FineBits : (lg >= 17 ? CoarseBits : MantissaBits);
+    }
+
+    // Count of classes of sizes below 2^(lg - 1).
+    static constexpr int GetOffset(int lg)
+    {
+        const int fine = std::clamp(lg, 7, 13) - 7;
+        const int coarse = std::max(lg, 17) - 17;
+        return ((lg - fine - coarse) << MantissaBits) + (fine << FineBits) + (coarse << CoarseBits);
+    }
 };
 
+// 16 classes per power of two, the default of the blob storage.
 constexpr int GetRank(uint64_t x) {
-    int lg = 64 - __builtin_clzll(x);
-    return (lg << 4) | ((x << 5 >> lg) & 15);
+    return TLogSizeClasses<>::Get(x);
 }
 
+// Two levels: a bit per nonempty block of 64 bits above the bits, so `Find` takes a couple of ctz
+// for up to 4096 bits instead of a scan over blocks.
 template <int BitsCount>
 class TBitMask {
 public:
@@ -152,85 +391,280 @@ public:
     void Set(int i)
     {
         Data_[i / 64] |= 1ull << (i & 63);
+        Blocks_[i / 4096] |= 1ull << ((i / 64) & 63);
     }
 
     void Reset(int i)
     {
         Data_[i / 64] &= ~(1ull << (i & 63));
+        if (Data_[i / 64] == 0) {
+            Blocks_[i / 4096] &= ~(1ull << ((i / 64) & 63));
+        }
     }
 
     int Find(int start)
     {
         const int startBlock = start / 64;
         const int startBlockOffset = (start & 63);
-        const int startBlockRelPos = __builtin_ctzll(Data_[startBlock] >> startBlockOffset);
-        if (startBlockRelPos != 64) {
-            return start + startBlockRelPos;
+        const uint64_t startBlockBits = Data_[startBlock] >> startBlockOffset;
+        if (startBlockBits != 0) { // __builtin_ctzll(0) is undefined.
+            return start + __builtin_ctzll(startBlockBits);
         }
-        for (int block = startBlock + 1; block < DataSize_; ++block) {
-            const int blockAbsPos = __builtin_ctzll(Data_[block]);
-            if (blockAbsPos != 64) {
-                return block * 64 + blockAbsPos;
+        const int nextBlock = startBlock + 1;
+        if (nextBlock == DataSize_) {
+            return -1;
+        }
+        uint64_t blocks = Blocks_[nextBlock / 64] & (~0ull << (nextBlock & 63));
+        for (int word = nextBlock / 64; ; blocks = Blocks_[word]) {
+            if (blocks != 0) {
+                const int block = word * 64 + __builtin_ctzll(blocks);
+                return block * 64 + __builtin_ctzll(Data_[block]);
+            }
+            if (++word == BlocksSize_) {
+                return -1;
             }
         }
-        return -1;
     }
 
 private:
     static constexpr int DataSize_ = (BitsCount + 63) / 64;
+    static constexpr int BlocksSize_ = (DataSize_ + 63) / 64;
     uint64_t Data_[DataSize_] = {};
+    uint64_t Blocks_[BlocksSize_] = {};
+};
+
+
+// How the blob storage chooses a free gap. Gaps are in lists by rank, see `TLogSizeClasses`.
+enum class TFitPolicy
+{
+    Segregated, // The first gap of the least rank above the rank of the size, every gap there fits.
+    ExactRank, // First a bounded scan of the rank of the size for a gap that fits, then Segregated.
+    BestFit, // As ExactRank, but the least of the scanned gaps that fit, in the Segregated rank too.
 };
 
+// Array of metadata, e.g. `Positions_` or hash table buckets. By default it is in the heap and grows like std::vector.
+// Constructed from a span it is placed there with fixed capacity and never reallocates (one block mode).
+template <typename T>
+class TMetaVector
+{
+public:
+    TMetaVector() = default;
+
+    explicit TMetaVector(std::span<T> place)
+        : Data_(place.data())
+        , Capacity_(place.size())
+        , Fixed_(true)
+    { }
+
+    explicit TMetaVector(std::vector<T>&& heap)
+        : Heap_(std::move(heap))
+        , Data_(Heap_.data())
+        , Size_(Heap_.size())
+        , Capacity_(Heap_.capacity())
+    { }
+
+    TMetaVector(TMetaVector&& other)
+    {
+        *this = std::move(other);
+    }
+
+    TMetaVector& operator=(TMetaVector&& other)
+    {
+        if (this != &other) {
+            Heap_ = std::move(other.Heap_); // Keeps the heap buffer, so `Data_` stays valid.
+            Data_ = std::exchange(other.Data_, nullptr);
+            Size_ = std::exchange(other.Size_, 0);
+            Capacity_ = std::exchange(other.Capacity_, 0);
+            Fixed_ = std::exchange(other.Fixed_, false);
+        }
+        return *this;
+    }
+
+    T& operator[](size_t i)
+    {
+        return Data_[i];
+    }
+
+    T* data()
+    {
+        return Data_;
+    }
+
+    size_t size() const
+    {
+        return Size_;
+    }
+
+    size_t capacity() const
+    {
+        return Capacity_;
+    }
+
+    bool empty() const
+    {
+        return Size_ == 0;
+    }
+
+    bool IsFixed() const
+    {
+        return Fixed_;
+    }
+
+    void resize(size_t size)
+    {
+        if (!Fixed_) {
+            Heap_.resize(size);
+            Data_ = Heap_.data();
+            Capacity_ = Heap_.capacity();
+        } else if (size > Capacity_) {
+            throw std::runtime_error("fixed metadata is too small");
+        } else {
+            std::fill(Data_ + std::min(size, Size_), Data_ + size, T());
+        }
+        Size_ = size;
+    }
+
+    void assign(size_t size, T value)
+    {
+        resize(0);
+        resize(size);
+        std::fill(Data_, Data_ + size, value);
+    }
+
+    void clear()
+    {
+        resize(0);
+    }
+
+private:
+    std::vector<T> Heap_;
+    T* Data_ = nullptr;
+    size_t Size_ = 0;
+    size_t Capacity_ = 0;
+    bool Fixed_ = false;
+};
 
-class TBlobStringsStorage
+// `TPosition` is a signed type of `Positions_`, negative values encode the free index list.
+// Positions are in 4-byte units, as every header is 4-byte aligned, so int32_t covers buffers up to 8 GB
+// with half of the index memory, and int64_t covers `MaxSize`.
+// Header fields are `OffsetBits` wide for offsets in the buffer (the buffer is less than 2^OffsetBits bytes),
+// `SizeBits` for the value size and `IndexBits` for the own index (less than 2^IndexBits - 1 elements).
+// Defaults are 28 bytes for 200 GB buffers, see `TCompactBlobStringsStorage` for a smaller one.
+// `FitPolicy` chooses a free gap in the rank lists, see `TFitPolicy`, and `TSizeClasses` ranks gaps for them,
+// see `TLogSizeClasses`.
+template <typename TPosition = int64_t, int OffsetBits = 38, int SizeBits = 38, int IndexBits = 32,
+          TFitPolicy FitPolicy = TFitPolicy::Segregated, typename TSizeClasses = TLogSizeClasses<>>
+class TBasicBlobStringsStorage
 {
 public:
-    static constexpr uint64_t MaxSize = 200'000'000'000;
-    static constexpr int MaxSizeRank = GetRank(MaxSize);
+    static_assert(OffsetBits <= 40 && SizeBits <= 40 && IndexBits <= 32);
+    static_assert((4 * OffsetBits + SizeBits + 2 + IndexBits) % 32 == 0, "header would have padding bits");
+
+    static constexpr uint64_t MaxSize = std::min<uint64_t>(200'000'000'000, (1ull << OffsetBits) - 1);
+    static constexpr uint64_t MaxValueSize = (1ull << SizeBits) - 1;
+    static constexpr int MaxSizeRank = TSizeClasses::Get(MaxSize);
 
     using TIndex = uint32_t;
     using TValue = std::span<char>;
     static inline constexpr TIndex NilIndex = static_cast<TIndex>(-1);
     static inline constexpr TValue NilValue = {static_cast<char*>(nullptr), 0u};
-
-    TBlobStringsStorage(uint64_t bufferSize)
+    static constexpr uint64_t MaxElementsCount = (1ull << IndexBits) - 1; // All ones are the nil own index.
+
+    // `defragmentationBytesPerAllocation` bounds bytes moved by the resumable compaction inside `Allocate`,
+    // 0 means no bound (synchronous `Defragmentate` only).
+    // `maxElementsCount` != 0 is one block mode: `Positions_` for that many elements and `extraMetaBytes`
+    // for the user (see `ExtraMeta`) are carved from the head of the buffer, so the process has one fixed mapping
+    // of `bufferSize` bytes and no metadata reallocations. `HasSpaceFor` is false when the count is reached.
+    TBasicBlobStringsStorage(uint64_t bufferSize, uint64_t defragmentationBytesPerAllocation = 0,
+                             TBufferOptions bufferOptions = TBufferOptions(),
+                             uint64_t maxElementsCount = 0, uint64_t extraMetaBytes = 0)
+        : MaxElementsCount_(maxElementsCount == 0 ? MaxElementsCount - 1 : std::min(maxElementsCount, MaxElementsCount - 1))
+        , DefragmentationBytesPerAllocation_(defragmentationBytesPerAllocation)
     {
-        bufferSize = RoundValueSize(bufferSize);
-        if (bufferSize < OccupiedMetaSize_) {
+        const uint64_t positionsBytes = (maxElementsCount * sizeof(TPosition) + 63) & ~63ull;
+        const uint64_t metaBytes = (positionsBytes + extraMetaBytes + 63) & ~63ull;
+        const uint64_t dataSize = RoundValueSize(bufferSize) > metaBytes ? RoundValueSize(bufferSize) - metaBytes : 0;
+        if (dataSize < OccupiedMetaSize_) {
             throw std::runtime_error("too small buffer size");
         }
-        Data_.resize(bufferSize);
+        if (dataSize / PositionUnit > static_cast<uint64_t>(std::numeric_limits<TPosition>::max())) {
+            throw std::runtime_error("too large buffer size for the position type");
+        }
+        if (dataSize > MaxSize) {
+            throw std::runtime_error("too large buffer size for the offset width");
+        }
+        Block_ = TMmapBuffer(metaBytes + dataSize, bufferOptions);
+        Data_ = {Block_.data() + metaBytes, dataSize};
+        if (maxElementsCount != 0) {
+            Positions_ = TMetaVector<TPosition>({reinterpret_cast<TPosition*>(Block_.data()), maxElementsCount});
+            ExtraMeta_ = {Block_.data() + positionsBytes, extraMetaBytes};
+        }
         Clear();
     }
 
-    std::pair<TValue, TIndex> Allocate(uint64_t size)
+    // Memory for the user metadata in one block mode, e.g. for hash table buckets. Empty otherwise.
+    std::span<char> ExtraMeta()
     {
-        //std::cerr << "OccupiedSpace_=" << OccupiedSpace_ << std::endl;
-        const uint64_t roundedSize = RoundValueSize(size);
-        const uint64_t fullSize = roundedSize + sizeof(THeader);
+        return ExtraMeta_;
+    }
 
-        if (fullSize > Data_.size() - OccupiedSpace_) {
-            throw std::runtime_error("no space");
+    // Without pins `Allocate` of `size` bytes does not throw "no space", defragmentation always finds enough space then.
+    // Pinned elements split free space, so with them it is a guess: `TryAllocate` may compact and find no gap.
+    // Then free bytes left before pinned elements are not counted until a pin is released, so this turns false
+    // and the caller evicts more. Nothing is moved here.
+    bool HasSpaceFor(uint64_t size)
+    {
+        if (size > MaxValueSize) {
+            throw std::runtime_error("too large value"); // Not "no space", the map should not evict everything for it.
+        }
+        if (ElementsCount_ >= MaxElementsCount_) {
+            return false;
         }
-        THeader& header = FindHeaderWithFreeSpace(fullSize);
+        const uint64_t fullSize = RoundValueSize(size) + sizeof(THeader);
+        return fullSize + TrappedSpace_ <= Data_.size() - OccupiedSpace_;
+    }
 
-        ElementsCount_ += 1;
-        OccupiedSpace_ += fullSize;
-        const auto idx = AllocateIndex();
+    // `Allocate` of `size` bytes takes a free gap, so it moves nothing. Same gaps as `FindHeaderWithFreeSpace` checks.
+    bool HasGapFor(uint64_t size)
+    {
+        if (ElementsCount_ >= MaxElementsCount_) {
+            return false;
+        }
+        const uint64_t fullSize = RoundValueSize(size) + sizeof(THeader);
+        const int rank = TSizeClasses::Get(fullSize);
+        if (AvailableRanks_.Find(rank + 1) != -1) {
+            return true;
+        }
+        return FitPolicy != TFitPolicy::Segregated && FindInRank(rank, fullSize) != nullptr;
+    }
 
-        UnregisterFreeSpace(header);
-        THeader& newHeader = *reinterpret_cast<THeader*>(Data_.data() + header.GetLastOffset(Data_.data()));
-        const uint64_t newHeaderOffset = newHeader.GetFirstOffset(Data_.data());
-        Positions_[idx] = newHeaderOffset;
-        newHeader.OwnIndex = idx;
-        newHeader.ValueSize = size;
-        newHeader.RightOffset = header.RightOffset;
-        newHeader.LeftOffset = header.GetFirstOffset(Data_.data());
-        header.RightOffset = newHeaderOffset;
-        newHeader.GetRightHeader(Data_.data()).LeftOffset = newHeaderOffset;
-        RegisterFreeSpace(header);
-        RegisterFreeSpace(newHeader);
+    // `evictor` may drop cold elements instead of moving them, if compaction is needed (see `TMoveAllElements`).
+    template <typename TEvictor = TMoveAllElements>
+    std::pair<TValue, TIndex> Allocate(uint64_t size, TEvictor evictor = TEvictor())
+    {
+        auto allocated = TryAllocate(size, std::move(evictor));
+        if (allocated.second == NilIndex) {
+            throw std::runtime_error("no space");
+        }
+        return allocated;
+    }
+
+    // Nil instead of "no space", also when pins leave no large enough gap after compaction (see `HasSpaceFor`).
+    template <typename TEvictor = TMoveAllElements>
+    std::pair<TValue, TIndex> TryAllocate(uint64_t size, TEvictor evictor = TEvictor())
+    {
+        //std::cerr << "OccupiedSpace_=" << OccupiedSpace_ << std::endl;
+        const uint64_t roundedSize = RoundValueSize(size);
+        const uint64_t fullSize = roundedSize + sizeof(THeader);
 
+        if (!HasSpaceFor(size)) {
+            return {NilValue, NilIndex};
+        }
+        THeader* freeHeader = FindHeaderWithFreeSpace(fullSize, evictor);
+        if (freeHeader == nullptr) {
+            return {NilValue, NilIndex};
+        }
+        const auto idx = AllocateAfter(*freeHeader, size);
         return {GetValue(idx), idx};
     }
 
@@ -247,18 +681,16 @@ public:
         if (index >= Positions_.size() || Positions_[index] < 0) {
             return false;
         }
-        --ElementsCount_;
+        if (auto it = Pins_.find(index); it != Pins_.end()) {
+            it->second.FreeOnUnpin = true;
+            return true;
+        }
         auto& header = GetHeader(index);
-        verify(OccupiedSpace_ >= OccupiedMetaSize_ + header.GetFullSize());
-        OccupiedSpace_ -= header.GetFullSize();
         auto& leftHeader = header.GetLeftHeader(Data_.data());
-        auto& rightHeader = header.GetRightHeader(Data_.data());
         UnregisterFreeSpace(leftHeader);
         UnregisterFreeSpace(header);
-        leftHeader.RightOffset = header.RightOffset;
-        rightHeader.LeftOffset = header.LeftOffset;
+        RemoveElement(header);
         RegisterFreeSpace(leftHeader);
-        FreeIndex(index);
         return true;
     }
 
@@ -274,13 +706,19 @@ public:
         Positions_.clear();
         FirstFreeIndex_ = NilIndex;
         AvailableRanks_ = {};
+        CompactionCursor_ = NilIndex;
+        SweepDirty_ = false;
+        Compacted_ = false;
+        ClockHand_ = NilIndex;
+        Pins_.clear();
+        TrappedSpace_ = 0;
 
         // Rank nodes. Special service nodes. Never moved.
         RankNodes_ = reinterpret_cast<THeader*>(Data_.data());
         for (int i = 0; i < MaxSizeRank; ++i) {
             THeader& rankNode = RankNodes_[i];
             const uint64_t offset = rankNode.GetFirstOffset(Data_.data());
-            rankNode.OwnIndex = NilIndex; // Not important.
+            rankNode.SetOwnIndex(NilIndex); // Not important.
             rankNode.ValueSize = 0; // Not important.
             rankNode.LeftOffset = offset; // Not important.
             rankNode.RightOffset = offset; // Not important.
@@ -295,14 +733,14 @@ public:
             const uint64_t leftestOffset = leftestNode.GetFirstOffset(Data_.data());
             const uint64_t rightestOffset = rightestNode.GetFirstOffset(Data_.data());
 
-            leftestNode.OwnIndex = NilIndex; // Important.
+            leftestNode.SetOwnIndex(NilIndex); // Important.
             leftestNode.ValueSize = 0; // Important.
             leftestNode.LeftOffset = 0; // Important. It is marker.
             leftestNode.RightOffset = rightestOffset; // Important.
             leftestNode.LeftInRankOffset = leftestOffset; // Important.
             leftestNode.RightInRankOffset = leftestOffset; // Important.
 
-            rightestNode.OwnIndex = NilIndex; // Important.
+            rightestNode.SetOwnIndex(NilIndex); // Important.
             rightestNode.ValueSize = 0; // Important.
             rightestNode.LeftOffset = leftestOffset; // Important.
             rightestNode.RightOffset = Data_.size(); // Important. It is marker.
@@ -311,6 +749,7 @@ public:
 
             RegisterFreeSpace(leftestNode);
         }
+        ResetStripes();
     }
 
     double FillRate()
@@ -322,54 +761,341 @@ public:
     {
         return DefragmentatedBytes_;
     }
-private:
 
-    static constexpr uint64_t RoundValueSize(uint64_t valueSize)
+    // Resumes compaction for about `byteBudget` moved bytes. Meant to be called from an idle loop.
+    // Returns false when a full sweep over Data_ moved and freed nothing, so there are no gaps left.
+    bool DoHeavyWork(uint64_t byteBudget)
     {
-        return (valueSize + 3) & ~3ull;
+        if (Compacted_) {
+            return false;
+        }
+        DefragmentateIncrementally(std::numeric_limits<uint64_t>::max(), byteBudget, TMoveAllElements());
+        return !Compacted_;
     }
 
-    struct __attribute__ ((__packed__)) alignas(TIndex) THeader {
-        uint64_t LeftOffset : 38; // Absolute offset from begin of Data_.
-        uint64_t RightOffset : 38; // Absolute offset from begin of Data_.
-        uint64_t LeftInRankOffset : 38; // Absolute offset from begin of Data_.
-        uint64_t RightInRankOffset : 38; // Absolute offset from begin of Data_.
-        uint64_t ValueSize : 38;
-        TIndex OwnIndex;
-
-        uint64_t GetRightFreeSize(char* start)
-        {
-            return RightOffset - GetLastOffset(start);
+    // Compaction for owners with concurrent readers (see TBackgroundCompactedStrStrHashMap), it never writes
+    // over bytes of an element. Goes on with the sweep of `DoHeavyWork`, but elements to the right of the cursor
+    // are copied to the start of its bubble, each only if the rest of the bubble holds it whole.
+    // The copy gets a new index, and `relocate(oldIndex, newIndex)` lets the owner switch to it. The original
+    // is pinned and freed, so it is neither moved nor reused until the owner `Unpin`s it when no reader can see it.
+    // Its space joins the bubble then, so the call stops after copies when the next element does not fit the bubble.
+    // Returns false when a full sweep copied and freed nothing.
+    template <typename TRelocate>
+    bool CopyIncrementally(uint64_t byteBudget, TRelocate&& relocate)
+    {
+        if (Compacted_) {
+            return false;
         }
+        uint64_t spentBudget = 0;
+        bool copied = false;
+        THeader* header = &GetCompactionCursorHeader();
+        THeader* next = &header->GetRightHeader(Data_.data());
+        while (spentBudget < byteBudget) {
+            if (next->RightOffset == Data_.size()) { // Next is the rightest node.
+                if (copied) {
+                    break; // Originals of the copies may be ahead of the bubble.
+                }
+                Compacted_ = !SweepDirty_;
+                SweepDirty_ = false;
+                CompactionCursor_ = NilIndex;
+                if (Compacted_) {
+                    return false;
+                }
+                header = &RankNodes_[MaxSizeRank];
+                next = &header->GetRightHeader(Data_.data());
+                spentBudget += sizeof(THeader);
+                continue;
+            }
+            if (IsPinned(next->GetOwnIndex())) { // Originals of earlier copies or pinned values.
+                next = &next->GetRightHeader(Data_.data());
+                spentBudget += sizeof(THeader);
+                continue;
+            }
+            const uint64_t nextFullSize = next->GetFullSize();
+            if (header->GetRightFreeSize(Data_.data()) < nextFullSize || ElementsCount_ >= MaxElementsCount_) {
+                if (copied) {
+                    break;
+                }
+                header = &header->GetRightHeader(Data_.data()); // The bubble is left to the next sweep.
+                CompactionCursor_ = header->GetOwnIndex();
+                next = &header->GetRightHeader(Data_.data());
+                spentBudget += sizeof(THeader);
+                continue;
+            }
 
-        uint64_t GetFullSize()
-        {
-            return sizeof(THeader) + RoundValueSize(ValueSize); // Hack for aligned memory. Can be done better?
-        }
+            THeader& original = *next;
+            const TIndex oldIndex = original.GetOwnIndex();
+            next = &original.GetRightHeader(Data_.data());
+            const TIndex newIndex = AllocateAfter(*header, original.ValueSize);
+            header = &GetHeader(newIndex);
+            header->ClockCounter = original.ClockCounter;
+            std::memcpy(GetValue(newIndex).data(), GetValue(oldIndex).data(), original.ValueSize);
+            CompactionCursor_ = newIndex;
+            DefragmentatedBytes_ += nextFullSize;
+            SweepDirty_ = true;
+            spentBudget += nextFullSize;
+            copied = true;
 
-        uint64_t GetFirstOffset(char* start)
-        {
-            return reinterpret_cast<char*>(this) - start;
+            Pin(oldIndex);
+            Free(oldIndex); // Deferred to `Unpin`.
+            relocate(oldIndex, newIndex);
         }
+        return true;
+    }
 
-        uint64_t GetLastOffset(char* start)
-        {
-            return reinterpret_cast<char*>(this) + GetFullSize() - start;
-        }
+    // Begin of the buffer. An element stays at its offset from it until it is moved or freed.
+    char* Data()
+    {
+        return Data_.data();
+    }
 
-        THeader& GetLeftHeader(char* start)
-        {
-            return *reinterpret_cast<THeader*>(start + LeftOffset);
+    // Recency counter for CLOCK eviction, saturates at 3. Allocate sets 1, as the element is just referenced,
+    // so a new element is not dropped by compaction before the hand comes to it (see `IsClockCold`).
+    void Touch(TIndex index)
+    {
+        auto& header = GetHeader(index);
+        if (header.ClockCounter != MaxClockCounter) {
+            ++header.ClockCounter;
         }
+    }
 
-        THeader& GetRightHeader(char* start)
-        {
-            return *reinterpret_cast<THeader*>(start + RightOffset);
-        }
+    // Not touched since the hand passed it, so the hand evicts it on arrival.
+    bool IsClockCold(TIndex index)
+    {
+        return GetHeader(index).ClockCounter == 0;
+    }
 
-        THeader& GetLeftInRankHeader(char* start)
-        {
-            return *reinterpret_cast<THeader*>(start + LeftInRankOffset);
+    // CLOCK hand goes in address order along `RightOffset` links. An element with non-zero counter
+    // gets a decrement and is skipped, so the hand stops after at most 4 rounds. Pinned elements are skipped.
+    // Nullopt if there are no unpinned elements.
+    std::optional<TIndex> NextClockVictim()
+    {
+        if (ElementsCount_ <= Pins_.size()) {
+            return std::nullopt;
+        }
+        THeader& leftestNode = RankNodes_[MaxSizeRank];
+        THeader* header = ClockHand_ == NilIndex ? &leftestNode : &GetHeader(ClockHand_);
+        while (true) {
+            header = header->RightOffset == Data_.size() ? &leftestNode : &header->GetRightHeader(Data_.data());
+            if (header->GetOwnIndex() == NilIndex || IsPinned(header->GetOwnIndex())) {
+                continue; // Border node or pinned.
+            }
+            if (header->ClockCounter == 0) {
+                ClockHand_ = header->GetOwnIndex();
+                return ClockHand_;
+            }
+            --header->ClockCounter;
+        }
+    }
+
+    // For batched lookups. The first one brings the position of an element, the second one its header,
+    // it reads the position, so it goes after the first one has completed.
+    void PrefetchIndex(TIndex index)
+    {
+        __builtin_prefetch(Positions_.data() + index);
+    }
+
+    void PrefetchValue(TIndex index)
+    {
+        __builtin_prefetch(Data_.data() + GetPosition(index));
+    }
+
+    // A pinned element is not moved by compaction, so its value stays valid. `Free` of it is deferred
+    // to the last `Unpin`, till then it takes space and is counted. Every pinned element is a barrier
+    // for compaction, so pins are for short reads, e.g. writing a value to a socket without a copy.
+    void Pin(TIndex index)
+    {
+        assert(index < Positions_.size() && Positions_[index] >= 0);
+        ++Pins_[index].Count;
+    }
+
+    void Unpin(TIndex index)
+    {
+        auto it = Pins_.find(index);
+        assert(it != Pins_.end());
+        if (--it->second.Count == 0) {
+            const bool free = it->second.FreeOnUnpin;
+            Pins_.erase(it);
+            TrappedSpace_ = 0; // Unknown until the next failed `Defragmentate`.
+            if (free) {
+                Free(index);
+            }
+        }
+    }
+
+    template <typename TFunc>
+    void ForEachIndex(TFunc&& func)
+    {
+        for (TIndex idx = 0; idx < Positions_.size(); ++idx) {
+            if (Positions_[idx] >= 0) {
+                func(idx);
+            }
+        }
+    }
+
+    // Offsets in Data_ are relative to its begin, so the buffer is written as is, at a page aligned offset,
+    // and `Load` maps it from the file instead of reading. Metadata follows the buffer, the caller may append more.
+    void Save(FILE* f)
+    {
+        if (!Pins_.empty()) {
+            throw std::runtime_error("can not save with pinned values");
+        }
+        TSnapshotHeader header;
+        header.Magic = SnapshotMagic;
+        header.Version = SnapshotVersion;
+        header.HeaderOffsetBits = OffsetBits;
+        header.HeaderSizeBits = SizeBits;
+        header.HeaderIndexBits = IndexBits;
+        header.SizeClassesLayout = TSizeClasses::Layout;
+        header.PositionSize = sizeof(TPosition);
+        header.DataSize = Data_.size();
+        header.PositionsCount = Positions_.size();
+        header.FirstFreeIndex = FirstFreeIndex_;
+        header.ElementsCount = ElementsCount_;
+        header.OccupiedSpace = OccupiedSpace_;
+        header.DefragmentatedBytes = DefragmentatedBytes_;
+        header.AvailableRanks = AvailableRanks_;
+        WriteToFile(f, &header, sizeof(header));
+        SeekFile(f, SnapshotDataOffset);
+        WriteToFile(f, Data_.data(), Data_.size());
+        WriteToFile(f, Positions_.data(), Positions_.size() * sizeof(Positions_[0]));
+    }
+
+    // Replaces the content and the buffer size with the snapshot. Leaves `f` after the storage metadata.
+    // The header, sizes of the sections and positions are checked, a bad snapshot throws and leaves the storage as is.
+    // Element headers in the buffer are not, that would fault every page of it.
+    void Load(FILE* f)
+    {
+        TSnapshotHeader header;
+        SeekFile(f, 0);
+        ReadFromFile(f, &header, sizeof(header));
+        if (header.Magic != SnapshotMagic) {
+            throw std::runtime_error("not a storage snapshot");
+        }
+        if (header.Version != SnapshotVersion) {
+            throw std::runtime_error("snapshot has another version");
+        }
+        if (header.HeaderOffsetBits != OffsetBits || header.HeaderSizeBits != SizeBits
+            || header.HeaderIndexBits != IndexBits || header.SizeClassesLayout != TSizeClasses::Layout)
+        {
+            throw std::runtime_error("snapshot has another header layout");
+        }
+        if (header.PositionSize != sizeof(TPosition)) {
+            throw std::runtime_error("snapshot has another position type");
+        }
+        if (header.DataSize < OccupiedMetaSize_ || header.DataSize > MaxSize || header.DataSize % PositionUnit != 0
+            || header.DataSize / PositionUnit > static_cast<uint64_t>(std::numeric_limits<TPosition>::max()))
+        {
+            throw std::runtime_error("snapshot has a bad buffer size");
+        }
+        if (header.PositionsCount > MaxElementsCount || header.ElementsCount > header.PositionsCount
+            || (header.FirstFreeIndex != NilIndex && header.FirstFreeIndex >= header.PositionsCount)
+            || header.OccupiedSpace > header.DataSize)
+        {
+            throw std::runtime_error("snapshot has bad counters");
+        }
+        CheckFileHas(f, SnapshotDataOffset, header.DataSize);
+        CheckFileHas(f, SnapshotDataOffset + header.DataSize, header.PositionsCount, sizeof(TPosition));
+        std::vector<TPosition> positions(header.PositionsCount);
+        SeekFile(f, SnapshotDataOffset + header.DataSize);
+        ReadFromFile(f, positions.data(), positions.size() * sizeof(positions[0]));
+        for (auto position : positions) {
+            // A header in the buffer, or the end of the free index list (-1) or a link to a free index (-2 - k).
+            const bool valid = position >= 0
+                ? static_cast<uint64_t>(position) * PositionUnit + sizeof(THeader) <= header.DataSize
+                : static_cast<uint64_t>(-2 - static_cast<int64_t>(position)) + 1 <= header.PositionsCount;
+            if (!valid) {
+                throw std::runtime_error("snapshot has a bad position");
+            }
+        }
+
+        // Tables of one block mode are in the replaced mapping, so the loaded storage keeps them in the heap.
+        Block_ = TMmapBuffer(fileno(f), SnapshotDataOffset, header.DataSize);
+        Data_ = {Block_.data(), Block_.size()};
+        ExtraMeta_ = {};
+        RankNodes_ = reinterpret_cast<THeader*>(Data_.data());
+        Positions_ = TMetaVector<TPosition>(std::move(positions));
+        FirstFreeIndex_ = header.FirstFreeIndex;
+        ElementsCount_ = header.ElementsCount;
+        OccupiedSpace_ = header.OccupiedSpace;
+        DefragmentatedBytes_ = header.DefragmentatedBytes;
+        AvailableRanks_ = header.AvailableRanks;
+        CompactionCursor_ = NilIndex;
+        SweepDirty_ = true; // Unknown, so the next sweep checks.
+        Compacted_ = false;
+        ClockHand_ = NilIndex;
+        Pins_.clear();
+        TrappedSpace_ = 0;
+        ResetStripes();
+    }
+private:
+
+    static constexpr uint64_t MaxClockCounter = 3;
+    static constexpr uint64_t PositionUnit = 4;
+    static constexpr uint64_t FitScanLength = 8;
+
+    static constexpr uint64_t SnapshotMagic = 0x53'4B'43'4F'4C'42'4F'53; // "SOBLOCKS"
+    static constexpr uint64_t SnapshotVersion = 3;
+    // Multiple of any page size in use, so the buffer can be mapped.
+    static constexpr uint64_t SnapshotDataOffset = 64 << 10;
+
+    static constexpr uint64_t RoundValueSize(uint64_t valueSize)
+    {
+        return (valueSize + 3) & ~3ull;
+    }
+
+    struct __attribute__ ((__packed__, __aligned__(alignof(TIndex)))) THeader {
+        uint64_t LeftOffset : OffsetBits; // Absolute offset from begin of Data_.
+        uint64_t RightOffset : OffsetBits; // Absolute offset from begin of Data_.
+        uint64_t LeftInRankOffset : OffsetBits; // Absolute offset from begin of Data_.
+        uint64_t RightInRankOffset : OffsetBits; // Absolute offset from begin of Data_.
+        uint64_t ValueSize : SizeBits;
+        uint64_t ClockCounter : 2; // Spare bits of the packed header.
+        uint64_t OwnIndex : IndexBits; // Use `GetOwnIndex`, it maps all ones to NilIndex.
+
+        TIndex GetOwnIndex()
+        {
+            return OwnIndex == MaxElementsCount ? NilIndex : static_cast<TIndex>(OwnIndex);
+        }
+
+        void SetOwnIndex(TIndex index)
+        {
+            OwnIndex = index == NilIndex ? MaxElementsCount : index;
+        }
+
+        uint64_t GetRightFreeSize(char* start)
+        {
+            return RightOffset - GetLastOffset(start);
+        }
+
+        uint64_t GetFullSize()
+        {
+            return sizeof(THeader) + RoundValueSize(ValueSize); // Hack for aligned memory. Can be done better?
+        }
+
+        uint64_t GetFirstOffset(char* start)
+        {
+            return reinterpret_cast<char*>(this) - start;
+        }
+
+        uint64_t GetLastOffset(char* start)
+        {
+            return reinterpret_cast<char*>(this) + GetFullSize() - start;
+        }
+
+        THeader& GetLeftHeader(char* start)
+        {
+            return *reinterpret_cast<THeader*>(start + LeftOffset);
+        }
+
+        THeader& GetRightHeader(char* start)
+        {
+            return *reinterpret_cast<THeader*>(start + RightOffset);
+        }
+
+        THeader& GetLeftInRankHeader(char* start)
+        {
+            return *reinterpret_cast<THeader*>(start + LeftInRankOffset);
         }
 
         THeader& GetRightInRankHeader(char* start)
@@ -380,41 +1106,71 @@ private:
     static_assert(alignof(TIndex) == 4);
     static_assert(alignof(THeader) == 4);
     //static_assert(RoundValueSize(alignof(THeader) / 2) == alignof(THeader));
-    static_assert(sizeof(THeader) == 28); // Not invariant, just check.
+    static_assert(sizeof(THeader) == (4 * OffsetBits + SizeBits + 2 + IndexBits) / 8); // No padding.
 
 
-    THeader& FindHeaderWithFreeSpace(uint64_t fullSize)
+    // Nullptr only with pins, if compaction can not collect `fullSize` between them.
+    template <typename TEvictor>
+    THeader* FindHeaderWithFreeSpace(uint64_t fullSize, TEvictor& evictor)
     {
-        const int requiredRank = GetRank(fullSize) + 1;
+        if constexpr (FitPolicy != TFitPolicy::Segregated) {
+            if (THeader* header = FindInRank(TSizeClasses::Get(fullSize), fullSize)) {
+                return header;
+            }
+        }
+        const int requiredRank = TSizeClasses::Get(fullSize) + 1;
         const int availableRank = AvailableRanks_.Find(requiredRank);
         if (availableRank == -1) {
-            return Defragmentate(fullSize);
+            if (DefragmentationBytesPerAllocation_ != 0) {
+                if (THeader* header = DefragmentateIncrementally(fullSize, DefragmentationBytesPerAllocation_, evictor)) {
+                    return header;
+                }
+                // Budget is not enough, so block until done. At most two sweeps: the second one finds all free space at the end.
+                if (THeader* header = DefragmentateIncrementally(fullSize, std::numeric_limits<uint64_t>::max(), evictor)) {
+                    return header;
+                }
+                return Defragmentate(fullSize, evictor); // Only with pins, the gap may be behind the cursor.
+            }
+            return Defragmentate(fullSize, evictor);
         }
         // std::cout << "FindHeaderWithFreeSpace requiredRank=" << requiredRank << " availableRank=" << availableRank << std::endl;
         THeader& rankNodeHeader = RankNodes_[availableRank];
         verify(rankNodeHeader.LeftInRankOffset != rankNodeHeader.GetFirstOffset(Data_.data()));
-        return rankNodeHeader.GetRightInRankHeader(Data_.data());
+        if constexpr (FitPolicy == TFitPolicy::BestFit) {
+            return FindInRank(availableRank, fullSize);
+        }
+        return &rankNodeHeader.GetRightInRankHeader(Data_.data());
     }
 
-    THeader& Defragmentate(uint64_t fullSize)
+    // Scans at most `FitScanLength` gaps of the rank. The first one that fits or the least of them for BestFit.
+    THeader* FindInRank(int rank, uint64_t fullSize)
     {
-        THeader* header = nullptr;
-        // Find point to start defragmentation.
-        {
-            // Find random allocation.
-            TIndex startIndex = NilIndex;
-            while (true) {
-                startIndex = rand() % Positions_.size();
-                if (Positions_[startIndex] >= 0) {
+        THeader& rankNodeHeader = RankNodes_[rank];
+        THeader* found = nullptr;
+        uint64_t foundFreeSize = std::numeric_limits<uint64_t>::max();
+        THeader* header = &rankNodeHeader.GetRightInRankHeader(Data_.data());
+        for (uint64_t i = 0; i < FitScanLength && header != &rankNodeHeader; ++i) {
+            const uint64_t freeSize = header->GetRightFreeSize(Data_.data());
+            if (freeSize >= fullSize && freeSize < foundFreeSize) {
+                found = header;
+                foundFreeSize = freeSize;
+                if (FitPolicy != TFitPolicy::BestFit || freeSize == fullSize) {
                     break;
                 }
             }
-            // std::cerr << "Positions. ";
-            // for (int i = 0; i < Positions_.size(); ++i) {
-            //     std::cerr << i << ":" << Positions_[i] << ", ";
-            // }
-            // std::cerr << " first:" << FirstFreeIndex_ << std::endl;
-            header = &GetHeader(startIndex);
+            header = &header->GetRightInRankHeader(Data_.data());
+        }
+        return found;
+    }
+
+    // Nullptr only with pins, then `TrappedSpace_` is the free space left before pinned elements.
+    template <typename TEvictor>
+    THeader* Defragmentate(uint64_t fullSize, TEvictor&& evictor)
+    {
+        THeader* header = nullptr;
+        // Find point to start defragmentation.
+        {
+            header = &GetStripeHeader(FindDefragmentationStripe(fullSize));
             // Search for free space to the right.
             uint64_t rightFreeSpace = 0;
             THeader* currentHeader = header;
@@ -430,15 +1186,39 @@ private:
             verify(rightFreeSpace >= fullSize);
         }
         UnregisterFreeSpace(*header);
+        bool restarted = false;
+        uint64_t trappedSpace = 0;
         while (true) {
             if (header->GetRightFreeSize(Data_.data()) >= fullSize) {
                 RegisterFreeSpace(*header);
-                return *header;
+                return header;
             }
             THeader& nextHeader = header->GetRightHeader(Data_.data());
-            verify(nextHeader.RightOffset != Data_.size()); // If there is no space - abort.
+            if (nextHeader.RightOffset == Data_.size()) {
+                // Without pins free space ahead is enough. With them the space is collected between pinned elements
+                // once from the leftest node, and the bubbles may still be too small.
+                verify(!Pins_.empty()); // If there is no space - abort.
+                RegisterFreeSpace(*header);
+                if (std::exchange(restarted, true)) {
+                    TrappedSpace_ = trappedSpace;
+                    return nullptr;
+                }
+                header = &RankNodes_[MaxSizeRank];
+                UnregisterFreeSpace(*header);
+                continue;
+            }
 
             UnregisterFreeSpace(nextHeader);
+            if (IsPinned(nextHeader.GetOwnIndex())) { // Barrier, the bubble starts again after it.
+                trappedSpace += restarted ? header->GetRightFreeSize(Data_.data()) : 0;
+                RegisterFreeSpace(*header);
+                header = &nextHeader;
+                continue;
+            }
+            if (evictor(nextHeader.GetOwnIndex())) {
+                RemoveElement(nextHeader); // Its space joins the bubble.
+                continue;
+            }
 
             const uint64_t nextFullSize = nextHeader.GetFullSize();
             const uint64_t oldNextOffset = nextHeader.GetFirstOffset(Data_.data());
@@ -453,13 +1233,314 @@ private:
 
             header->RightOffset = newNextOffset;
             afterNextHeader.LeftOffset = newNextOffset;
-            Positions_[nextHeader.OwnIndex] = newNextOffset;
+            SetPosition(nextHeader.GetOwnIndex(), newNextOffset);
+            MoveStripes(oldNextOffset, newNextOffset, nextFullSize);
+            UpdateStripeAnchor(nextHeader.GetOwnIndex(), newNextOffset);
+
+            std::memmove(Data_.data() + newNextOffset, Data_.data() + oldNextOffset, nextFullSize); // Now `nextHeader` is invalid.
+            DefragmentatedBytes_ += nextFullSize;
+
+            header = &header->GetRightHeader(Data_.data());
+        }
+    }
+
+    // Resumable compaction. Free space to the right of the cursor header is a "bubble":
+    // every step moves the right neighbour of the cursor to the left, so the bubble grows and travels to the right
+    // until the sweep ends and starts again from the leftmost node.
+    // Stops when the bubble is at least `fullSize` (returns its header) or when `byteBudget` is spent (returns nullptr).
+    // Moved bytes are charged to the budget, skipped headers are charged sizeof(THeader) each.
+    // At least one step is done, so one element larger than the budget does not stop the progress.
+    // Cold elements are dropped by `evictor` as in `Defragmentate`, that is charged sizeof(THeader).
+    template <typename TEvictor>
+    THeader* DefragmentateIncrementally(uint64_t fullSize, uint64_t byteBudget, TEvictor&& evictor)
+    {
+        uint64_t spentBudget = 0;
+        while (true) {
+            THeader& header = GetCompactionCursorHeader();
+            if (header.GetRightFreeSize(Data_.data()) >= fullSize) {
+                return &header;
+            }
+            if (spentBudget >= byteBudget) {
+                return nullptr;
+            }
+            THeader& nextHeader = header.GetRightHeader(Data_.data());
+            if (nextHeader.RightOffset == Data_.size()) { // Next is the rightest node. Sweep is finished.
+                Compacted_ = !SweepDirty_;
+                SweepDirty_ = false;
+                CompactionCursor_ = NilIndex;
+                spentBudget += sizeof(THeader);
+                if (Compacted_) { // A clean sweep left no gaps to merge. For a `fullSize` it happens only with pins.
+                    return nullptr;
+                }
+                continue;
+            }
+            if (IsPinned(nextHeader.GetOwnIndex())) { // Barrier.
+                CompactionCursor_ = nextHeader.GetOwnIndex();
+                spentBudget += sizeof(THeader);
+                continue;
+            }
+            if (evictor(nextHeader.GetOwnIndex())) {
+                UnregisterFreeSpace(header);
+                UnregisterFreeSpace(nextHeader);
+                RemoveElement(nextHeader);
+                RegisterFreeSpace(header);
+                spentBudget += sizeof(THeader);
+                continue;
+            }
+            if (header.GetRightFreeSize(Data_.data()) == 0) {
+                CompactionCursor_ = nextHeader.GetOwnIndex();
+                spentBudget += sizeof(THeader);
+                continue;
+            }
+
+            UnregisterFreeSpace(header);
+            UnregisterFreeSpace(nextHeader);
+
+            const TIndex nextIndex = nextHeader.GetOwnIndex();
+            const uint64_t nextFullSize = nextHeader.GetFullSize();
+            const uint64_t oldNextOffset = nextHeader.GetFirstOffset(Data_.data());
+            const uint64_t newNextOffset = header.GetLastOffset(Data_.data());
+            THeader& afterNextHeader = nextHeader.GetRightHeader(Data_.data());
+
+            header.RightOffset = newNextOffset;
+            afterNextHeader.LeftOffset = newNextOffset;
+            SetPosition(nextIndex, newNextOffset);
+            MoveStripes(oldNextOffset, newNextOffset, nextFullSize);
+            UpdateStripeAnchor(nextIndex, newNextOffset);
 
             std::memmove(Data_.data() + newNextOffset, Data_.data() + oldNextOffset, nextFullSize); // Now `nextHeader` is invalid.
             DefragmentatedBytes_ += nextFullSize;
+            SweepDirty_ = true;
+            spentBudget += nextFullSize;
+
+            RegisterFreeSpace(GetHeader(nextIndex));
+            CompactionCursor_ = nextIndex;
+        }
+    }
+
+    // Takes the start of the gap to the right of `header`, that holds the element.
+    TIndex AllocateAfter(THeader& header, uint64_t size)
+    {
+        const uint64_t fullSize = RoundValueSize(size) + sizeof(THeader);
+        ElementsCount_ += 1;
+        OccupiedSpace_ += fullSize;
+        const auto idx = AllocateIndex();
+
+        UnregisterFreeSpace(header);
+        THeader& newHeader = *reinterpret_cast<THeader*>(Data_.data() + header.GetLastOffset(Data_.data()));
+        const uint64_t newHeaderOffset = newHeader.GetFirstOffset(Data_.data());
+        SetPosition(idx, newHeaderOffset);
+        OccupyStripes(newHeaderOffset, fullSize);
+        UpdateStripeAnchor(idx, newHeaderOffset);
+        newHeader.SetOwnIndex(idx);
+        newHeader.ValueSize = size;
+        newHeader.ClockCounter = 1;
+        newHeader.RightOffset = header.RightOffset;
+        newHeader.LeftOffset = header.GetFirstOffset(Data_.data());
+        header.RightOffset = newHeaderOffset;
+        newHeader.GetRightHeader(Data_.data()).LeftOffset = newHeaderOffset;
+        RegisterFreeSpace(header);
+        RegisterFreeSpace(newHeader);
+        return idx;
+    }
+
+    bool IsPinned(TIndex index)
+    {
+        return !Pins_.empty() && Pins_.contains(index);
+    }
+
+    // `Free` of an unpinned element, that and its left neighbour are out of the free lists.
+    // The left neighbour takes the space.
+    void RemoveElement(THeader& header)
+    {
+        const TIndex index = header.GetOwnIndex();
+        --ElementsCount_;
+        verify(OccupiedSpace_ >= OccupiedMetaSize_ + header.GetFullSize());
+        OccupiedSpace_ -= header.GetFullSize();
+        auto& leftHeader = header.GetLeftHeader(Data_.data());
+        auto& rightHeader = header.GetRightHeader(Data_.data());
+        if (index == CompactionCursor_) {
+            CompactionCursor_ = leftHeader.GetOwnIndex(); // Left one takes freed space.
+        }
+        if (index == ClockHand_) {
+            ClockHand_ = leftHeader.GetOwnIndex();
+        }
+        const uint64_t offset = header.GetFirstOffset(Data_.data());
+        ReleaseStripes(offset, header.GetFullSize());
+        if (auto& anchor = StripeAnchors_[offset >> StripeBits_]; anchor.Index == index) {
+            const uint64_t rightOffset = rightHeader.GetFirstOffset(Data_.data());
+            const bool sameStripe = rightOffset >> StripeBits_ == offset >> StripeBits_;
+            anchor = {sameStripe ? rightHeader.GetOwnIndex() : NilIndex, rightOffset};
+        }
+        Compacted_ = false;
+        SweepDirty_ = true;
+        leftHeader.RightOffset = header.RightOffset;
+        rightHeader.LeftOffset = header.LeftOffset;
+        FreeIndex(index);
+    }
+
+    // Stripes are 1 MB, smaller in small buffers, so there are enough of them to choose from.
+    // Rebuilt from the address list, it is two nodes after `Clear`.
+    void ResetStripes()
+    {
+        StripeBits_ = std::clamp<int>(std::bit_width(Data_.size() / 64) - 1, 12, 20);
+        const uint64_t count = (Data_.size() + (1ull << StripeBits_) - 1) >> StripeBits_;
+        StripeLeaves_ = std::bit_ceil(count);
+        StripeTree_.assign(2 * StripeLeaves_, 0);
+        StripeAnchors_.assign(count, {NilIndex, 0});
+        for (uint64_t stripe = 0; stripe < count; ++stripe) {
+            StripeTree_[StripeLeaves_ + stripe] = GetStripeSize(stripe);
+        }
+        DirtyStripesBegin_ = 0;
+        DirtyStripesEnd_ = count;
+        THeader* header = &RankNodes_[MaxSizeRank];
+        OccupyStripes(0, header->GetLastOffset(Data_.data()));
+        while (header->RightOffset != Data_.size()) {
+            header = &header->GetRightHeader(Data_.data());
+            const uint64_t offset = header->GetFirstOffset(Data_.data());
+            OccupyStripes(offset, header->GetFullSize());
+            if (header->GetOwnIndex() != NilIndex) {
+                UpdateStripeAnchor(header->GetOwnIndex(), offset);
+            }
+        }
+    }
 
+    uint64_t GetStripeSize(uint64_t stripe)
+    {
+        return std::min<uint64_t>(Data_.size() - (stripe << StripeBits_), 1ull << StripeBits_);
+    }
+
+    void OccupyStripes(uint64_t offset, uint64_t size)
+    {
+        UpdateStripes(offset, size, false);
+    }
+
+    void ReleaseStripes(uint64_t offset, uint64_t size)
+    {
+        UpdateStripes(offset, size, true);
+    }
+
+    // An element of `size` bytes moved left from `oldOffset`. Only the bytes that changed state are updated,
+    // not the whole bubble it crossed, that is megabytes at the end of a long compaction.
+    void MoveStripes(uint64_t oldOffset, uint64_t newOffset, uint64_t size)
+    {
+        const uint64_t changed = std::min(oldOffset - newOffset, size);
+        OccupyStripes(newOffset, changed);
+        ReleaseStripes(oldOffset + size - changed, changed);
+    }
+
+    // Only leaves are updated, a compaction moves thousands of elements and the tree is read once per `Defragmentate`.
+    void UpdateStripes(uint64_t offset, uint64_t size, bool release)
+    {
+        if (size == 0) {
+            return;
+        }
+        const uint64_t end = offset + size;
+        DirtyStripesBegin_ = std::min(DirtyStripesBegin_, offset >> StripeBits_);
+        DirtyStripesEnd_ = std::max(DirtyStripesEnd_, ((end - 1) >> StripeBits_) + 1);
+        while (offset < end) {
+            const uint64_t stripe = offset >> StripeBits_;
+            const uint64_t stripeEnd = std::min(end, (stripe + 1) << StripeBits_);
+            if (release) {
+                StripeTree_[StripeLeaves_ + stripe] += stripeEnd - offset;
+            } else {
+                StripeTree_[StripeLeaves_ + stripe] -= stripeEnd - offset;
+            }
+            offset = stripeEnd;
+        }
+    }
+
+    void FlushStripes()
+    {
+        if (DirtyStripesBegin_ >= DirtyStripesEnd_) {
+            return;
+        }
+        uint64_t begin = StripeLeaves_ + DirtyStripesBegin_;
+        uint64_t end = StripeLeaves_ + DirtyStripesEnd_ - 1;
+        while (begin > 1) {
+            begin /= 2;
+            end /= 2;
+            for (uint64_t node = begin; node <= end; ++node) {
+                StripeTree_[node] = std::max(StripeTree_[2 * node], StripeTree_[2 * node + 1]);
+            }
+        }
+        DirtyStripesBegin_ = std::numeric_limits<uint64_t>::max();
+        DirtyStripesEnd_ = 0;
+    }
+
+    // Anchor is the leftmost element of a stripe as far as known, it may be stale after moves,
+    // so it is checked on use. Compaction starts from the left neighbour of the anchor.
+    void UpdateStripeAnchor(TIndex index, uint64_t offset)
+    {
+        auto& anchor = StripeAnchors_[offset >> StripeBits_];
+        if (anchor.Index == NilIndex || offset <= anchor.Offset) {
+            anchor = {index, offset};
+        }
+    }
+
+    // The window of stripes with the fewest live bytes to move that has `fullSize` free bytes.
+    // Usually one stripe is enough, then it is the one with the most free bytes, the root of the tree.
+    uint64_t FindDefragmentationStripe(uint64_t fullSize)
+    {
+        FlushStripes();
+        if (StripeTree_[1] >= fullSize) {
+            uint64_t node = 1;
+            while (node < StripeLeaves_) {
+                node = StripeTree_[2 * node] == StripeTree_[node] ? 2 * node : 2 * node + 1;
+            }
+            return node - StripeLeaves_;
+        }
+        // Live bytes grow with the window, so for every end the shortest window with enough free bytes is the best.
+        uint64_t bestStripe = 0;
+        uint64_t bestLiveBytes = std::numeric_limits<uint64_t>::max();
+        uint64_t begin = 0;
+        uint64_t freeBytes = 0;
+        uint64_t windowSize = 0;
+        for (uint64_t end = 0; end < StripeAnchors_.size(); ++end) {
+            freeBytes += StripeTree_[StripeLeaves_ + end];
+            windowSize += GetStripeSize(end);
+            while (freeBytes - StripeTree_[StripeLeaves_ + begin] >= fullSize) {
+                freeBytes -= StripeTree_[StripeLeaves_ + begin];
+                windowSize -= GetStripeSize(begin);
+                ++begin;
+            }
+            if (freeBytes >= fullSize && windowSize - freeBytes < bestLiveBytes) {
+                bestLiveBytes = windowSize - freeBytes;
+                bestStripe = begin;
+            }
+        }
+        return bestStripe;
+    }
+
+    // The header that covers the begin of `stripe` if its anchor is valid, otherwise it is found
+    // by walking from a valid anchor to the left, and the anchor is repaired.
+    THeader& GetStripeHeader(uint64_t stripe)
+    {
+        THeader* header = &RankNodes_[MaxSizeRank];
+        for (uint64_t current = stripe + 1; current-- > 0;) {
+            const auto [index, offset] = StripeAnchors_[current];
+            if (index < Positions_.size() && Positions_[index] >= 0 && GetPosition(index) == offset) {
+                header = &GetHeader(index);
+                if (current == stripe) {
+                    return header->GetLeftHeader(Data_.data());
+                }
+                break;
+            }
+        }
+        const uint64_t stripeBegin = stripe << StripeBits_;
+        while (header->RightOffset <= stripeBegin) {
             header = &header->GetRightHeader(Data_.data());
         }
+        THeader& rightHeader = header->GetRightHeader(Data_.data());
+        if (rightHeader.GetOwnIndex() != NilIndex && rightHeader.GetFirstOffset(Data_.data()) >> StripeBits_ == stripe) {
+            StripeAnchors_[stripe] = {rightHeader.GetOwnIndex(), rightHeader.GetFirstOffset(Data_.data())};
+        }
+        return *header;
+    }
+
+    THeader& GetCompactionCursorHeader()
+    {
+        return CompactionCursor_ == NilIndex ? RankNodes_[MaxSizeRank] : GetHeader(CompactionCursor_);
     }
 
     void UnregisterFreeSpace(THeader& header)
@@ -469,7 +1550,7 @@ private:
             return;
         }
         if (header.LeftInRankOffset == header.RightInRankOffset) { // If it was last element.
-            AvailableRanks_.Reset(GetRank(freeSize));
+            AvailableRanks_.Reset(TSizeClasses::Get(freeSize));
         }
         header.GetLeftInRankHeader(Data_.data()).RightInRankOffset = header.RightInRankOffset;
         header.GetRightInRankHeader(Data_.data()).LeftInRankOffset = header.LeftInRankOffset;
@@ -485,7 +1566,7 @@ private:
         if (freeSize == 0) {
             return;
         }
-        const int rank = GetRank(freeSize);
+        const int rank = TSizeClasses::Get(freeSize);
         const uint64_t offset = header.GetFirstOffset(Data_.data());
         THeader& rankNodeHeader = RankNodes_[rank];
         const uint64_t rankNodeOffset = rankNodeHeader.GetFirstOffset(Data_.data());
@@ -509,31 +1590,44 @@ private:
     {
         if (FirstFreeIndex_ == NilIndex) {
             TIndex idx = Positions_.size();
-            Positions_.resize(std::max<size_t>(Positions_.size(), 2u) * 3 / 2);
+            Positions_.resize(Positions_.IsFixed() ? Positions_.capacity() : std::max<size_t>(Positions_.size(), 2u) * 3 / 2);
             for (; idx < Positions_.size(); idx++) {
                 FreeIndex(idx);
             }
         }
         auto idx = FirstFreeIndex_;
-        FirstFreeIndex_ = -(Positions_[idx] + 2);
+        const uint64_t next = -1 - static_cast<int64_t>(Positions_[idx]);
+        FirstFreeIndex_ = next == 0 ? NilIndex : next - 1;
         return idx;
     }
 
+    // -1 is the end of the list, -2 - k is the next free index k, so it fits into int32_t too.
     void FreeIndex(TIndex index)
     {
-        Positions_[index] = -static_cast<int64_t>(FirstFreeIndex_ + 2);
+        Positions_[index] = FirstFreeIndex_ == NilIndex ? -1 : -2 - static_cast<int64_t>(FirstFreeIndex_);
         FirstFreeIndex_ = index;
     }
 
+    uint64_t GetPosition(TIndex index)
+    {
+        return static_cast<uint64_t>(Positions_[index]) * PositionUnit;
+    }
+
+    void SetPosition(TIndex index, uint64_t offset)
+    {
+        assert(offset % PositionUnit == 0);
+        Positions_[index] = offset / PositionUnit;
+    }
+
     THeader& GetHeader(TIndex index)
     {
         assert(index < Positions_.size() && Positions_[index] >= 0);
-        return *reinterpret_cast<THeader*>(Data_.data() + Positions_[index]);
+        return *reinterpret_cast<THeader*>(Data_.data() + GetPosition(index));
     }
 
     TValue GetValue(TIndex index)
     {
-        return {Data_.data() + Positions_[index] + sizeof(THeader), GetHeader(index).ValueSize};
+        return {Data_.data() + GetPosition(index) + sizeof(THeader), GetHeader(index).ValueSize};
     }
 
 private:
@@ -541,27 +1635,343 @@ private:
 
     TBitMask<MaxSizeRank + 1> AvailableRanks_;
 
-    std::vector<char> Data_;
+    struct TSnapshotHeader
+    {
+        uint64_t Magic;
+        uint64_t Version;
+        // Layout checks, a map of another storage type would misread headers.
+        uint64_t HeaderOffsetBits;
+        uint64_t HeaderSizeBits;
+        uint64_t HeaderIndexBits;
+        uint64_t SizeClassesLayout;
+        uint64_t PositionSize;
+        uint64_t DataSize;
+        uint64_t PositionsCount;
+        uint64_t FirstFreeIndex;
+        uint64_t ElementsCount;
+        uint64_t OccupiedSpace;
+        uint64_t DefragmentatedBytes;
+        TBitMask<MaxSizeRank + 1> AvailableRanks;
+    };
+    static_assert(sizeof(TSnapshotHeader) <= SnapshotDataOffset);
+
+    // Mapping of the tables in one block mode and of the buffer.
+    TMmapBuffer Block_;
+    std::span<char> Data_;
+    std::span<char> ExtraMeta_;
+    uint64_t MaxElementsCount_;
     THeader* RankNodes_;
 
-    // Overhead per one element is sizeof(char*) * 3 / 2 = 12.
-    // Positions_[idx] >= 0 -> it is a position of idx node in Data_,
-    // Positions_[idx] < 0 -> -(Positions_[idx] + 1) is a next free node index (can be nil).
-    std::vector<int64_t> Positions_;
+    // Overhead per one element is sizeof(TPosition) * 3 / 2 = 12 or 6.
+    // Positions_[idx] >= 0 -> it is a position of idx node in Data_ in `PositionUnit`s,
+    // Positions_[idx] < 0 -> a next free node index, see `FreeIndex`.
+    TMetaVector<TPosition> Positions_;
     TIndex FirstFreeIndex_ = NilIndex;
 
     uint64_t ElementsCount_ = 0;
     uint64_t OccupiedSpace_ = 0;
     uint64_t DefragmentatedBytes_ = 0;
-};
 
-#ifdef TRIVIAL_STORAGE
-using TStringsStorage = TTrivialStringsStorage;
-std::string RunDesc = "Mode: TRIVIAL";
-#else
-using TStringsStorage = TBlobStringsStorage;
-std::string RunDesc = "Mode: BLOB";
-#endif
+    // Resumable compaction state. Cursor is an index, so it survives moves of the element. NilIndex is the leftest node.
+    uint64_t DefragmentationBytesPerAllocation_ = 0;
+    TIndex CompactionCursor_ = NilIndex;
+    bool SweepDirty_ = false; // Something was moved or freed since the sweep start.
+    bool Compacted_ = false;
+
+    std::unordered_map<TIndex, TPinState> Pins_;
+    uint64_t TrappedSpace_ = 0;
+
+    // Free bytes per stripe of Data_ are leaves of a max segment tree, see `FindDefragmentationStripe`.
+    // Inner nodes over the dirty leaves are stale until `FlushStripes`.
+    // It is small and allocated once, so it stays in the heap in one block mode.
+    struct TStripeAnchor
+    {
+        TIndex Index;
+        uint64_t Offset;
+    };
+    int StripeBits_ = 20;
+    uint64_t StripeLeaves_ = 0;
+    std::vector<uint32_t> StripeTree_;
+    uint64_t DirtyStripesBegin_ = 0;
+    uint64_t DirtyStripesEnd_ = 0;
+    std::vector<TStripeAnchor> StripeAnchors_;
+
+    // Last element visited by `NextClockVictim`, NilIndex is the leftest node. Like the cursor, survives moves.
+    TIndex ClockHand_ = NilIndex;
+};
+
+using TBlobStringsStorage = TBasicBlobStringsStorage<int64_t>;
+// Buffers up to 8 GB and entries up to 64 MB, 24-byte headers and half of the index.
+using TCompactBlobStringsStorage = TBasicBlobStringsStorage<int32_t, 33, 26, 32>;
+
+// Values up to `slotSize` bytes (map entries with small keys and values) live in fixed size slots
+// of a separate buffer, larger ones in `TLargeStorage`. A slot costs `slotSize` bytes and a size byte:
+// no storage header, no rounding, no position, and slots are never moved, so there is no compaction for them.
+// Index spaces are interleaved, even indexes are slots, so indexes stay dense for eviction policies.
+// Pools do not share space. CLOCK evicts from the pool that was short in the last `HasSpaceFor`,
+// other policies evict in their order until the short pool gets space.
+template <typename TLargeStorage = TBlobStringsStorage>
+class TSmallSlotsStringsStorage
+{
+public:
+    using TIndex = typename TLargeStorage::TIndex;
+    using TValue = typename TLargeStorage::TValue;
+    static inline constexpr TIndex NilIndex = TLargeStorage::NilIndex;
+    static inline constexpr TValue NilValue = TLargeStorage::NilValue;
+    static constexpr uint64_t MaxSlotSize = 252;
+
+    TSmallSlotsStringsStorage(uint64_t largeBufferSize, uint64_t slotsBufferSize, uint64_t slotSize,
+                              uint64_t defragmentationBytesPerAllocation = 0, TBufferOptions bufferOptions = TBufferOptions())
+        : Large_(largeBufferSize, defragmentationBytesPerAllocation, bufferOptions)
+        , LargeBufferSize_(largeBufferSize)
+        , SlotSize_(std::max<uint64_t>((slotSize + 3) & ~3ull, 4)) // Map headers in slots are 4-byte aligned.
+        , SlotsCount_(std::min<uint64_t>(slotsBufferSize / SlotSize_, NilIndex / 2))
+        , Slots_(SlotsCount_ * SlotSize_, bufferOptions)
+    {
+        if (SlotSize_ > MaxSlotSize) {
+            throw std::runtime_error("too large slot size");
+        }
+    }
+
+    bool HasSpaceFor(uint64_t size)
+    {
+        if (size > SlotSize_) {
+            SlotsShort_ = false;
+            return Large_.HasSpaceFor(size);
+        }
+        SlotsShort_ = FirstFreeSlot_ == NilSlot && SlotSizes_.size() == SlotsCount_;
+        return !SlotsShort_;
+    }
+
+    std::pair<TValue, TIndex> Allocate(uint64_t size)
+    {
+        auto allocated = TryAllocate(size);
+        if (allocated.second == NilIndex) {
+            throw std::runtime_error("no space");
+        }
+        return allocated;
+    }
+
+    // Nil instead of "no space", see `TLargeStorage::TryAllocate`.
+    std::pair<TValue, TIndex> TryAllocate(uint64_t size)
+    {
+        if (size > SlotSize_) {
+            auto [value, idx] = Large_.TryAllocate(size);
+            if (idx == NilIndex) {
+                return {NilValue, NilIndex};
+            }
+            verify(idx < NilIndex / 2);
+            return {value, idx * 2 + 1};
+        }
+        if (!HasSpaceFor(size)) {
+            return {NilValue, NilIndex};
+        }
+        uint32_t slot = FirstFreeSlot_;
+        if (slot != NilSlot) {
+            std::memcpy(&FirstFreeSlot_, GetSlot(slot), sizeof(FirstFreeSlot_));
+        } else {
+            slot = SlotSizes_.size();
+            SlotSizes_.push_back(FreeSlot);
+        }
+        SlotSizes_[slot] = size;
+        ++SlotElementsCount_;
+        return {{GetSlot(slot), size}, slot * 2};
+    }
+
+    TValue Get(TIndex index)
+    {
+        if (index % 2 == 1) {
+            return index == NilIndex ? NilValue : Large_.Get(index / 2);
+        }
+        const uint32_t slot = index / 2;
+        if (slot >= SlotSizes_.size() || SlotSizes_[slot] == FreeSlot) {
+            return NilValue;
+        }
+        return {GetSlot(slot), SlotSizes_[slot]};
+    }
+
+    bool Free(TIndex index)
+    {
+        if (index % 2 == 1) {
+            return index != NilIndex && Large_.Free(index / 2);
+        }
+        if (Get(index).data() == nullptr) {
+            return false;
+        }
+        if (auto it = Pins_.find(index); it != Pins_.end()) {
+            it->second.FreeOnUnpin = true;
+            return true;
+        }
+        const uint32_t slot = index / 2;
+        SlotSizes_[slot] = FreeSlot;
+        std::memcpy(GetSlot(slot), &FirstFreeSlot_, sizeof(FirstFreeSlot_));
+        FirstFreeSlot_ = slot;
+        --SlotElementsCount_;
+        return true;
+    }
+
+    uint64_t ElementsCount()
+    {
+        return Large_.ElementsCount() + SlotElementsCount_;
+    }
+
+    void Clear()
+    {
+        Large_.Clear();
+        SlotSizes_.clear();
+        FirstFreeSlot_ = NilSlot;
+        SlotElementsCount_ = 0;
+        SlotsShort_ = false;
+        ClockHand_ = 0;
+        Pins_.clear();
+    }
+
+    double FillRate()
+    {
+        return (Large_.FillRate() * LargeBufferSize_ + SlotElementsCount_ * SlotSize_) / (LargeBufferSize_ + Slots_.size());
+    }
+
+    uint64_t DefragmentatedBytes()
+    {
+        return Large_.DefragmentatedBytes();
+    }
+
+    bool DoHeavyWork(uint64_t byteBudget)
+    {
+        return Large_.DoHeavyWork(byteBudget);
+    }
+
+    // Slots have no counters.
+    void Touch(TIndex index)
+    {
+        if (index % 2 == 1) {
+            Large_.Touch(index / 2);
+        }
+    }
+
+    // Slots are evicted FIFO by slot number, pinned ones are skipped.
+    std::optional<TIndex> NextClockVictim()
+    {
+        if (!SlotsShort_) {
+            auto victim = Large_.NextClockVictim();
+            return victim ? std::optional<TIndex>(*victim * 2 + 1) : std::nullopt;
+        }
+        if (SlotElementsCount_ <= Pins_.size()) {
+            return std::nullopt;
+        }
+        do {
+            ClockHand_ = (ClockHand_ + 1) % SlotSizes_.size();
+        } while (SlotSizes_[ClockHand_] == FreeSlot || Pins_.contains(ClockHand_ * 2));
+        return ClockHand_ * 2;
+    }
+
+    void PrefetchIndex(TIndex index)
+    {
+        if (index % 2 == 1) {
+            Large_.PrefetchIndex(index / 2);
+        } else {
+            __builtin_prefetch(SlotSizes_.data() + index / 2);
+        }
+    }
+
+    void PrefetchValue(TIndex index)
+    {
+        if (index % 2 == 1) {
+            Large_.PrefetchValue(index / 2);
+        } else {
+            __builtin_prefetch(GetSlot(index / 2));
+        }
+    }
+
+    // Slots never move, so pins of them only defer `Free`.
+    void Pin(TIndex index)
+    {
+        if (index % 2 == 1) {
+            Large_.Pin(index / 2);
+            return;
+        }
+        assert(Get(index).data() != nullptr);
+        ++Pins_[index].Count;
+    }
+
+    void Unpin(TIndex index)
+    {
+        if (index % 2 == 1) {
+            Large_.Unpin(index / 2);
+            return;
+        }
+        auto it = Pins_.find(index);
+        assert(it != Pins_.end());
+        if (--it->second.Count == 0) {
+            const bool free = it->second.FreeOnUnpin;
+            Pins_.erase(it);
+            if (free) {
+                Free(index);
+            }
+        }
+    }
+
+private:
+    static constexpr uint32_t NilSlot = static_cast<uint32_t>(-1);
+    static constexpr uint8_t FreeSlot = 255;
+    static_assert(MaxSlotSize < FreeSlot);
+
+    char* GetSlot(uint32_t slot)
+    {
+        return Slots_.data() + static_cast<uint64_t>(slot) * SlotSize_;
+    }
+
+private:
+    TLargeStorage Large_;
+    uint64_t LargeBufferSize_;
+
+    uint64_t SlotSize_;
+    uint64_t SlotsCount_;
+    TMmapBuffer Slots_;
+    // Value size per slot, FreeSlot for free ones. Slots after the end were never used.
+    std::vector<uint8_t> SlotSizes_;
+    // Free slots are a list, the next one is in the first bytes of a slot.
+    uint32_t FirstFreeSlot_ = NilSlot;
+    uint64_t SlotElementsCount_ = 0;
+    bool SlotsShort_ = false;
+    uint32_t ClockHand_ = 0;
+    std::unordered_map<TIndex, TPinState> Pins_;
+};
+
+#ifdef TRIVIAL_STORAGE
+using TStringsStorage = TTrivialStringsStorage;
+std::string RunDesc = "Mode: TRIVIAL";
+#else
+using TStringsStorage = TBlobStringsStorage;
+std::string RunDesc = "Mode: BLOB";
+#endif
+
+void MB_FileMappingTest()
+{
+    const std::string path = "mb_file_mapping_test.bin";
+    const uint64_t pageSize = sysconf(_SC_PAGESIZE);
+    auto f = OpenFile(path, "w+b");
+    const std::string content(2 * pageSize, 'm');
+    WriteToFile(f.get(), content.data(), content.size());
+    verify(fflush(f.get()) == 0);
+
+    TMmapBuffer whole(fileno(f.get()), 0, content.size());
+    verify(std::string_view(whole.data(), whole.size()) == content);
+    TMmapBuffer tail(fileno(f.get()), pageSize, pageSize);
+    verify(tail.data()[pageSize - 1] == 'm');
+    // Past the end of file pages would be SIGBUS on access, so such regions are not mapped.
+    const std::pair<uint64_t, uint64_t> regions[] = {{0, 3 * pageSize}, {pageSize, pageSize + 1}, {4 * pageSize, 1}};
+    for (auto [offset, size] : regions) {
+        bool thrown = false;
+        try {
+            TMmapBuffer buffer(fileno(f.get()), offset, size);
+        } catch (const std::runtime_error&) {
+            thrown = true;
+        }
+        verify(thrown);
+    }
+    std::remove(path.c_str());
+}
 
 void SS_SimpleTest()
 {
@@ -576,7 +1986,7 @@ void SS_SimpleTest()
     static auto check = [&](TStringsStorage::TIndex index) {
         auto value = storage.Get(index);
         for (auto& e : value) {
-            verify(e == index);
+            verify(e == static_cast<char>(index));
         }
     };
 
@@ -605,363 +2015,2748 @@ void SS_SimpleTest()
     }
 }
 
-class TStrStrHashMap
+void SS_CompactPositionsTest()
 {
-public:
-    using TIndex = TStringsStorage::TIndex;
-    using TValue = TStringsStorage::TValue;
-    static inline constexpr TIndex NilIndex = TStringsStorage::NilIndex;
-    static inline constexpr TValue NilValue = TStringsStorage::NilValue;
+    // The same operations give the same indexes and values with both position types.
+    // Layouts differ: headers are smaller in the compact one, so gaps, their ranks and compacted windows differ too.
+    TBlobStringsStorage storage(1'000'000);
+    TCompactBlobStringsStorage compact(1'000'000);
+    std::vector<TBlobStringsStorage::TIndex> indexes;
+    srand(45);
+    for (int i = 0; i < 100'000; ++i) {
+        if (!indexes.empty() && (rand() % 3 == 0 || !storage.HasSpaceFor(1000))) {
+            const size_t j = rand() % indexes.size();
+            verify(storage.Free(indexes[j]) && compact.Free(indexes[j]));
+            indexes[j] = indexes.back();
+            indexes.pop_back();
+            continue;
+        }
+        const uint64_t size = rand() % 1000;
+        auto [val, idx] = storage.Allocate(size);
+        auto [compactVal, compactIdx] = compact.Allocate(size);
+        verify(idx == compactIdx);
+        std::memset(val.data(), idx, size);
+        std::memset(compactVal.data(), idx, size);
+        indexes.push_back(idx);
+    }
+    verify(storage.DefragmentatedBytes() > 0 && compact.DefragmentatedBytes() > 0);
+    for (auto idx : indexes) {
+        verify(compact.Get(idx).size() == storage.Get(idx).size());
+        for (auto& e : compact.Get(idx)) {
+            verify(e == static_cast<char>(idx));
+        }
+    }
 
-    TStrStrHashMap(uint64_t bufferSize)
-        : Storage_(bufferSize)
-    {
-        HashTable_.assign(1, NilIndex);
+    bool thrown = false;
+    try {
+        TCompactBlobStringsStorage tooLarge(9ull << 30);
+    } catch (const std::runtime_error&) {
+        thrown = true;
     }
+    verify(thrown);
+}
 
-    std::pair<TValue, TIndex> PutUnitialized(std::string_view key, uint64_t valueSize)
-    {
-        if (Storage_.ElementsCount() + 1 > HashTable_.size() * 2) { // Multiplier has significant effect on speed.
-            DoubleHashTable();
+void SS_NarrowHeaderTest()
+{
+    // 16-byte headers: buffers up to 16 MB, entries up to 4 KB, 256K elements.
+    using TNarrowStorage = TBasicBlobStringsStorage<int32_t, 24, 12, 18>;
+    TNarrowStorage storage(1'000'000);
+    std::vector<TNarrowStorage::TIndex> indexes;
+    while (storage.HasSpaceFor(100)) {
+        auto [val, idx] = storage.Allocate(100);
+        std::memset(val.data(), idx, val.size());
+        indexes.push_back(idx);
+    }
+    verify(indexes.size() > 1'000'000 / (100 + 16 + 4) * 9 / 10);
+    for (auto idx : indexes) {
+        verify(storage.Get(idx).size() == 100 && storage.Get(idx)[99] == static_cast<char>(idx));
+    }
+    verify(storage.Free(indexes[0]));
+    verify(storage.HasSpaceFor(100));
+
+    bool thrown = false;
+    try {
+        storage.HasSpaceFor(TNarrowStorage::MaxValueSize + 1);
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    verify(thrown);
+    thrown = false;
+    try {
+        TNarrowStorage tooLarge(32 << 20);
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    verify(thrown);
+}
+
+void SS_DefragmentationWindowTest()
+{
+    // Every 4th element is free, and 3 of 4 in one region. Compaction goes to that region,
+    // so a few elements are moved instead of a hundred from a random point.
+    TBlobStringsStorage storage(4'000'000);
+    std::vector<TBlobStringsStorage::TIndex> indexes;
+    while (storage.HasSpaceFor(1000)) {
+        auto [val, idx] = storage.Allocate(1000);
+        std::memset(val.data(), idx, val.size());
+        indexes.push_back(idx);
+    }
+    verify(indexes.size() > 3000);
+    for (size_t i = 0; i < indexes.size(); ++i) {
+        if (i % 4 == 0 || (i >= 2000 && i < 2400 && i % 4 != 3)) {
+            verify(storage.Free(indexes[i]));
+            indexes[i] = TBlobStringsStorage::NilIndex;
         }
+    }
+    verify(storage.DefragmentatedBytes() == 0);
+    auto [val, idx] = storage.Allocate(30'000);
+    verify(val.size() == 30'000);
+    verify(storage.DefragmentatedBytes() > 0 && storage.DefragmentatedBytes() < 20'000);
+    for (auto index : indexes) {
+        if (index != TBlobStringsStorage::NilIndex) {
+            verify(storage.Get(index).size() == 1000 && storage.Get(index)[999] == static_cast<char>(index));
+        }
+    }
+}
 
-        const uint64_t keyHash = Hash(key);
-        const uint64_t bucket = keyHash % HashTable_.size();
-        auto erasedIdx = EraseFromBucket(bucket, keyHash, key); // Remove old element if exists.
-        if (erasedIdx != NilIndex) {
-            Storage_.Free(erasedIdx);
+template <TFitPolicy FitPolicy>
+void SS_FitPolicyTest()
+{
+    // Layout is A B C D E. Gaps of B (1028 bytes) and D (1068 bytes) are in one rank, D is the first in the list.
+    TBasicBlobStringsStorage<int64_t, 38, 38, 32, FitPolicy> storage(1'000'000);
+    std::vector<char*> data;
+    std::vector<uint32_t> indexes;
+    for (uint64_t size : {1000, 1000, 1000, 1040, 1000}) {
+        auto [val, idx] = storage.Allocate(size);
+        data.push_back(val.data());
+        indexes.push_back(idx);
+    }
+    verify(storage.Free(indexes[1]));
+    verify(storage.Free(indexes[3]));
+
+    // The rank of 1028 bytes has gaps that fit, only Segregated goes to the tail. BestFit takes the exact one.
+    auto [exact, exactIdx] = storage.Allocate(1000);
+    char* const expected = FitPolicy == TFitPolicy::BestFit ? data[1] : data[3];
+    verify((exact.data() == expected) == (FitPolicy != TFitPolicy::Segregated));
+    verify(storage.Free(exactIdx));
+
+    // 1018 bytes fit every gap of the next rank. BestFit takes the least one.
+    auto [best, bestIdx] = storage.Allocate(990);
+    verify(best.data() == (FitPolicy == TFitPolicy::BestFit ? data[1] : data[3]));
+    verify(storage.DefragmentatedBytes() == 0);
+}
+
+void SS_SizeClassesTest()
+{
+    // A gap of 1068 bytes after A, the next allocation needs 1040. With 16 classes per power of two
+    // both are in [1024, 1088), so the gap is not guaranteed to fit and the allocation goes to the tail.
+    using TFineStorage = TBasicBlobStringsStorage<int64_t, 38, 38, 32, TFitPolicy::Segregated, TLogSizeClasses<4, 6, 2>>;
+    TBlobStringsStorage storage(1'000'000);
+    TFineStorage fine(1'000'000);
+    std::vector<char*> data;
+    std::vector<char*> fineData;
+    for (uint64_t size : {1000, 1040, 1000}) {
+        data.push_back(storage.Allocate(size).first.data());
+        fineData.push_back(fine.Allocate(size).first.data());
+    }
+    verify(storage.Free(1) && fine.Free(1));
+    verify(storage.Allocate(1010).first.data() > data[2]);
+    verify(fine.Allocate(1010).first.data() == fineData[1]);
+
+    // Sizes in every band of classes.
+    std::vector<TFineStorage::TIndex> indexes;
+    srand(45);
+    for (int i = 0; i < 20'000; ++i) {
+        const uint64_t size = rand() % 4 == 0 ? rand() % 100'000 : rand() % 5000;
+        if (!indexes.empty() && (rand() % 3 == 0 || !fine.HasSpaceFor(size))) {
+            const size_t j = rand() % indexes.size();
+            verify(fine.Free(indexes[j]));
+            indexes[j] = indexes.back();
+            indexes.pop_back();
+            continue;
+        }
+        auto [val, idx] = fine.Allocate(size);
+        std::memset(val.data(), idx, size);
+        indexes.push_back(idx);
+    }
+    verify(fine.DefragmentatedBytes() > 0);
+    for (auto idx : indexes) {
+        for (auto& e : fine.Get(idx)) {
+            verify(e == static_cast<char>(idx));
         }
+    }
+}
 
-        auto [sval, idx] = Storage_.Allocate(CalculateSize(key.size(), valueSize));
-        THeader& header = GetHeader(sval);
-        header.KeyHash = keyHash;
-        header.KeySize = key.size();
-        std::memcpy(sval.data() + sizeof(THeader), key.data(), header.KeySize);
+void SS_PinnedAllocateTest()
+{
+    constexpr uint64_t BufferSize = 100'000;
+    TBlobStringsStorage storage(BufferSize);
+    std::vector<TBlobStringsStorage::TIndex> indexes;
+    while (storage.HasSpaceFor(1000)) {
+        indexes.push_back(storage.Allocate(1000).second);
+    }
+    std::vector<TBlobStringsStorage::TIndex> pinned;
+    for (size_t i = 0; i < indexes.size(); ++i) {
+        if (i % 2) {
+            verify(storage.Free(indexes[i]));
+        } else {
+            storage.Pin(indexes[i]);
+            pinned.push_back(indexes[i]);
+        }
+    }
 
-        InsertToBucket(bucket, idx, header);
+    // Free space is enough in total, but pins split it into gaps of one element.
+    verify(storage.HasSpaceFor(3000));
+    verify(storage.DefragmentatedBytes() == 0); // The query moves nothing.
+    verify(storage.TryAllocate(3000).second == TBlobStringsStorage::NilIndex);
+    verify(!storage.HasSpaceFor(3000)); // Space before pins is not counted now.
+    bool thrown = false;
+    try {
+        storage.Allocate(3000);
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    verify(thrown);
 
-        return {GetValue(sval), idx};
+    for (auto idx : pinned) {
+        storage.Unpin(idx);
     }
+    verify(storage.HasSpaceFor(3000));
+    verify(storage.TryAllocate(3000).second != TBlobStringsStorage::NilIndex);
+}
 
-    std::pair<TValue, TIndex> Put(std::string_view key, std::string_view value)
-    {
-        auto [val, idx] = PutUnitialized(key, value.size());
-        std::memcpy(val.data(), value.data(), value.size());
-        return {val, idx};
+void SS_IncrementalDefragmentationTest()
+{
+    constexpr uint64_t BufferSize = 1000000;
+    constexpr uint64_t Budget = 4096;
+    TBlobStringsStorage storage(BufferSize, Budget);
+
+    std::vector<TBlobStringsStorage::TIndex> indexes;
+    auto check = [&]() {
+        for (auto idx : indexes) {
+            for (auto& e : storage.Get(idx)) {
+                verify(e == static_cast<char>(idx));
+            }
+        }
+    };
+
+    // Fill almost all space, then free every second element to get many small gaps.
+    while ((1 - storage.FillRate()) * BufferSize >= 1528) {
+        auto [val, idx] = storage.Allocate(1000);
+        std::memset(val.data(), idx, val.size());
+        indexes.push_back(idx);
+    }
+    std::vector<TBlobStringsStorage::TIndex> alive;
+    for (size_t i = 0; i < indexes.size(); ++i) {
+        if (i % 2) {
+            verify(storage.Free(indexes[i]));
+        } else {
+            alive.push_back(indexes[i]);
+        }
     }
+    indexes = alive;
+
+    // Gaps are too small, but merging two of them fits in the budget.
+    const uint64_t defragmentatedBytes = storage.DefragmentatedBytes();
+    auto [val, idx] = storage.Allocate(1500);
+    std::memset(val.data(), idx, val.size());
+    indexes.push_back(idx);
+    verify(storage.DefragmentatedBytes() > defragmentatedBytes);
+    verify(storage.DefragmentatedBytes() <= defragmentatedBytes + Budget + 1028);
+    check();
+
+    // Idle loop compacts everything, then all free space is one gap.
+    while (storage.DoHeavyWork(Budget)) {
+    }
+    verify(!storage.DoHeavyWork(Budget));
+    check();
+    const uint64_t compactedBytes = storage.DefragmentatedBytes();
+    auto [bigVal, bigIdx] = storage.Allocate((1 - storage.FillRate()) * BufferSize / 2);
+    std::memset(bigVal.data(), bigIdx, bigVal.size());
+    indexes.push_back(bigIdx);
+    verify(storage.DefragmentatedBytes() == compactedBytes);
+    check();
+
+    // Freeing makes it dirty again.
+    verify(storage.Free(indexes.front()));
+    indexes.erase(indexes.begin());
+    verify(storage.DoHeavyWork(Budget));
+    check();
+}
 
-    std::pair<TValue, TIndex> Get(std::string_view key)
+// Hashers for TStrStrHashMap: `uint64_t operator()(std::string_view) const`, as std::hash<std::string_view>.
+
+// Fast on long keys and seedable, unlike libstdc++ std::hash.
+struct TWyHasher
+{
+    uint64_t Seed = 0;
+
+    uint64_t operator()(std::string_view key) const
     {
-        const uint64_t keyHash = Hash(key);
-        auto [prevIdx, idx] = FindInBucket(keyHash % HashTable_.size(), keyHash, key);
-        return {Get(idx), idx};
+        return wyhash(key.data(), key.size(), Seed, _wyp);
     }
+};
 
-    TValue Get(TIndex index)
+// For keys that already start with a good hash, e.g. `keyHash` of trace logs. Only the first 8 bytes are read.
+struct TIdentityHasher
+{
+    uint64_t operator()(std::string_view key) const
     {
-        auto svalue = Storage_.Get(index);
-        if (svalue.data() == nullptr) {
-            return NilValue;
-        }
-        return GetValue(svalue);
+        uint64_t hash = 0;
+        std::memcpy(&hash, key.data(), std::min<size_t>(key.size(), sizeof(hash)));
+        return hash;
     }
+};
 
-    bool Erase(std::string_view key)
+// Eviction policies for TStrStrHashMap, as TCleaner of the dkudimov prototype.
+// The map reports every element it adds, touches by Get and removes, and asks for victims when Put does not fit.
+// Hooks get the storage of the map, so a policy may keep its state in element headers.
+// Get calls `OnElementTouch` and `OnKeyLookup`, so with any policy but TNoEviction Get writes policy state
+// or headers and is not safe from concurrent readers.
+// Key hashes of lookups and `Admit` are for admission filters: Put of a new key that needs eviction
+// returns NilIndex if `Admit(keyHash, victimKeyHash)` is false for the first victim, before anything is evicted.
+// `CanRemoveOnCompaction` elements are dropped by compaction instead of being moved, without `Admit`.
+
+// Put throws "no space" when the buffer is full.
+struct TNoEviction
+{
+    using TIndex = TStringsStorage::TIndex;
+
+    void OnElementAdd(auto&, TIndex)
+    { }
+
+    void OnElementTouch(auto&, TIndex)
+    { }
+
+    void OnElementRemove(auto&, TIndex)
+    { }
+
+    std::optional<TIndex> GetElementToRemove(auto&)
     {
-        const uint64_t keyHash = Hash(key);
-        auto erasedIdx = EraseFromBucket(keyHash % HashTable_.size(), keyHash, key);
-        if (erasedIdx == NilIndex) {
-            return false;
-        }
-        bool success = Storage_.Free(erasedIdx);
-        assert(success);
-        return true;;
+        return std::nullopt;
     }
 
-    bool Erase(TIndex index)
+    bool CanRemoveOnCompaction(auto&, TIndex)
     {
-        auto sval = Storage_.Get(index);
-        if (sval.data() == nullptr) {
-            return false;
-        }
-        auto& header = GetHeader(sval);
-        auto erasedIdx = EraseFromBucket(header.KeyHash % HashTable_.size(), header.KeyHash, GetKey(sval));
-        assert(index == erasedIdx);
+        return false;
+    }
+
+    void OnKeyLookup(uint64_t)
+    { }
 
-        bool success = Storage_.Free(erasedIdx);
-        assert(success);
+    bool Admit(uint64_t, uint64_t)
+    {
         return true;
     }
 
     void Clear()
+    { }
+};
+
+// Least recently used (Put or Get). Intrusive list over element indexes: 8 bytes per element, no allocations on Get.
+class TLruEviction
+{
+public:
+    using TIndex = TStringsStorage::TIndex;
+    static inline constexpr TIndex NilIndex = TStringsStorage::NilIndex;
+
+    void OnElementAdd(auto&, TIndex index)
     {
-        Storage_.Clear();
-        HashTable_.assign(1, NilIndex);
+        if (index >= Links_.size()) {
+            Links_.resize(std::max<size_t>(index + 1, Links_.size() * 3 / 2));
+        }
+        LinkBack(index);
     }
 
-    uint64_t ElementsCount()
+    void OnElementTouch(auto&, TIndex index)
     {
-        return Storage_.ElementsCount();
+        Unlink(index);
+        LinkBack(index);
     }
 
-    double FillRate()
+    void OnElementRemove(auto&, TIndex index)
     {
-        return Storage_.FillRate();
+        Unlink(index);
     }
 
-    uint64_t DefragmentatedBytes()
+    std::optional<TIndex> GetElementToRemove(auto&)
     {
-        return Storage_.DefragmentatedBytes();
+        if (Head_ == NilIndex) {
+            return std::nullopt;
+        }
+        return Head_;
     }
 
-private:
-    struct __attribute__ ((__packed__)) alignas(TIndex) THeader
+    // The list has no ranks, so the order stays exact.
+    bool CanRemoveOnCompaction(auto&, TIndex)
     {
-        static constexpr uint64_t KeyHashMask = (1ull << 56) - 1;
+        return false;
+    }
 
-        uint64_t KeyHash : 56;
-        uint64_t KeySize : 40;
-        TIndex ListNext;
+    void OnKeyLookup(uint64_t)
+    { }
+
+    bool Admit(uint64_t, uint64_t)
+    {
+        return true;
+    }
+
+    void Clear()
+    {
+        Links_.clear();
+        Head_ = NilIndex;
+        Tail_ = NilIndex;
+    }
+
+private:
+    struct TLinks
+    {
+        TIndex Prev = NilIndex;
+        TIndex Next = NilIndex;
     };
-    static_assert(alignof(THeader) == 4);
-    static_assert(sizeof(THeader) == 16); // Not invariant, just check.
 
-    uint64_t Hash(std::string_view key)
+    void LinkBack(TIndex index)
     {
-        return std::hash<std::string_view>{}(key) & THeader::KeyHashMask;
+        Links_[index] = {Tail_, NilIndex};
+        (Tail_ == NilIndex ? Head_ : Links_[Tail_].Next) = index;
+        Tail_ = index;
     }
 
-    uint64_t CalculateSize(uint64_t keySize, uint64_t valueSize)
+    void Unlink(TIndex index)
     {
-        return sizeof(THeader) + keySize + valueSize;
+        auto [prev, next] = Links_[index];
+        (prev == NilIndex ? Head_ : Links_[prev].Next) = next;
+        (next == NilIndex ? Tail_ : Links_[next].Prev) = prev;
     }
 
-    THeader& GetHeader(TValue svalue)
+private:
+    std::vector<TLinks> Links_; // The oldest is `Head_`.
+    TIndex Head_ = NilIndex;
+    TIndex Tail_ = NilIndex;
+};
+
+// CLOCK with 2-bit counters in storage headers. No state of its own: no allocations, and Get
+// only increments the counter in the header it has just read, while LRU relinks two neighbours.
+struct TClockEviction
+{
+    using TIndex = TStringsStorage::TIndex;
+
+    void OnElementAdd(auto&, TIndex)
+    { }
+
+    void OnElementTouch(auto& storage, TIndex index)
+    {
+        storage.Touch(index);
+    }
+
+    void OnElementRemove(auto&, TIndex)
+    { }
+
+    std::optional<TIndex> GetElementToRemove(auto& storage)
+    {
+        return storage.NextClockVictim();
+    }
+
+    // The hand goes in address order too, compaction is one more hand over its window.
+    bool CanRemoveOnCompaction(auto& storage, TIndex index)
+    {
+        return storage.IsClockCold(index);
+    }
+
+    void OnKeyLookup(uint64_t)
+    { }
+
+    bool Admit(uint64_t, uint64_t)
+    {
+        return true;
+    }
+
+    void Clear()
+    { }
+};
+
+// TinyLFU admission in front of another policy: a new key that needs eviction is admitted only if
+// it was looked up more often than the victim. Frequencies are estimated by a count-min sketch
+// of 4-bit counters keyed on the key hash, all counters are halved every 10 * `countersPerRow` lookups,
+// so the history fades. Put of a key that was never looked up is not admitted into a full map.
+template <typename TEvictionPolicy = TLruEviction>
+class TTinyLfuAdmission
+{
+public:
+    using TIndex = TStringsStorage::TIndex;
+
+    // `countersPerRow` is rounded up to a power of two, memory is 2 bytes per one.
+    TTinyLfuAdmission(uint64_t countersPerRow = 1 << 16, TEvictionPolicy evictionPolicy = TEvictionPolicy())
+        : RowBits_(std::max(64 - __builtin_clzll(std::max<uint64_t>(countersPerRow, CountersPerWord) - 1), 4))
+        , SampleSize_(10ull << RowBits_)
+        , Counters_(RowsCount << (RowBits_ - 4))
+        , EvictionPolicy_(std::move(evictionPolicy))
+    { }
+
+    void OnElementAdd(auto& storage, TIndex index)
+    {
+        EvictionPolicy_.OnElementAdd(storage, index);
+    }
+
+    void OnElementTouch(auto& storage, TIndex index)
+    {
+        EvictionPolicy_.OnElementTouch(storage, index);
+    }
+
+    void OnElementRemove(auto& storage, TIndex index)
+    {
+        EvictionPolicy_.OnElementRemove(storage, index);
+    }
+
+    std::optional<TIndex> GetElementToRemove(auto& storage)
+    {
+        return EvictionPolicy_.GetElementToRemove(storage);
+    }
+
+    bool CanRemoveOnCompaction(auto& storage, TIndex index)
+    {
+        return EvictionPolicy_.CanRemoveOnCompaction(storage, index);
+    }
+
+    void OnKeyLookup(uint64_t keyHash)
+    {
+        for (uint64_t row = 0; row < RowsCount; ++row) {
+            auto [word, shift] = GetCounter(keyHash, row);
+            if (((*word >> shift) & CounterMask) != CounterMask) {
+                *word += 1ull << shift;
+            }
+        }
+        if (++LookupsCount_ == SampleSize_) {
+            Age();
+        }
+        EvictionPolicy_.OnKeyLookup(keyHash);
+    }
+
+    bool Admit(uint64_t keyHash, uint64_t victimKeyHash)
+    {
+        return Estimate(keyHash) > Estimate(victimKeyHash) && EvictionPolicy_.Admit(keyHash, victimKeyHash);
+    }
+
+    uint64_t Estimate(uint64_t keyHash)
+    {
+        uint64_t estimate = CounterMask;
+        for (uint64_t row = 0; row < RowsCount; ++row) {
+            auto [word, shift] = GetCounter(keyHash, row);
+            estimate = std::min(estimate, (*word >> shift) & CounterMask);
+        }
+        return estimate;
+    }
+
+    void Clear()
+    {
+        std::fill(Counters_.begin(), Counters_.end(), 0);
+        LookupsCount_ = 0;
+        EvictionPolicy_.Clear();
+    }
+
+    TEvictionPolicy& EvictionPolicy()
+    {
+        return EvictionPolicy_;
+    }
+
+private:
+    static constexpr uint64_t RowsCount = 4;
+    static constexpr uint64_t CountersPerWord = 16;
+    static constexpr uint64_t CounterMask = 15;
+    static constexpr uint64_t RowSeeds[RowsCount] = {
+        0x9E3779B97F4A7C15ull, 0xC2B2AE3D27D4EB4Full, 0x165667B19E3779F9ull, 0xD6E8FEB86659FD93ull};
+
+    // (word, shift of the counter in it)
+    std::pair<uint64_t*, uint64_t> GetCounter(uint64_t keyHash, uint64_t row)
+    {
+        const uint64_t counter = (keyHash * RowSeeds[row]) >> (64 - RowBits_);
+        return {&Counters_[(row << (RowBits_ - 4)) + counter / CountersPerWord], counter % CountersPerWord * 4};
+    }
+
+    void Age()
+    {
+        for (auto& word : Counters_) {
+            word = (word >> 1) & 0x7777777777777777ull;
+        }
+        LookupsCount_ /= 2;
+    }
+
+private:
+    const int RowBits_;
+    const uint64_t SampleSize_;
+    std::vector<uint64_t> Counters_;
+    uint64_t LookupsCount_ = 0;
+    TEvictionPolicy EvictionPolicy_;
+};
+
+// GreedyDual-Size-Frequency: evicts the element with the least `Inflation + Frequency * Cost(size) / size`,
+// where Inflation is the priority of the last victim, so old frequencies fade.
+// Cost(size) = 1 + `byteCost` * size: 0 favors small elements (object hit rate), large values
+// make it size neutral LFU with aging (byte hit rate). Size is of the whole element in the storage.
+// Indexed binary heap outside of the buffer, 20 bytes per element, O(log n) Put, Get and Erase.
+class TGdsfEviction
+{
+public:
+    using TIndex = TStringsStorage::TIndex;
+    static inline constexpr TIndex NilIndex = TStringsStorage::NilIndex;
+
+    TGdsfEviction(double byteCost = 0)
+        : ByteCost_(byteCost)
+    { }
+
+    void OnElementAdd(auto& storage, TIndex index)
+    {
+        if (index >= Entries_.size()) {
+            Entries_.resize(std::max<size_t>(index + 1, Entries_.size() * 3 / 2));
+        }
+        auto& entry = Entries_[index];
+        entry.Size = storage.Get(index).size();
+        entry.Frequency = 1;
+        entry.Priority = CalculatePriority(entry);
+        entry.HeapPosition = Heap_.size();
+        Heap_.push_back(index);
+        SiftUp(entry.HeapPosition);
+    }
+
+    void OnElementTouch(auto&, TIndex index)
+    {
+        auto& entry = Entries_[index];
+        ++entry.Frequency;
+        entry.Priority = CalculatePriority(entry);
+        SiftDown(entry.HeapPosition); // Priority only grows.
+    }
+
+    void OnElementRemove(auto&, TIndex index)
+    {
+        const uint32_t position = Entries_[index].HeapPosition;
+        const TIndex last = Heap_.back();
+        Heap_.pop_back();
+        if (last != index) {
+            Place(last, position);
+            SiftUp(position);
+            SiftDown(Entries_[last].HeapPosition);
+        }
+    }
+
+    std::optional<TIndex> GetElementToRemove(auto&)
+    {
+        if (Heap_.empty()) {
+            return std::nullopt;
+        }
+        Inflation_ = Entries_[Heap_.front()].Priority;
+        return Heap_.front();
+    }
+
+    // Victims out of the heap order would break the aging, it is the priority of the last victim.
+    bool CanRemoveOnCompaction(auto&, TIndex)
+    {
+        return false;
+    }
+
+    void OnKeyLookup(uint64_t)
+    { }
+
+    bool Admit(uint64_t, uint64_t)
+    {
+        return true;
+    }
+
+    void Clear()
+    {
+        Entries_.clear();
+        Heap_.clear();
+        Inflation_ = 0;
+    }
+
+private:
+    struct TEntry
+    {
+        double Priority;
+        uint32_t Size; // Elements are less than 4 GB.
+        uint32_t Frequency;
+        uint32_t HeapPosition;
+    };
+
+    double CalculatePriority(const TEntry& entry)
+    {
+        return Inflation_ + entry.Frequency * (1 + ByteCost_ * entry.Size) / std::max<uint32_t>(entry.Size, 1);
+    }
+
+    void Place(TIndex index, uint32_t position)
+    {
+        Heap_[position] = index;
+        Entries_[index].HeapPosition = position;
+    }
+
+    void SiftUp(uint32_t position)
+    {
+        const TIndex index = Heap_[position];
+        const double priority = Entries_[index].Priority;
+        while (position > 0) {
+            const uint32_t parent = (position - 1) / 2;
+            if (Entries_[Heap_[parent]].Priority <= priority) {
+                break;
+            }
+            Place(Heap_[parent], position);
+            position = parent;
+        }
+        Place(index, position);
+    }
+
+    void SiftDown(uint32_t position)
+    {
+        const TIndex index = Heap_[position];
+        const double priority = Entries_[index].Priority;
+        while (true) {
+            uint32_t child = position * 2 + 1;
+            if (child >= Heap_.size()) {
+                break;
+            }
+            if (child + 1 < Heap_.size() && Entries_[Heap_[child + 1]].Priority < Entries_[Heap_[child]].Priority) {
+                ++child;
+            }
+            if (priority <= Entries_[Heap_[child]].Priority) {
+                break;
+            }
+            Place(Heap_[child], position);
+            position = child;
+        }
+        Place(index, position);
+    }
+
+private:
+    const double ByteCost_;
+    double Inflation_ = 0;
+    std::vector<TEntry> Entries_;
+    std::vector<TIndex> Heap_; // Root is the victim.
+};
+
+// `TStorage` is TStringsStorage or another storage with the same interface and `uint32_t` indexes
+// (eviction policies are indexed by TStringsStorage::TIndex).
+// Value that is not moved or freed while the handle lives, see `Pin` in storages.
+// E.g. a large value can be passed to `writev` with no copy, while the map serves other requests.
+template <typename TStorage>
+class TPinnedValue
+{
+public:
+    using TIndex = typename TStorage::TIndex;
+    using TValue = typename TStorage::TValue;
+
+    TPinnedValue() = default;
+
+    TPinnedValue(TStorage& storage, TIndex index, TValue value)
+        : Storage_(&storage)
+        , Index_(index)
+        , Value_(value)
+    {
+        Storage_->Pin(Index_);
+    }
+
+    TPinnedValue(TPinnedValue&& other)
+        : Storage_(std::exchange(other.Storage_, nullptr))
+        , Index_(other.Index_)
+        , Value_(std::exchange(other.Value_, TStorage::NilValue))
+    { }
+
+    TPinnedValue& operator=(TPinnedValue&& other)
+    {
+        if (this != &other) {
+            Reset();
+            Storage_ = std::exchange(other.Storage_, nullptr);
+            Index_ = other.Index_;
+            Value_ = std::exchange(other.Value_, TStorage::NilValue);
+        }
+        return *this;
+    }
+
+    ~TPinnedValue()
+    {
+        Reset();
+    }
+
+    void Reset()
+    {
+        if (Storage_ != nullptr) {
+            std::exchange(Storage_, nullptr)->Unpin(Index_);
+            Value_ = TStorage::NilValue;
+        }
+    }
+
+    explicit operator bool() const
+    {
+        return Storage_ != nullptr;
+    }
+
+    TValue Value() const
+    {
+        return Value_;
+    }
+
+private:
+    TStorage* Storage_ = nullptr;
+    TIndex Index_ = TStorage::NilIndex;
+    TValue Value_ = TStorage::NilValue;
+};
+
+template <typename THasher = std::hash<std::string_view>, typename TEvictionPolicy = TNoEviction,
+          typename TStorage = TStringsStorage>
+class TStrStrHashMap
+{
+public:
+    using TIndex = typename TStorage::TIndex;
+    using TValue = typename TStorage::TValue;
+    static inline constexpr TIndex NilIndex = TStorage::NilIndex;
+    static inline constexpr TValue NilValue = TStorage::NilValue;
+    // Only 56 bits of a hash are used, they are stored in entries.
+    static inline constexpr uint64_t KeyHashMask = (1ull << 56) - 1;
+
+    TStrStrHashMap(uint64_t bufferSize, uint64_t defragmentationBytesPerAllocation = 0, THasher hasher = THasher(),
+                   TEvictionPolicy evictionPolicy = TEvictionPolicy())
+        : TStrStrHashMap(TStorage(bufferSize, defragmentationBytesPerAllocation), std::move(hasher), std::move(evictionPolicy))
+    { }
+
+    // Takes an empty storage, e.g. with non default buffer options.
+    explicit TStrStrHashMap(TStorage storage, THasher hasher = THasher(), TEvictionPolicy evictionPolicy = TEvictionPolicy())
+        : Storage_(std::move(storage))
+        , Hasher_(std::move(hasher))
+        , EvictionPolicy_(std::move(evictionPolicy))
+    {
+        if constexpr (requires { Storage_.ExtraMeta(); }) {
+            const auto meta = Storage_.ExtraMeta();
+            if (!meta.empty()) {
+                HashTable_ = TMetaVector<TIndex>({reinterpret_cast<TIndex*>(meta.data()), meta.size() / sizeof(TIndex)});
+            }
+        }
+        ResetHashTable();
+    }
+
+    // One block mode: storage tables and the buckets are in the storage buffer, which is the only allocation
+    // of `bufferSize` bytes. There are no rehashes, the bucket count is fixed for `maxElementsCount`.
+    static TStrStrHashMap OneBlock(uint64_t bufferSize, uint64_t maxElementsCount, uint64_t defragmentationBytesPerAllocation = 0,
+                                   THasher hasher = THasher(), TEvictionPolicy evictionPolicy = TEvictionPolicy(),
+                                   TBufferOptions bufferOptions = TBufferOptions())
+    {
+        const uint64_t bucketsCount = std::max<uint64_t>(maxElementsCount / 2, 1); // Load factor as before doubling.
+        return TStrStrHashMap(TStorage(bufferSize, defragmentationBytesPerAllocation, bufferOptions,
+                                       maxElementsCount, bucketsCount * sizeof(TIndex)),
+                              std::move(hasher), std::move(evictionPolicy));
+    }
+
+    uint64_t Hash(std::string_view key) const
+    {
+        return Hasher_(key) & KeyHashMask;
+    }
+
+    std::pair<TValue, TIndex> PutUnitialized(std::string_view key, uint64_t valueSize)
+    {
+        return PutUnitialized(key, Hash(key), valueSize);
+    }
+
+    // Overloads with `keyHash` take precomputed `Hash(key)`, e.g. from a shard router.
+    std::pair<TValue, TIndex> PutUnitialized(std::string_view key, uint64_t keyHash, uint64_t valueSize)
+    {
+        MigrateBuckets(MigratedBucketsPerOperation);
+        if (!HashTable_.IsFixed() && Storage_.ElementsCount() + 1 > HashTable_.size() * 2) { // Multiplier has significant effect on speed.
+            DoubleHashTable();
+        }
+
+        TIndex& bucket = GetBucket(keyHash);
+        auto erasedIdx = EraseFromBucket(bucket, keyHash, key); // Remove old element if exists.
+        if (erasedIdx != NilIndex) {
+            EvictionPolicy_.OnElementRemove(Storage_, erasedIdx);
+            Storage_.Free(erasedIdx);
+        }
+
+        const uint64_t size = CalculateSize(key.size(), valueSize);
+        // Updates of present keys are always admitted. A new key is admitted or rejected once, against the first victim,
+        // so a rejected Put never drops anything.
+        bool admitted = erasedIdx != NilIndex;
+        // `HasSpaceFor` may be true and allocation still fail with pins, then it is false and eviction goes on.
+        std::pair<TValue, TIndex> allocated = {NilValue, NilIndex};
+        while (allocated.second == NilIndex) {
+            // Erase by index does not migrate buckets, so `bucket` stays valid.
+            while (!Storage_.HasSpaceFor(size)) {
+                const auto victim = EvictionPolicy_.GetElementToRemove(Storage_);
+                if (!victim) {
+                    throw std::runtime_error("no space");
+                }
+                if (!admitted && !EvictionPolicy_.Admit(keyHash, GetHeader(Storage_.Get(*victim)).KeyHash)) {
+                    return {NilValue, NilIndex};
+                }
+                admitted = true;
+                const bool erased = Erase(*victim);
+                verify(erased);
+            }
+            allocated = AllocateInStorage(size);
+        }
+
+        auto [sval, idx] = allocated;
+        EvictionPolicy_.OnElementAdd(Storage_, idx);
+        THeader& header = GetHeader(sval);
+        header.KeyHash = keyHash;
+        char* keyData = WriteVarint(sval.data() + sizeof(THeader), key.size());
+        std::memcpy(keyData, key.data(), key.size());
+
+        InsertToBucket(bucket, idx, header);
+
+        return {GetValue(sval), idx};
+    }
+
+    std::pair<TValue, TIndex> Put(std::string_view key, std::string_view value)
+    {
+        return Put(key, Hash(key), value);
+    }
+
+    std::pair<TValue, TIndex> Put(std::string_view key, uint64_t keyHash, std::string_view value)
+    {
+        auto [val, idx] = PutUnitialized(key, keyHash, value.size());
+        if (idx != NilIndex) {
+            std::memcpy(val.data(), value.data(), value.size());
+        }
+        return {val, idx};
+    }
+
+    std::pair<TValue, TIndex> Get(std::string_view key)
+    {
+        return Get(key, Hash(key));
+    }
+
+    std::pair<TValue, TIndex> Get(std::string_view key, uint64_t keyHash)
+    {
+        EvictionPolicy_.OnKeyLookup(keyHash);
+        auto [prevIdx, idx] = FindInBucket(GetBucket(keyHash), keyHash, key);
+        if (idx != NilIndex) {
+            EvictionPolicy_.OnElementTouch(Storage_, idx);
+        }
+        return {Get(idx), idx};
+    }
+
+    // Lookups of a batch go stage by stage: bucket, position of the element, its header, next element in the chain.
+    // Every stage prefetches what the next one reads, so cache misses of different keys overlap
+    // instead of being paid one after another as in `Get`.
+    void MultiGet(std::span<const std::string_view> keys, std::span<std::pair<TValue, TIndex>> results)
+    {
+        assert(keys.size() == results.size());
+        for (size_t begin = 0; begin < keys.size(); begin += MultiGetBatchSize) {
+            const size_t count = std::min(MultiGetBatchSize, keys.size() - begin);
+            std::array<uint64_t, MultiGetBatchSize> hashes;
+            std::array<TIndex, MultiGetBatchSize> indexes;
+            std::array<uint8_t, MultiGetBatchSize> pending; // Positions in the batch that are not found yet.
+            size_t pendingCount = 0;
+            for (size_t i = 0; i < count; ++i) {
+                hashes[i] = Hash(keys[begin + i]);
+                EvictionPolicy_.OnKeyLookup(hashes[i]);
+                __builtin_prefetch(&GetBucket(hashes[i]));
+            }
+            for (size_t i = 0; i < count; ++i) {
+                indexes[i] = GetBucket(hashes[i]);
+                results[begin + i] = {NilValue, NilIndex};
+                if (indexes[i] != NilIndex) {
+                    Storage_.PrefetchIndex(indexes[i]);
+                    pending[pendingCount++] = i;
+                }
+            }
+            while (pendingCount != 0) {
+                for (size_t j = 0; j < pendingCount; ++j) {
+                    Storage_.PrefetchValue(indexes[pending[j]]);
+                }
+                size_t nextPendingCount = 0;
+                for (size_t j = 0; j < pendingCount; ++j) {
+                    const size_t i = pending[j];
+                    auto sval = Storage_.Get(indexes[i]);
+                    auto& header = GetHeader(sval);
+                    if (header.KeyHash == hashes[i] && keys[begin + i] == GetKey(sval)) {
+                        EvictionPolicy_.OnElementTouch(Storage_, indexes[i]);
+                        results[begin + i] = {GetValue(sval), indexes[i]};
+                    } else if (header.ListNext != NilIndex) {
+                        indexes[i] = header.ListNext;
+                        Storage_.PrefetchIndex(indexes[i]);
+                        pending[nextPendingCount++] = i;
+                    }
+                }
+                pendingCount = nextPendingCount;
+            }
+        }
+    }
+
+    std::vector<std::pair<TValue, TIndex>> MultiGet(std::span<const std::string_view> keys)
+    {
+        std::vector<std::pair<TValue, TIndex>> results(keys.size());
+        MultiGet(keys, results);
+        return results;
+    }
+
+    // Like `Get`, but the value stays valid through later operations until the handle dies.
+    // Erase of the key is deferred until then. Empty handle if there is no key. `Clear` and `Load` invalidate handles.
+    TPinnedValue<TStorage> GetPinned(std::string_view key)
+    {
+        auto [value, idx] = Get(key);
+        if (idx == NilIndex) {
+            return {};
+        }
+        return TPinnedValue<TStorage>(Storage_, idx, value);
+    }
+
+    TValue Get(TIndex index)
+    {
+        auto svalue = Storage_.Get(index);
+        if (svalue.data() == nullptr) {
+            return NilValue;
+        }
+        return GetValue(svalue);
+    }
+
+    bool Erase(std::string_view key)
+    {
+        return Erase(key, Hash(key));
+    }
+
+    bool Erase(std::string_view key, uint64_t keyHash)
+    {
+        MigrateBuckets(MigratedBucketsPerOperation);
+        auto erasedIdx = EraseFromBucket(GetBucket(keyHash), keyHash, key);
+        if (erasedIdx == NilIndex) {
+            return false;
+        }
+        EvictionPolicy_.OnElementRemove(Storage_, erasedIdx);
+        verify(Storage_.Free(erasedIdx));
+        return true;;
+    }
+
+    bool Erase(TIndex index)
+    {
+        if (Storage_.Get(index).data() == nullptr) {
+            return false;
+        }
+        Forget(index);
+        verify(Storage_.Free(index));
+        return true;
+    }
+
+    void Clear()
+    {
+        Storage_.Clear();
+        EvictionPolicy_.Clear();
+        ResetHashTable();
+        OldHashTable_ = {};
+        MigratedBucketsCount_ = 0;
+    }
+
+    uint64_t ElementsCount()
+    {
+        return Storage_.ElementsCount();
+    }
+
+    double FillRate()
+    {
+        return Storage_.FillRate();
+    }
+
+    uint64_t DefragmentatedBytes()
+    {
+        return Storage_.DefragmentatedBytes();
+    }
+
+    bool DoHeavyWork(uint64_t byteBudget)
+    {
+        return Storage_.DoHeavyWork(byteBudget);
+    }
+
+    TEvictionPolicy& EvictionPolicy()
+    {
+        return EvictionPolicy_;
+    }
+
+    // Writes the storage snapshot (see `TStorage::Save`) and the bucket heads after it.
+    // An unfinished rehash is finished first. Eviction policy state is not saved.
+    void Save(const std::string& path)
+    {
+        MigrateBuckets(OldHashTable_.size());
+        auto f = OpenFile(path, "wb");
+        Storage_.Save(f.get());
+        TSnapshotHeader header;
+        header.Magic = SnapshotMagic;
+        header.Version = SnapshotVersion;
+        header.HasherCheck = Hash(HasherCheckKey);
+        header.HashTableSize = HashTable_.size();
+        WriteToFile(f.get(), &header, sizeof(header));
+        WriteToFile(f.get(), HashTable_.data(), HashTable_.size() * sizeof(TIndex));
+        if (fflush(f.get()) != 0) {
+            throw std::runtime_error("snapshot write failed");
+        }
+    }
+
+    // Warm restart: the buffer is mapped from the file and faulted on first access, only the index is read.
+    // Needs the same hasher, the map would not find keys otherwise. The eviction policy gets all elements as added
+    // in index order, CLOCK counters are in the storage headers, so they survive. On error the map is left empty.
+    // Headers and section sizes are checked (see `TStorage::Load`), bucket heads and chains are trusted as entries are.
+    void Load(const std::string& path)
+    {
+        try {
+            auto f = OpenFile(path, "rb");
+            HashTable_ = {}; // Fixed buckets are in the mapping replaced by the storage.
+            Storage_.Load(f.get());
+            TSnapshotHeader header;
+            ReadFromFile(f.get(), &header, sizeof(header));
+            if (header.Magic != SnapshotMagic) {
+                throw std::runtime_error("not a map snapshot");
+            }
+            if (header.Version != SnapshotVersion) {
+                throw std::runtime_error("snapshot has another version");
+            }
+            if (header.HasherCheck != Hash(HasherCheckKey)) {
+                throw std::runtime_error("snapshot was saved with another hasher");
+            }
+            if (header.HashTableSize == 0) {
+                throw std::runtime_error("snapshot has no buckets");
+            }
+            CheckFileHas(f.get(), TellFile(f.get()), header.HashTableSize, sizeof(TIndex));
+            HashTable_.resize(header.HashTableSize);
+            ReadFromFile(f.get(), HashTable_.data(), HashTable_.size() * sizeof(TIndex));
+            OldHashTable_ = {};
+            MigratedBucketsCount_ = 0;
+            EvictionPolicy_.Clear();
+            Storage_.ForEachIndex([this](TIndex idx) {
+                EvictionPolicy_.OnElementAdd(Storage_, idx);
+            });
+        } catch (...) {
+            Clear();
+            throw;
+        }
+    }
+
+    // For storage specific calls. Freeing elements through it breaks the index, use `Erase(index)`.
+    TStorage& Storage()
+    {
+        return Storage_;
+    }
+
+    // Bytes allocated in the storage for an entry.
+    static uint64_t CalculateSize(uint64_t keySize, uint64_t valueSize)
+    {
+        return sizeof(THeader) + VarintSize(keySize) + keySize + valueSize;
+    }
+
+    // Bucket heads plus `ListNext` links kept in entry headers.
+    uint64_t IndexBytes()
+    {
+        return (HashTable_.capacity() + OldHashTable_.capacity() + ElementsCount()) * sizeof(TIndex);
+    }
+
+private:
+    // Old table has half of the buckets, and the next doubling is at least HashTable_.size() puts later,
+    // so one bucket per operation would be enough. A few more finish earlier and free the old table.
+    static constexpr uint64_t MigratedBucketsPerOperation = 4;
+    // Keys in flight in `MultiGet`, about as many misses as a core can have outstanding and then some.
+    static constexpr size_t MultiGetBatchSize = 32;
+
+    static constexpr uint64_t SnapshotMagic = 0x53'50'41'4D'52'54'53'53; // "SSTRMAPS"
+    static constexpr uint64_t SnapshotVersion = 2;
+    static constexpr std::string_view HasherCheckKey = "hasher check";
+
+    struct TSnapshotHeader
+    {
+        uint64_t Magic;
+        uint64_t Version;
+        uint64_t HasherCheck;
+        uint64_t HashTableSize;
+    };
+
+    // Entry is this header right after the storage header, varint key size, key and value.
+    // Chain step reads `KeyHash` and `ListNext` first, and the key follows in the same or the next cache line.
+    // Storage and map headers are byte packed, so one fused struct would not be smaller than the two
+    // (28 + 11 bytes), the saving is in the key size: 1 byte for keys shorter than 128 instead of 5.
+    // `KeyHash` goes first, so it is one 8-byte load.
+    struct __attribute__ ((__packed__)) THeader
+    {
+        uint64_t KeyHash : 56;
+        TIndex ListNext;
+    };
+    static_assert(sizeof(THeader) == 11); // Not invariant, just check.
+
+    static uint64_t VarintSize(uint64_t x)
+    {
+        uint64_t size = 1;
+        for (; x >= 0x80; x >>= 7) {
+            ++size;
+        }
+        return size;
+    }
+
+    static char* WriteVarint(char* data, uint64_t x)
+    {
+        for (; x >= 0x80; x >>= 7) {
+            *data++ = static_cast<char>(x | 0x80);
+        }
+        *data++ = static_cast<char>(x);
+        return data;
+    }
+
+    static const char* ReadVarint(const char* data, uint64_t& x)
+    {
+        x = 0;
+        for (int shift = 0; ; shift += 7) {
+            const uint8_t byte = *data++;
+            x |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if (byte < 0x80) {
+                return data;
+            }
+        }
+    }
+
+    THeader& GetHeader(TValue svalue)
+    {
+        return *reinterpret_cast<THeader*>(svalue.data());
+    }
+
+    std::string_view GetKey(TValue svalue)
+    {
+        uint64_t keySize = 0;
+        const char* keyData = ReadVarint(svalue.data() + sizeof(THeader), keySize);
+        return {keyData, keySize};
+    }
+
+    TValue GetValue(TValue svalue)
+    {
+        const auto key = GetKey(svalue);
+        return svalue.subspan(key.data() + key.size() - svalue.data());
+    }
+
+    // During migration an element is in the old table until its old bucket is migrated.
+    TIndex& GetBucket(uint64_t keyHash)
+    {
+        if (!OldHashTable_.empty()) {
+            const uint64_t oldBucket = keyHash % OldHashTable_.size();
+            if (oldBucket >= MigratedBucketsCount_) {
+                return OldHashTable_[oldBucket];
+            }
+        }
+        return HashTable_[keyHash % HashTable_.size()];
+    }
+
+    // (prevIndex, foundIndex) or (nil, nil)
+    std::pair<TIndex, TIndex> FindInBucket(TIndex bucket, uint64_t hash, std::string_view key)
+    {
+        TIndex prevIdx = NilIndex;
+        TIndex idx = bucket;
+        while (idx != NilIndex) {
+            auto sval = Storage_.Get(idx);
+            auto& header = GetHeader(sval);
+            if (header.KeyHash == hash && key == GetKey(sval)) {
+                return {prevIdx, idx};
+            }
+            prevIdx = idx;
+            idx = header.ListNext;
+        }
+        return {NilIndex, NilIndex};
+    }
+
+    TIndex EraseFromBucket(TIndex& bucket, uint64_t hash, std::string_view key)
+    {
+        auto [prevIdx, idx] = FindInBucket(bucket, hash, key);
+        if (idx != NilIndex) {
+            auto sval = Storage_.Get(idx);
+            auto& header = GetHeader(sval);
+            if (prevIdx == NilIndex) {
+                assert(idx == bucket);
+                bucket = header.ListNext;
+            } else {
+                GetHeader(Storage_.Get(prevIdx)).ListNext = header.ListNext;
+            }
+            return idx;
+        }
+        return NilIndex;
+    }
+
+    void InsertToBucket(TIndex& bucket, TIndex idx, THeader& header)
+    {
+        header.ListNext = bucket;
+        bucket = idx;
+    }
+
+    // Unlinks a present element from its bucket and the policy, the storage frees it.
+    void Forget(TIndex index)
+    {
+        auto sval = Storage_.Get(index);
+        auto& header = GetHeader(sval);
+        auto erasedIdx = EraseFromBucket(GetBucket(header.KeyHash), header.KeyHash, GetKey(sval));
+        assert(index == erasedIdx);
+        EvictionPolicy_.OnElementRemove(Storage_, erasedIdx);
+    }
+
+    // Compaction in `Allocate` frees elements that the policy would evict soon instead of moving them,
+    // if the storage compacts (see `TMoveAllElements`). Buckets do not migrate here, so `Forget` keeps
+    // the bucket of `PutUnitialized` valid.
+    // Nil if the storage has `TryAllocate` and it fails (see `TBasicBlobStringsStorage::HasSpaceFor`).
+    std::pair<TValue, TIndex> AllocateInStorage(uint64_t size)
+    {
+        if constexpr (requires { Storage_.TryAllocate(size, TMoveAllElements()); }) {
+            return Storage_.TryAllocate(size, [this](TIndex index) {
+                if (!EvictionPolicy_.CanRemoveOnCompaction(Storage_, index)) {
+                    return false;
+                }
+                Forget(index);
+                return true;
+            });
+        } else if constexpr (requires { Storage_.TryAllocate(size); }) {
+            return Storage_.TryAllocate(size);
+        } else {
+            return Storage_.Allocate(size);
+        }
+    }
+
+    // All buckets of a fixed table, one bucket of a growing one.
+    void ResetHashTable()
+    {
+        HashTable_.assign(HashTable_.IsFixed() ? HashTable_.capacity() : 1, NilIndex);
+    }
+
+    // Starts incremental migration to a twice larger table. Chains are moved by `MigrateBuckets`,
+    // so the pause is only allocation and fill of the new table.
+    void DoubleHashTable()
+    {
+        MigrateBuckets(OldHashTable_.size()); // Previous migration is unfinished only if there were many erases.
+        OldHashTable_ = std::move(HashTable_);
+        HashTable_.assign(OldHashTable_.size() * 2, NilIndex);
+        MigratedBucketsCount_ = 0;
+    }
+
+    void MigrateBuckets(uint64_t bucketsCount)
+    {
+        if (OldHashTable_.empty()) {
+            return;
+        }
+        const uint64_t lastBucket = std::min<uint64_t>(MigratedBucketsCount_ + bucketsCount, OldHashTable_.size());
+        for (; MigratedBucketsCount_ < lastBucket; ++MigratedBucketsCount_) {
+            auto idx = std::exchange(OldHashTable_[MigratedBucketsCount_], NilIndex);
+            while (idx != NilIndex) {
+                auto sval = Storage_.Get(idx);
+                auto& header = GetHeader(sval);
+                auto nextIdx = header.ListNext;
+                InsertToBucket(HashTable_[header.KeyHash % HashTable_.size()], idx, header);
+                idx = nextIdx;
+            }
+        }
+        if (MigratedBucketsCount_ == OldHashTable_.size()) {
+            OldHashTable_ = {};
+            MigratedBucketsCount_ = 0;
+        }
+    }
+
+private:
+    TStorage Storage_;
+    [[no_unique_address]] THasher Hasher_;
+    [[no_unique_address]] TEvictionPolicy EvictionPolicy_;
+    // Overhead per one element is sizeof(TIndex) = 4.
+    TMetaVector<TIndex> HashTable_;
+    // Not empty while migration to `HashTable_` is in progress. Buckets before `MigratedBucketsCount_` are moved.
+    TMetaVector<TIndex> OldHashTable_;
+    uint64_t MigratedBucketsCount_ = 0;
+};
+
+void SSHM_SimpleTest()
+{
+    srand(45);
+    TStrStrHashMap<> m(1000000);
+    m.Put("key1", "value1");
+    verify(m.Get("key1").first == "value1"sv);
+    auto [val2, idx2] = m.Put("key2", "value2");
+    verify(m.Get("key2").first == "value2"sv);
+    verify(m.Erase("key1"));
+    verify(m.Get("key1").first.data() == nullptr);
+    verify(!m.Erase("key1"));
+    verify(m.Erase(idx2));
+    verify(m.Get("key2").first.data() == nullptr);
+    verify(!m.Erase(idx2));
+
+    for (int i = 0; i < 94; ++i) {
+        auto val = m.PutUnitialized(std::to_string(i), 10000).first;
+        for (auto& e : val) {
+            e = i;
+        }
+    }
+    for (int i = 0; i < 94; ++i) {
+        auto val = m.Get(std::to_string(i)).first;
+        for (auto& e : val) {
+            verify(e == i);
+        }
+    }
+    for (int i = 0; i < 94; i += 2) {
+        verify(m.Erase(std::to_string(i)));
+    }
+    for (int i = 0; i < 94; i += 2) {
+        auto val = m.PutUnitialized(std::to_string(i), 10000).first;
+        for (auto& e : val) {
+            e = i;
+        }
+    }
+    for (int i = 0; i < 94; ++i) {
+        auto val = m.Get(std::to_string(i)).first;
+        for (auto& e : val) {
+            verify(e == i);
+        }
+    }
+    for (int i = 0; i < 94; i += 2) {
+        verify(m.Erase(std::to_string(i)));
+    }
+    for (int i = 100; i < 120; ++i) {
+        auto val = m.PutUnitialized(std::to_string(i), 20000).first;
+        for (auto& e : val) {
+            e = i;
+        }
+    }
+    for (int i = 1; i < 94; i += 2) {
+        auto val = m.Get(std::to_string(i)).first;
+        for (auto& e : val) {
+            verify(e == i);
+        }
+    }
+
+    m.Clear();
+}
+
+template <typename THasher>
+void SSHM_HasherTest(THasher hasher)
+{
+    TStrStrHashMap<THasher> m(10'000'000, 0, hasher);
+    for (int i = 0; i < 10000; ++i) {
+        const std::string key = std::to_string(i * 1000003ull) + "-key"; // Some keys collide by the identity hasher.
+        m.Put(key, key);
+        verify(m.Get(key).first == key);
+    }
+    verify(m.ElementsCount() == 10000);
+}
+
+void test_hasher()
+{
+    // Test vectors published with wyhash final version 4: the i-th message hashed with seed i and the default secret.
+    const std::pair<std::string_view, uint64_t> vectors[] = {
+        {"", 0x93228a4de0eec5a2ull},
+        {"a", 0xc5bac3db178713c4ull},
+        {"abc", 0xa97f2f7b1d9b3314ull},
+        {"message digest", 0x786d1f1df3801df4ull},
+        {"abcdefghijklmnopqrstuvwxyz", 0xdca5a8138ad37c87ull},
+        {"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789", 0xb9e734f117cfaf70ull},
+        {"12345678901234567890123456789012345678901234567890123456789012345678901234567890", 0x6cc5eab49a92d617ull},
+    };
+    for (uint64_t i = 0; i < std::size(vectors); ++i) {
+        verify(TWyHasher{i}(vectors[i].first) == vectors[i].second);
+    }
+
+    const std::string key(100, 'k');
+    for (size_t size = 0; size <= key.size(); ++size) {
+        const std::string_view prefix = std::string_view(key).substr(0, size);
+        verify(TWyHasher{}(prefix) == TWyHasher{}(std::string(prefix)));
+        verify(TWyHasher{1}(prefix) != TWyHasher{2}(prefix));
+        if (size > 0) {
+            verify(TWyHasher{}(prefix) != TWyHasher{}(prefix.substr(1)));
+        }
+    }
+    const uint64_t hash = 0x123456789abcdefull;
+    verify(TIdentityHasher{}(std::string_view(reinterpret_cast<const char*>(&hash), sizeof(hash))) == hash);
+    SSHM_HasherTest(TWyHasher{45});
+    SSHM_HasherTest(TIdentityHasher{});
+}
+
+void SSHM_EvictionTest()
+{
+    TStrStrHashMap<std::hash<std::string_view>, TLruEviction> m(100'000);
+    std::string value;
+    for (int i = 0; i < 10000; ++i) {
+        value.assign(i % 300, static_cast<char>(i));
+        m.Put(std::to_string(i), value); // Never throws "no space".
+        verify(m.Get("0").second != TStrStrHashMap<>::NilIndex); // Touched on every step, so never evicted.
+    }
+    verify(m.ElementsCount() < 10000);
+    verify(m.FillRate() > 0.9);
+    // The newest ones survive.
+    for (int i = 9990; i < 10000; ++i) {
+        auto val = m.Get(std::to_string(i)).first;
+        verify(val.size() == static_cast<size_t>(i % 300));
+    }
+    verify(m.Get("1").first.data() == nullptr);
+
+    TStrStrHashMap<> noEviction(100'000);
+    bool thrown = false;
+    try {
+        for (int i = 0; i < 10000; ++i) {
+            noEviction.Put(std::to_string(i), value);
+        }
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    verify(thrown);
+}
+
+void SSHM_ClockEvictionTest()
+{
+    TStrStrHashMap<std::hash<std::string_view>, TClockEviction> m(100'000);
+    std::string value;
+    for (int i = 0; i < 10000; ++i) {
+        value.assign(i % 300, static_cast<char>(i));
+        m.Put(std::to_string(i), value); // Never throws "no space".
+        for (int hot = 0; hot < std::min(i + 1, 10); ++hot) { // Touched on every step, so the hand never finds zero counters on them.
+            verify(m.Get(std::to_string(hot)).second != TStrStrHashMap<>::NilIndex);
+        }
+    }
+    verify(m.ElementsCount() < 10000);
+    verify(m.FillRate() > 0.9);
+    // The newest one was just put, and cold ones are evicted.
+    verify(m.Get("9999").first.size() == 9999 % 300);
+    verify(m.Get("10").first.data() == nullptr);
+
+    m.Clear();
+    verify(!m.Storage().NextClockVictim());
+    const auto idx = m.Put("a", "1").second;
+    m.Get("a");
+    m.Get("a");
+    verify(m.Storage().NextClockVictim() == idx); // The only element, after three rounds.
+}
+
+struct TCountingClockEviction : TClockEviction
+{
+    bool CanRemoveOnCompaction(auto& storage, TIndex index)
+    {
+        const bool cold = TClockEviction::CanRemoveOnCompaction(storage, index);
+        Dropped += cold;
+        return cold;
+    }
+
+    uint64_t Dropped = 0;
+};
+
+void SSHM_EvictOnCompactionTest()
+{
+    // Compaction drops cold elements instead of moving them. Hot ones are moved, and buckets stay consistent.
+    for (uint64_t defragmentationBytesPerAllocation : {0, 4096}) {
+        using TMap = TStrStrHashMap<std::hash<std::string_view>, TCountingClockEviction, TBlobStringsStorage>;
+        TMap m(200'000, defragmentationBytesPerAllocation);
+        std::string value;
+        srand(46);
+        for (int i = 0; i < 20'000; ++i) {
+            value.assign(rand() % 2000, static_cast<char>(i));
+            m.Put(std::to_string(i), value);
+            for (int hot = 0; hot < std::min(i + 1, 10); ++hot) {
+                verify(m.Get(std::to_string(hot)).second != TMap::NilIndex);
+            }
+        }
+        verify(m.EvictionPolicy().Dropped > 0);
+        uint64_t found = 0;
+        for (int i = 0; i < 20'000; ++i) {
+            auto [val, idx] = m.Get(std::to_string(i));
+            if (idx == TMap::NilIndex) {
+                continue;
+            }
+            ++found;
+            for (char c : val) {
+                verify(c == static_cast<char>(i));
+            }
+        }
+        verify(found == m.ElementsCount());
+        verify(m.FillRate() > 0.8);
+    }
+}
+
+void SSHM_AdmissionTest()
+{
+    using TMap = TStrStrHashMap<std::hash<std::string_view>, TTinyLfuAdmission<>>;
+    TMap m(100'000, 0, {}, TTinyLfuAdmission<>(1 << 10));
+    TStrStrHashMap<std::hash<std::string_view>, TLruEviction> lru(100'000);
+    const std::string value(100, 'v');
+    for (int i = 0; i < 500; ++i) {
+        const auto key = std::to_string(i);
+        for (int j = 0; j < 3; ++j) {
+            m.Get(key);
+            lru.Get(key);
+        }
+        m.Put(key, value);
+        lru.Put(key, value);
+    }
+    // One-hit-wonders do not push out keys that were looked up more.
+    uint64_t rejected = 0;
+    for (int i = 1000; i < 3000; ++i) {
+        const auto key = std::to_string(i);
+        m.Get(key);
+        lru.Get(key);
+        rejected += m.Put(key, value).second == TMap::NilIndex;
+        lru.Put(key, value);
+    }
+    verify(rejected > 1000);
+    verify(m.FillRate() > 0.9);
+    uint64_t hotFound = 0;
+    for (int i = 0; i < 500; ++i) {
+        hotFound += m.Get(std::to_string(i)).second != TMap::NilIndex;
+        verify(lru.Get(std::to_string(i)).second == TMap::NilIndex);
+    }
+    verify(hotFound > 400);
+
+    // Keys that became hot are admitted. Updates are always admitted.
+    for (int j = 0; j < 5; ++j) {
+        m.Get("new");
+    }
+    verify(m.Put("new", value).second != TMap::NilIndex);
+    verify(m.Put("new", "updated").second != TMap::NilIndex);
+    verify(m.Get("new").first == "updated"sv);
+}
+
+void SSHM_AdmissionManyVictimsTest()
+{
+    // Keys 0 and 1 were looked up once, the others three times. Fill goes until the first eviction, that drops key 0,
+    // so LRU order is 1, 2, 3, ...
+    using TMap = TStrStrHashMap<std::hash<std::string_view>, TTinyLfuAdmission<>>;
+    TMap m(100'000, 0, {}, TTinyLfuAdmission<>(1 << 10));
+    const std::string value(1000, 'v');
+    for (int i = 0; m.ElementsCount() == static_cast<uint64_t>(i); ++i) {
+        const auto key = std::to_string(i);
+        for (int j = 0; j < (i < 2 ? 1 : 3); ++j) {
+            m.Get(key);
+        }
+        m.Put(key, value);
+    }
+    verify(m.Get("0").second == TMap::NilIndex);
+    const int keysCount = m.ElementsCount() + 1;
+    const std::string largeValue(2500, 'l'); // Needs at least two victims.
+
+    // A key hotter than the first victim is admitted, even if the next victims are hotter.
+    m.Get("warm");
+    m.Get("warm");
+    verify(m.Put("warm", largeValue).second != TMap::NilIndex);
+    verify(m.Get("1").second == TMap::NilIndex && m.Get("2").second == TMap::NilIndex);
+
+    // A cold key is rejected before the first victim is evicted, so all victims it needs survive.
+    const uint64_t elementsCount = m.ElementsCount();
+    m.Get("cold");
+    verify(m.Put("cold", largeValue).second == TMap::NilIndex);
+    verify(m.ElementsCount() == elementsCount);
+    uint64_t found = 0;
+    for (int i = 0; i < keysCount; ++i) {
+        found += m.Get(std::to_string(i)).second != TMap::NilIndex;
+    }
+    verify(found + 1 == elementsCount);
+}
+
+void SSHM_GdsfEvictionTest()
+{
+    // Without byte cost large elements go first.
+    TStrStrHashMap<std::hash<std::string_view>, TGdsfEviction> m(100'000);
+    for (int i = 0; i < 1000; ++i) {
+        m.Put(std::to_string(i), std::string(i % 10 == 0 ? 2000 : 20, 'v'));
+    }
+    verify(m.FillRate() > 0.9);
+    uint64_t smallCount = 0;
+    uint64_t largeCount = 0;
+    for (int i = 500; i < 1000; ++i) {
+        if (m.Get(std::to_string(i)).second != TStrStrHashMap<>::NilIndex) {
+            ++(i % 10 == 0 ? largeCount : smallCount);
+        }
+    }
+    verify(smallCount == 450);
+    verify(largeCount < 25);
+
+    // With high byte cost frequency wins over size.
+    TStrStrHashMap<std::hash<std::string_view>, TGdsfEviction> byteMap(100'000, 0, {}, TGdsfEviction(1));
+    const std::string large(2000, 'v');
+    byteMap.Put("hot", large);
+    for (int i = 0; i < 1000; ++i) {
+        verify(byteMap.Get("hot").second != TStrStrHashMap<>::NilIndex);
+        byteMap.Put(std::to_string(i), std::string(i % 300, 'v'));
+        byteMap.Erase(std::to_string(i - 1)); // Erase of not the root.
+    }
+    verify(byteMap.Get("999").first.size() == 999 % 300);
+}
+
+void SSHM_PinnedValueTest(uint64_t defragmentationBytesPerAllocation)
+{
+    TStrStrHashMap<std::hash<std::string_view>, TLruEviction, TBlobStringsStorage> m(200'000, defragmentationBytesPerAllocation);
+    for (int i = 0; i < 100; ++i) {
+        m.Put("pinned" + std::to_string(i), std::string(500, static_cast<char>(i)));
+    }
+    std::vector<TPinnedValue<TBlobStringsStorage>> pinned;
+    for (int i = 0; i < 100; i += 10) {
+        pinned.push_back(m.GetPinned("pinned" + std::to_string(i)));
+    }
+    verify(!m.GetPinned("missing"));
+    const char* firstData = pinned[0].Value().data();
+    m.Erase("pinned0"); // Deferred.
+    m.Erase("pinned1");
+    verify(m.Get("pinned0").first.data() == nullptr);
+
+    // Churn with evictions and compactions around the pinned values. Only allocations move elements.
+    srand(45);
+    for (int i = 0; i < 100'000; ++i) {
+        const uint64_t defragmentatedBytes = m.DefragmentatedBytes();
+        m.Storage().HasSpaceFor(rand() % 2000);
+        verify(m.DefragmentatedBytes() == defragmentatedBytes);
+        m.Put(std::to_string(rand() % 1000), std::string(rand() % 700, 'x'));
+    }
+    verify(m.DefragmentatedBytes() > 0);
+    verify(pinned[0].Value().data() == firstData);
+    for (int i = 0; i < 10; ++i) {
+        verify(pinned[i].Value() == std::string(500, static_cast<char>(i * 10)));
+    }
+
+    const uint64_t elementsCount = m.ElementsCount();
+    pinned[0].Reset(); // Erased, so freed now.
+    verify(m.ElementsCount() == elementsCount - 1);
+    auto moved = std::move(pinned[1]);
+    verify(!pinned[1] && moved);
+    pinned.clear();
+    for (int i = 0; i < 10'000; ++i) {
+        m.Put(std::to_string(rand() % 1000), std::string(rand() % 700, 'x'));
+    }
+    verify(m.FillRate() > 0.9);
+}
+
+void SSHM_MultiGetTest()
+{
+    TStrStrHashMap<> m(10'000'000);
+    std::vector<std::string> keys;
+    for (int i = 0; i < 30'000; ++i) {
+        keys.push_back(std::to_string(i * 7));
+        if (i % 3 != 0) {
+            m.Put(keys.back(), std::string(i % 50, static_cast<char>(i)));
+        }
+        if (i % 1000 == 999) { // Lookups also go during incremental rehash.
+            std::vector<std::string_view> batch(keys.end() - 100, keys.end());
+            batch.push_back("missing");
+            const auto results = m.MultiGet(batch);
+            for (size_t j = 0; j < batch.size(); ++j) {
+                const auto expected = m.Get(batch[j]);
+                verify(results[j].second == expected.second);
+                verify(results[j].first.data() == expected.first.data() && results[j].first.size() == expected.first.size());
+            }
+        }
+    }
+    std::vector<std::string_view> all(keys.begin(), keys.end());
+    const auto results = m.MultiGet(all);
+    for (size_t i = 0; i < all.size(); ++i) {
+        verify((results[i].second != TStrStrHashMap<>::NilIndex) == (i % 3 != 0));
+        verify(i % 3 == 0 || results[i].first == std::string(i % 50, static_cast<char>(i)));
+    }
+    verify(m.MultiGet(std::span<const std::string_view>()).empty());
+}
+
+void SSHM_SmallSlotsTest()
+{
+    using TStorage = TSmallSlotsStringsStorage<>;
+    using TMap = TStrStrHashMap<std::hash<std::string_view>, TLruEviction, TStorage>;
+    TMap m(TStorage(200'000, 50'000, 64));
+    std::map<std::string, std::string> expected;
+    srand(45);
+    for (int i = 0; i < 100'000; ++i) {
+        const auto key = std::to_string(rand() % 3000);
+        if (rand() % 5 == 0) {
+            verify(m.Erase(key) == (expected.erase(key) == 1));
+            continue;
+        }
+        const std::string value(rand() % 3 == 0 ? rand() % 300 : rand() % 40, static_cast<char>(i));
+        m.Put(key, value);
+        expected[key] = value;
+        if (m.ElementsCount() < expected.size()) { // Evicted, sync the expectations.
+            for (auto it = expected.begin(); it != expected.end();) {
+                it = m.Get(it->first).second == TMap::NilIndex ? expected.erase(it) : std::next(it);
+            }
+        }
+        verify(m.ElementsCount() == expected.size());
+    }
+    uint64_t small = 0;
+    for (const auto& [key, value] : expected) {
+        const auto [val, idx] = m.Get(key);
+        verify(val == value);
+        small += idx % 2 == 0;
+    }
+    verify(small > 0 && small < expected.size());
+
+    // CLOCK frees the pool that is short.
+    TStrStrHashMap<std::hash<std::string_view>, TClockEviction, TStorage> c(TStorage(200'000, 6400, 64));
+    c.Put("large", std::string(1000, 'l'));
+    for (int i = 0; i < 1000; ++i) {
+        c.Put(std::to_string(i), "small");
+    }
+    verify(c.Get("large").first.size() == 1000);
+    verify(c.Get("999").first == "small"sv);
+    verify(c.ElementsCount() == 101);
+}
+
+void SSHM_OneBlockTest()
+{
+    using TMap = TStrStrHashMap<std::hash<std::string_view>, TLruEviction, TCompactBlobStringsStorage>;
+    auto m = TMap::OneBlock(1'000'000, 1000);
+    const uint64_t indexBytes = m.IndexBytes();
+    verify(m.Storage().ExtraMeta().size() == 500 * sizeof(TMap::TIndex));
+    for (int i = 0; i < 5000; ++i) {
+        m.Put(std::to_string(i), std::string(i % 100, static_cast<char>(i)));
+        verify(m.ElementsCount() <= 1000);
+    }
+    verify(m.ElementsCount() == 1000); // Count limit, not space.
+    verify(m.FillRate() < 0.2);
+    verify(m.IndexBytes() == indexBytes + m.ElementsCount() * sizeof(TMap::TIndex)); // No rehashes.
+    for (int i = 4000; i < 5000; ++i) {
+        verify(m.Get(std::to_string(i)).first == std::string(i % 100, static_cast<char>(i)));
+    }
+    m.Clear();
+    verify(m.Get("4999").first.data() == nullptr);
+    m.Put("a", "b");
+    verify(m.Get("a").first == "b"sv);
+
+    // Large values: space limit comes first.
+    for (int i = 0; i < 1000; ++i) {
+        m.Put(std::to_string(i), std::string(10'000, 'x'));
+    }
+    verify(m.ElementsCount() < 100 && m.FillRate() > 0.9);
+}
+
+void SSHM_SnapshotTest()
+{
+    const std::string path = "sshm_snapshot_test.bin";
+    using TMap = TStrStrHashMap<TWyHasher, TLruEviction>;
+    TMap m(1'000'000, 0, TWyHasher{45});
+    std::map<std::string, std::string> expected;
+    srand(45);
+    for (int i = 0; i < 20000; ++i) {
+        auto key = std::to_string(rand() % 5000);
+        if (rand() % 4 == 0) {
+            m.Erase(key);
+            expected.erase(key);
+        } else {
+            std::string value(rand() % 200, static_cast<char>(i));
+            m.Put(key, value);
+            expected[key] = value;
+        }
+    }
+    m.Save(path);
+
+    TMap loaded(100'000, 0, TWyHasher{45}); // Buffer size is taken from the snapshot.
+    loaded.Load(path);
+    verify(loaded.ElementsCount() == expected.size());
+    verify(loaded.FillRate() == m.FillRate());
+    for (const auto& [key, value] : expected) {
+        verify(loaded.Get(key).first == value);
+    }
+    // Writes go to private pages, the snapshot does not change.
+    for (int i = 0; i < 20000; ++i) {
+        loaded.Put("new" + std::to_string(i), std::string(100, 'n'));
+    }
+    verify(loaded.Get("new19999").first == std::string(100, 'n'));
+    verify(loaded.Get(expected.begin()->first).first.data() == nullptr); // LRU got the loaded elements.
+    loaded.Load(path);
+    verify(loaded.ElementsCount() == expected.size());
+    verify(loaded.Get(expected.begin()->first).first == expected.begin()->second);
+
+    TMap other(100'000, 0, TWyHasher{46});
+    bool thrown = false;
+    try {
+        other.Load(path);
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    verify(thrown && other.ElementsCount() == 0);
+
+    // Truncated and foreign snapshots throw instead of SIGBUS or reads out of bounds.
+    std::string content;
+    {
+        auto f = OpenFile(path, "rb");
+        verify(fseeko(f.get(), 0, SEEK_END) == 0);
+        content.resize(TellFile(f.get()));
+        SeekFile(f.get(), 0);
+        ReadFromFile(f.get(), content.data(), content.size());
+    }
+    const std::string badPath = "sshm_snapshot_test_bad.bin";
+    auto loadFails = [&](const std::string& bytes, auto map) {
+        {
+            auto f = OpenFile(badPath, "wb");
+            WriteToFile(f.get(), bytes.data(), bytes.size());
+        }
+        map.Put("key", "value");
+        bool thrown = false;
+        try {
+            map.Load(badPath);
+        } catch (const std::runtime_error&) {
+            thrown = true;
+        }
+        return thrown && map.ElementsCount() == 0;
+    };
+    auto patched = [&](uint64_t offset, uint64_t value) {
+        auto bytes = content;
+        memcpy(bytes.data() + offset, &value, sizeof(value));
+        return bytes;
+    };
+    for (uint64_t size : {0ul, 100ul, 70'000ul, content.size() / 2, content.size() - 1}) {
+        verify(loadFails(content.substr(0, size), TMap(100'000, 0, TWyHasher{45})));
+    }
+    verify(loadFails(content, TStrStrHashMap<TWyHasher, TLruEviction, TCompactBlobStringsStorage>(100'000, 0, TWyHasher{45})));
+    // Offsets of the storage snapshot header fields and of the sections after it, see `TBlobStringsStorage::Save`.
+    constexpr uint64_t dataOffset = 64 << 10;
+    uint64_t dataSize = 0;
+    uint64_t positionsCount = 0;
+    memcpy(&dataSize, content.data() + 56, sizeof(dataSize));
+    memcpy(&positionsCount, content.data() + 64, sizeof(positionsCount));
+    const uint64_t mapHeaderOffset = dataOffset + dataSize + positionsCount * sizeof(int64_t);
+    verify(mapHeaderOffset + 32 <= content.size());
+    verify(loadFails(patched(8, 2), TMap(100'000, 0, TWyHasher{45}))); // Version.
+    verify(loadFails(patched(56, content.size()), TMap(100'000, 0, TWyHasher{45}))); // DataSize past the end.
+    verify(loadFails(patched(56, 1ull << 40), TMap(100'000, 0, TWyHasher{45}))); // DataSize past the offset width.
+    verify(loadFails(patched(64, 1ull << 31), TMap(100'000, 0, TWyHasher{45}))); // PositionsCount.
+    verify(loadFails(patched(dataOffset + dataSize, dataSize), TMap(100'000, 0, TWyHasher{45}))); // First position.
+    verify(loadFails(patched(mapHeaderOffset + 24, 1ull << 40), TMap(100'000, 0, TWyHasher{45}))); // HashTableSize.
+    verify(!loadFails(content, TMap(100'000, 0, TWyHasher{45})));
+    std::remove(badPath.c_str());
+    std::remove(path.c_str());
+}
+
+void SSHM_IncrementalRehashTest()
+{
+    constexpr int N = 1'000'000;
+    TStrStrHashMap<> m(200'000'000);
+    std::vector<std::string> keys(N);
+    for (int i = 0; i < N; ++i) {
+        keys[i] = std::to_string(i);
+    }
+
+    using TClock = std::chrono::steady_clock;
+    TClock::duration maxPutTime{};
+    for (int i = 0; i < N; ++i) {
+        const auto start = TClock::now();
+        m.Put(keys[i], keys[i]);
+        maxPutTime = std::max(maxPutTime, TClock::now() - start);
+        // Elements of migrated and not migrated buckets are found, erase works in both tables.
+        const int j = i * 7 % (i + 1);
+        verify(m.Get(keys[j]).first == keys[j]);
+        if (i % 3 == 0) {
+            verify(m.Erase(keys[j]));
+            verify(m.Get(keys[j]).first.data() == nullptr);
+            m.Put(keys[j], keys[j]);
+        }
+    }
+    verify(m.ElementsCount() == N);
+    for (int i = 0; i < N; ++i) {
+        verify(m.Get(keys[i]).first == keys[i]);
+    }
+    std::cerr << "Incremental-rehash " << "(Elements: " << N << ", MaxPutTimeUs: "
+        << std::chrono::duration_cast<std::chrono::microseconds>(maxPutTime).count() << ")" << std::endl;
+}
+
+void SSHM_StressTest()
+{
+    srand(45);
+    TStrStrHashMap<> m(1'000'000'000);
+    const int N = 4500000;
+    std::vector<bool> filled(N, false);
+    std::vector<std::string> keys(N);
+    std::vector<char> valueData(1'000'000);
+    for (auto& c : valueData) {
+        c = rand() % 100;
+    }
+    std::vector<std::string_view> values(N);
+    for (int i = 0; i < N; ++i) {
+        keys[i] = std::to_string(i);
+        keys[i].resize(keys[i].size() + rand() % 10);
+        int valueSize = rand() % 200;
+        if (rand() % 10 == 0) {
+            valueSize = rand() % 2000;
+        }
+        if (rand() % 400 == 0) {
+            valueSize = rand() % 20000;
+        }
+        if (rand() % 5000 == 0) {
+            valueSize = rand() % 200000;
+        }
+        values[i] = std::string_view{valueData.begin(), valueData.end()}.substr(rand() % (valueData.size() - valueSize), valueSize);
+    }
+
+    {
+        auto start = Now();
+        for (int i = 0; i < N * 3; ++i) {
+            const int j = rand() % N;
+            if (rand() % 4 > 0) {
+                m.Put(keys[j], values[j]);
+                filled[j] = true;
+            } else {
+                auto [val, idx] = m.Get(keys[j]);
+                if (val.data() != nullptr) {
+                    verify(filled[j]);
+                    verify(val == values[j]);
+                } else {
+                    verify(!filled[j]);
+                }
+                m.Erase(keys[j]);
+                filled[j] = false;
+            }
+        }
+        std::cerr << "Put-Erase " << "(Time: " << Now() - start << ", FillRate: " << m.FillRate()
+            << ", Rss: " << Rss() << ", DefragmentatedBytes:" << m.DefragmentatedBytes() << ")" << std::endl;
+    }
+    {
+        auto start = Now();
+        for (int i = 0; i < 3000000; ++i) {
+            const int j = rand() % N;
+            m.Get(keys[j]);
+        }
+        std::cerr << "Get " << "(Time: " << Now() - start << ", FillRate: " << m.FillRate() << ", Rss: " << Rss() << ")" << std::endl;
+    }
+    // Change pattern.
+    {
+        auto start = Now();
+        int J = 10;
+        uint64_t sz = 0;
+        for (int i = 0; i < N; ++i) {
+            if (filled[i]) {
+                if (rand() % J != 0) {
+                    sz += m.Get(keys[i]).first.size();
+                    m.Erase(keys[i]);
+                    filled[i] = false;
+                    if (rand() % (J - 1) == 0) {
+                        m.Put(keys[i], std::string_view{valueData.begin(), valueData.end()}.substr(0, sz));
+                        sz = 0;
+                    }
+                }
+            }
+
+        }
+        std::cerr << "Change-pattern " << "(J: " << J << ", Time: " << Now() - start << ", FillRate: " << m.FillRate()
+            << ", Rss: " << Rss() << ", DefragmentatedBytes:" << m.DefragmentatedBytes() << ")" << std::endl;
+    }
+}
+
+// Map with Get from any number of threads and compaction on a dedicated thread, with epoch-based reclamation.
+// Readers take no lock and write nothing shared but an epoch counter, and neither writers nor compaction wait for them.
+// The index is an open addressing table of atomic slots with offsets of entries in the storage buffer, not indexes,
+// so readers do not read `Positions_` or storage headers, that writers change. A published entry is never changed:
+// Put writes a new entry to a free gap and publishes it in the slot, the replaced or erased one is retired.
+// Compaction copies entries to free space (see `CopyIncrementally`), publishes the copies and retires the originals.
+// Retired entries are pinned in the storage, and they and old slot tables are reused only when every reader
+// that entered before the retirement has left: a reader enters the current epoch, the epoch advances only when
+// no reader is left in the previous one, so entries retired two epochs ago are unreachable.
+// A long-lived read guard delays reuse of retired space, nothing else.
+// Put and Erase are serialized by a mutex, that a compaction step holds for at most `compactionBytesPerStep`
+// copied bytes. Put never waits for compaction: without a free gap for the entry it returns NilIndex,
+// wakes the compaction thread up and leaves the old value.
+template <typename THasher = std::hash<std::string_view>>
+class TBackgroundCompactedStrStrHashMap
+{
+public:
+    // ExactRank, so a compacted buffer has a gap for every entry that fits its free space (see `HasGapFor`).
+    using TStorage = TBasicBlobStringsStorage<int64_t, 38, 38, 32, TFitPolicy::ExactRank>;
+    using TIndex = TStorage::TIndex;
+    using TValue = TStorage::TValue;
+    static inline constexpr TIndex NilIndex = TStorage::NilIndex;
+    static inline constexpr TValue NilValue = TStorage::NilValue;
+
+    // Values returned by `Get` stay valid while the guard is alive. The thread may write meanwhile.
+    class TReadGuard
+    {
+    public:
+        TReadGuard(TReadGuard&& other)
+            : Count_(std::exchange(other.Count_, nullptr))
+        { }
+
+        TReadGuard(const TReadGuard&) = delete;
+        TReadGuard& operator=(const TReadGuard&) = delete;
+        TReadGuard& operator=(TReadGuard&&) = delete;
+
+        ~TReadGuard()
+        {
+            if (Count_) {
+                Count_->fetch_sub(1);
+            }
+        }
+
+    private:
+        friend class TBackgroundCompactedStrStrHashMap;
+
+        explicit TReadGuard(std::atomic<uint64_t>* count)
+            : Count_(count)
+        { }
+
+    private:
+        std::atomic<uint64_t>* Count_;
+    };
+
+    TBackgroundCompactedStrStrHashMap(uint64_t bufferSize, uint64_t compactionBytesPerStep = 64 << 10,
+                                      THasher hasher = THasher())
+        : Storage_(bufferSize) // No compaction inside Allocate, Put takes only free gaps.
+        , Hasher_(std::move(hasher))
+        , CompactionBytesPerStep_(compactionBytesPerStep)
+        , Table_(std::make_unique<TTable>(MinSlotsCount))
+        , PublishedTable_(Table_.get())
+        , CompactionThread_([this] { CompactionLoop(); })
+    { }
+
+    ~TBackgroundCompactedStrStrHashMap()
+    {
+        {
+            std::lock_guard lock(WriteMutex_);
+            Stop_ = true;
+        }
+        WorkAvailable_.notify_one();
+        CompactionThread_.join();
+    }
+
+    TReadGuard Read()
+    {
+        auto& slot = ReaderSlots_[GetReaderSlotIndex()];
+        while (true) {
+            const uint64_t epoch = Epoch_.load();
+            auto& count = slot.Counts[epoch % 2];
+            count.fetch_add(1);
+            if (Epoch_.load() == epoch) { // Both are seq_cst, so either we see the new epoch or the writer sees our count.
+                return TReadGuard(&count);
+            }
+            count.fetch_sub(1);
+        }
+    }
+
+    TValue Get(const TReadGuard&, std::string_view key)
+    {
+        const uint64_t keyHash = Hasher_(key);
+        const TTable& table = *PublishedTable_.load(std::memory_order_acquire);
+        for (uint64_t pos = keyHash & table.Mask; ; pos = (pos + 1) & table.Mask) {
+            const uint64_t slot = table.Slots[pos].load(std::memory_order_acquire);
+            if (slot == EmptySlot) {
+                return NilValue;
+            }
+            if (slot == DeletedSlot || (slot ^ keyHash) >> SlotOffsetBits != 0) {
+                continue;
+            }
+            char* entry = Data_ + (slot & SlotOffsetMask) * SlotOffsetUnit;
+            const TEntryHeader& header = *reinterpret_cast<const TEntryHeader*>(entry);
+            if (std::string_view(entry + sizeof(TEntryHeader), header.KeySize) == key) {
+                return {entry + sizeof(TEntryHeader) + header.KeySize, header.ValueSize};
+            }
+        }
+    }
+
+    // Throws "no space" if live entries fill the buffer. NilIndex if there is no free gap for the entry yet
+    // or the space is held by retired entries that readers may still see, the old value stays then.
+    TIndex Put(std::string_view key, std::string_view value)
+    {
+        if (key.size() > std::numeric_limits<uint32_t>::max() || value.size() > std::numeric_limits<uint32_t>::max()) {
+            throw std::runtime_error("too large value");
+        }
+        const uint64_t keyHash = Hasher_(key);
+        const uint64_t size = sizeof(TEntryHeader) + key.size() + value.size();
+        std::lock_guard lock(WriteMutex_);
+        Reclaim();
+        if (!Storage_.HasSpaceFor(size)) {
+            if (RetiredEntries_.empty()) {
+                throw std::runtime_error("no space");
+            }
+            return NilIndex;
+        }
+        NotifyCompaction();
+        if (!Storage_.HasGapFor(size)) {
+            return NilIndex;
+        }
+        if ((FullSlotsCount_ + DeletedSlotsCount_ + 1) * 8 > (Table_->Mask + 1) * 7) {
+            // Grow only if full slots take more than a half of the max load (7/16), otherwise just drop tombstones.
+            Rehash((FullSlotsCount_ + 1) * 2 * 8 > (Table_->Mask + 1) * 7 ? (Table_->Mask + 1) * 2 : Table_->Mask + 1);
+        }
+
+        auto [sval, idx] = Storage_.Allocate(size);
+        TEntryHeader& header = *reinterpret_cast<TEntryHeader*>(sval.data());
+        header.KeySize = key.size();
+        header.ValueSize = value.size();
+        std::memcpy(sval.data() + sizeof(TEntryHeader), key.data(), key.size());
+        std::memcpy(sval.data() + sizeof(TEntryHeader) + key.size(), value.data(), value.size());
+
+        const uint64_t pos = FindPosition(keyHash, key);
+        const TIndex oldIdx = Table_->Meta[pos].Index;
+        if (oldIdx == EmptyIndex) {
+            InsertSlot(keyHash, idx);
+        } else {
+            Publish(pos, keyHash, idx); // Readers see the old value or the new one, never a miss.
+            Retire(oldIdx);
+        }
+        return idx;
+    }
+
+    bool Erase(std::string_view key)
+    {
+        const uint64_t keyHash = Hasher_(key);
+        std::lock_guard lock(WriteMutex_);
+        Reclaim();
+        const uint64_t pos = FindPosition(keyHash, key);
+        const TIndex idx = Table_->Meta[pos].Index;
+        if (idx == EmptyIndex) {
+            return false;
+        }
+        Table_->Meta[pos].Index = DeletedIndex;
+        Table_->Slots[pos].store(DeletedSlot, std::memory_order_release);
+        --FullSlotsCount_;
+        ++DeletedSlotsCount_;
+        Retire(idx);
+        NotifyCompaction();
+        return true;
+    }
+
+    uint64_t ElementsCount()
+    {
+        std::lock_guard lock(WriteMutex_);
+        return FullSlotsCount_;
+    }
+
+    // With retired entries that are not reclaimed yet.
+    double FillRate()
+    {
+        std::lock_guard lock(WriteMutex_);
+        return Storage_.FillRate();
+    }
+
+    uint64_t DefragmentatedBytes()
+    {
+        std::lock_guard lock(WriteMutex_);
+        return Storage_.DefragmentatedBytes();
+    }
+
+    // Retired entries that readers may still see.
+    uint64_t RetiredCount()
+    {
+        std::lock_guard lock(WriteMutex_);
+        return RetiredEntries_.size();
+    }
+
+private:
+    static constexpr uint64_t MinSlotsCount = 16;
+    static constexpr TIndex EmptyIndex = NilIndex;
+    static constexpr TIndex DeletedIndex = NilIndex - 1;
+    // Slot is `keyHash` bits above `SlotOffsetBits` (a tag) and the entry offset in `SlotOffsetUnit`s,
+    // 0 and 1 are not offsets of entries, the buffer begins with storage service nodes.
+    static constexpr uint64_t EmptySlot = 0;
+    static constexpr uint64_t DeletedSlot = 1;
+    static constexpr int SlotOffsetBits = 38;
+    static constexpr uint64_t SlotOffsetMask = (1ull << SlotOffsetBits) - 1;
+    static constexpr uint64_t SlotOffsetUnit = 4; // Storage values are 4-byte aligned.
+    static_assert(TStorage::MaxSize / SlotOffsetUnit <= SlotOffsetMask);
+
+    struct TEntryHeader
+    {
+        uint32_t KeySize;
+        uint32_t ValueSize;
+    };
+
+    // Only writers read `Meta`: full hashes for rehash and storage indexes for Free.
+    struct TSlotMeta
+    {
+        uint64_t KeyHash = 0;
+        TIndex Index = EmptyIndex;
+    };
+
+    struct TTable
+    {
+        explicit TTable(uint64_t slotsCount)
+            : Slots(new std::atomic<uint64_t>[slotsCount])
+            , Meta(slotsCount)
+            , Mask(slotsCount - 1)
+        {
+            for (uint64_t i = 0; i < slotsCount; ++i) {
+                Slots[i].store(EmptySlot, std::memory_order_relaxed);
+            }
+        }
+
+        std::unique_ptr<std::atomic<uint64_t>[]> Slots;
+        std::vector<TSlotMeta> Meta;
+        uint64_t Mask;
+    };
+
+    struct alignas(64) TReaderSlot // Own cache line, so readers do not share written memory.
+    {
+        std::atomic<uint64_t> Counts[2] = {0, 0}; // Readers by the parity of the epoch they entered.
+    };
+
+    template <typename T>
+    struct TRetired
+    {
+        uint64_t Epoch;
+        T Item;
+    };
+
+    static constexpr size_t ReaderSlotsCount = 64;
+
+    static size_t GetReaderSlotIndex()
+    {
+        static std::atomic<size_t> nextIndex = 0;
+        static thread_local const size_t index = nextIndex.fetch_add(1) % ReaderSlotsCount;
+        return index;
+    }
+
+    std::string_view GetKey(TIndex index)
+    {
+        auto sval = Storage_.Get(index);
+        const TEntryHeader& header = *reinterpret_cast<const TEntryHeader*>(sval.data());
+        return {sval.data() + sizeof(TEntryHeader), header.KeySize};
+    }
+
+    // Slot of the key in the current table, or the empty one that ends its probe sequence.
+    uint64_t FindPosition(uint64_t keyHash, std::string_view key)
+    {
+        const TTable& table = *Table_;
+        for (uint64_t pos = keyHash & table.Mask; ; pos = (pos + 1) & table.Mask) {
+            const TSlotMeta& meta = table.Meta[pos];
+            if (meta.Index == EmptyIndex) {
+                return pos;
+            }
+            if (meta.Index != DeletedIndex && meta.KeyHash == keyHash && GetKey(meta.Index) == key) {
+                return pos;
+            }
+        }
+    }
+
+    // Entry is written before, so a reader that sees the slot sees the whole entry.
+    void Publish(uint64_t pos, uint64_t keyHash, TIndex index)
+    {
+        Table_->Meta[pos] = {keyHash, index};
+        const uint64_t offset = Storage_.Get(index).data() - Data_;
+        Table_->Slots[pos].store((keyHash & ~SlotOffsetMask) | offset / SlotOffsetUnit, std::memory_order_release);
+    }
+
+    void InsertSlot(uint64_t keyHash, TIndex index)
+    {
+        const TTable& table = *Table_;
+        for (uint64_t pos = keyHash & table.Mask; ; pos = (pos + 1) & table.Mask) {
+            const TIndex slotIndex = table.Meta[pos].Index;
+            if (slotIndex == EmptyIndex || slotIndex == DeletedIndex) {
+                DeletedSlotsCount_ -= slotIndex == DeletedIndex;
+                ++FullSlotsCount_;
+                Publish(pos, keyHash, index);
+                return;
+            }
+        }
+    }
+
+    // Readers move to the new table, the old one is retired.
+    void Rehash(uint64_t slotsCount)
     {
-        return *reinterpret_cast<THeader*>(svalue.data());
+        auto oldTable = std::exchange(Table_, std::make_unique<TTable>(slotsCount));
+        FullSlotsCount_ = 0;
+        DeletedSlotsCount_ = 0;
+        for (const TSlotMeta& meta : oldTable->Meta) {
+            if (meta.Index != EmptyIndex && meta.Index != DeletedIndex) {
+                InsertSlot(meta.KeyHash, meta.Index);
+            }
+        }
+        PublishedTable_.store(Table_.get(), std::memory_order_release);
+        RetiredTables_.push_back({Epoch_.load(), std::move(oldTable)});
     }
 
-    std::string_view GetKey(TValue svalue)
+    // The entry is not published any more. Pinned, it is neither moved nor reused until `Reclaim` unpins it.
+    void Retire(TIndex index)
     {
-        auto s = svalue.subspan(sizeof(THeader), GetHeader(svalue).KeySize);
-        return {s.data(), s.size()};
+        Storage_.Pin(index);
+        Storage_.Free(index);
+        RetiredEntries_.push_back({Epoch_.load(), index});
     }
 
-    TValue GetValue(TValue svalue)
+    // From `CopyIncrementally`, that has pinned and freed the original.
+    void Relocate(TIndex oldIndex, TIndex newIndex)
     {
-        return svalue.subspan(sizeof(THeader) + GetHeader(svalue).KeySize);
+        const uint64_t keyHash = Hasher_(GetKey(newIndex));
+        const TTable& table = *Table_;
+        uint64_t pos = keyHash & table.Mask;
+        while (table.Meta[pos].Index != oldIndex) {
+            verify(table.Meta[pos].Index != EmptyIndex); // Every unpinned element is a published entry.
+            pos = (pos + 1) & table.Mask;
+        }
+        Publish(pos, keyHash, newIndex);
+        RetiredEntries_.push_back({Epoch_.load(), oldIndex});
     }
 
-    // (prevIndex, foundIndex) or (nil, nil)
-    std::pair<TIndex, TIndex> FindInBucket(uint64_t bucket, uint64_t hash, std::string_view key)
+    // Readers of the epoch before the current one have left, so the epoch may advance. Never waits.
+    bool TryAdvanceEpoch()
     {
-        TIndex prevIdx = NilIndex;
-        TIndex idx = HashTable_[bucket];
-        while (idx != NilIndex) {
-            auto sval = Storage_.Get(idx);
-            auto& header = GetHeader(sval);
-            if (header.KeyHash == hash && key == GetKey(sval)) {
-                return {prevIdx, idx};
+        const uint64_t epoch = Epoch_.load();
+        for (auto& slot : ReaderSlots_) {
+            if (slot.Counts[(epoch + 1) % 2].load() != 0) {
+                return false;
             }
-            prevIdx = idx;
-            idx = header.ListNext;
         }
-        return {NilIndex, NilIndex};
+        Epoch_.store(epoch + 1);
+        return true;
     }
 
-    TIndex EraseFromBucket(uint64_t bucket, uint64_t hash, std::string_view key)
+    // Reuses what was retired two epochs ago. Under `WriteMutex_`, as every change of the epoch.
+    void Reclaim()
     {
-        auto [prevIdx, idx] = FindInBucket(bucket, hash, key);
-        if (idx != NilIndex) {
-            auto sval = Storage_.Get(idx);
-            auto& header = GetHeader(sval);
-            if (prevIdx == NilIndex) {
-                assert(idx == HashTable_[bucket]);
-                HashTable_[bucket] = header.ListNext;
-            } else {
-                GetHeader(Storage_.Get(prevIdx)).ListNext = header.ListNext;
-            }
-            return idx;
+        for (int i = 0; i < 2 && !(RetiredEntries_.empty() && RetiredTables_.empty()) && TryAdvanceEpoch(); ++i) {
+        }
+        const uint64_t epoch = Epoch_.load();
+        while (!RetiredEntries_.empty() && RetiredEntries_.front().Epoch + 2 <= epoch) {
+            Storage_.Unpin(RetiredEntries_.front().Item); // Frees it.
+            RetiredEntries_.pop_front();
+        }
+        while (!RetiredTables_.empty() && RetiredTables_.front().Epoch + 2 <= epoch) {
+            RetiredTables_.pop_front();
         }
-        return NilIndex;
     }
 
-    void InsertToBucket(uint64_t bucket, TIndex idx, THeader& header)
+    // Under `WriteMutex_` from the writer, so any write (maybe freed space) wakes up the compaction.
+    void NotifyCompaction()
     {
-        header.ListNext = HashTable_[bucket];
-        HashTable_[bucket] = idx;
+        HasWork_ = true;
+        WorkAvailable_.notify_one();
     }
 
-    void DoubleHashTable()
+    void CompactionLoop()
     {
-        auto oldHashTable = std::move(HashTable_);
-        HashTable_.assign(oldHashTable.size() * 2, NilIndex);
-        for (auto startIdx : oldHashTable) {
-            auto idx = startIdx;
-            while (idx != NilIndex) {
-                auto sval = Storage_.Get(idx);
-                auto& header = GetHeader(sval);
-                auto nextIdx = header.ListNext;
-                InsertToBucket(header.KeyHash % HashTable_.size(), idx, header);
-                idx = nextIdx;
+        std::unique_lock lock(WriteMutex_);
+        while (!Stop_) {
+            if (!HasWork_) {
+                WorkAvailable_.wait(lock, [this] { return Stop_ || HasWork_; });
+                continue;
             }
+            const size_t retiredCount = RetiredEntries_.size();
+            HasWork_ = Storage_.CopyIncrementally(CompactionBytesPerStep_, [this](TIndex oldIndex, TIndex newIndex) {
+                Relocate(oldIndex, newIndex);
+            });
+            // Originals of the copies are freed after readers leave, then the bubble grows and the sweep goes on.
+            const uint64_t stepEpoch = Epoch_.load();
+            while (!Stop_ && RetiredEntries_.size() != retiredCount && Epoch_.load() < stepEpoch + 2) {
+                Reclaim();
+                // Let writers in, they do not wait for readers.
+                lock.unlock();
+                std::this_thread::yield();
+                lock.lock();
+            }
+            Reclaim();
+            lock.unlock();
+            std::this_thread::yield();
+            lock.lock();
         }
     }
 
 private:
-    TStringsStorage Storage_;
-    // Overhead per one element is sizeof(TIndex) = 4.
-    std::vector<TIndex> HashTable_;
+    TStorage Storage_;
+    char* const Data_ = Storage_.Data();
+    THasher Hasher_;
+    const uint64_t CompactionBytesPerStep_;
+
+    // Writers use `Table_`, readers the same `PublishedTable_`.
+    std::unique_ptr<TTable> Table_;
+    std::atomic<TTable*> PublishedTable_;
+    uint64_t FullSlotsCount_ = 0;
+    uint64_t DeletedSlotsCount_ = 0;
+
+    std::atomic<uint64_t> Epoch_ = 2; // Epochs of retired items minus 2 do not underflow.
+    TReaderSlot ReaderSlots_[ReaderSlotsCount];
+    std::deque<TRetired<TIndex>> RetiredEntries_; // The oldest first.
+    std::deque<TRetired<std::unique_ptr<TTable>>> RetiredTables_;
+
+    // Serializes writers and compaction steps.
+    std::mutex WriteMutex_;
+    std::condition_variable WorkAvailable_;
+    bool HasWork_ = false;
+    bool Stop_ = false;
+
+    std::thread CompactionThread_; // The last one: started when everything else is constructed.
 };
 
-void SSHM_SimpleTest()
+void SSHM_BackgroundCompactionTest()
 {
-    srand(45);
-    TStrStrHashMap m(1000000);
-    auto [val1, idx1] = m.Put("key1", "value1");
-    verify(m.Get("key1").first == "value1"sv);
-    auto [val2, idx2] = m.Put("key2", "value2");
-    verify(m.Get("key2").first == "value2"sv);
-    verify(m.Erase("key1"));
-    verify(m.Get("key1").first.data() == nullptr);
-    verify(!m.Erase("key1"));
-    verify(m.Erase(idx2));
-    verify(m.Get("key2").first.data() == nullptr);
-    verify(!m.Erase(idx2));
+    constexpr int N = 2000;
+    constexpr int StableN = 100;
+    constexpr int ReadersCount = 3;
+    TBackgroundCompactedStrStrHashMap<> m(1'000'000, 4096);
 
-    for (int i = 0; i < 94; ++i) {
-        auto val = m.PutUnitialized(std::to_string(i), 10000).first;
-        for (auto& e : val) {
-            e = i;
-        }
+    std::vector<std::string> keys(N);
+    for (int i = 0; i < N; ++i) {
+        keys[i] = std::to_string(i);
     }
-    for (int i = 0; i < 94; ++i) {
-        auto val = m.Get(std::to_string(i)).first;
-        for (auto& e : val) {
-            verify(e == i);
-        }
+    // Never replaced, so readers must always find them, also while compaction copies them.
+    for (int i = 0; i < StableN; ++i) {
+        verify(m.Put("stable" + keys[i], std::string(i + 1, static_cast<char>(i))) != m.NilIndex);
     }
-    for (int i = 0; i < 94; i += 2) {
-        verify(m.Erase(std::to_string(i)));
+    std::string valueData;
+
+    std::atomic<bool> stop = false;
+    std::atomic<uint64_t> readsCount = 0;
+    std::vector<std::thread> readers;
+    for (int r = 0; r < ReadersCount; ++r) {
+        readers.emplace_back([&, r] {
+            int j = r;
+            while (!stop.load()) {
+                j = (j * 31 + 7) % N;
+                auto guard = m.Read();
+                for (char e : m.Get(guard, keys[j])) {
+                    verify(e == static_cast<char>(j));
+                }
+                auto stable = m.Get(guard, "stable" + keys[j % StableN]);
+                verify(stable.size() == static_cast<uint64_t>(j % StableN + 1));
+                for (char e : stable) {
+                    verify(e == static_cast<char>(j % StableN));
+                }
+                readsCount.fetch_add(1);
+            }
+        });
     }
-    for (int i = 0; i < 94; i += 2) {
-        auto val = m.PutUnitialized(std::to_string(i), 10000).first;
-        for (auto& e : val) {
-            e = i;
+
+    srand(45);
+    uint64_t noGapPuts = 0;
+    for (int i = 0; i < 100000; ++i) {
+        const int j = rand() % N;
+        if (rand() % 3 > 0) {
+            valueData.assign(rand() % 400, static_cast<char>(j));
+            noGapPuts += m.Put(keys[j], valueData) == m.NilIndex;
+        } else {
+            m.Erase(keys[j]);
         }
     }
-    for (int i = 0; i < 94; ++i) {
-        auto val = m.Get(std::to_string(i)).first;
-        for (auto& e : val) {
-            verify(e == i);
+    stop.store(true);
+    for (auto& reader : readers) {
+        reader.join();
+    }
+    verify(readsCount.load() > 0);
+    std::cerr << "Background-compaction " << "(Reads: " << readsCount.load() << ", NoGapPuts: " << noGapPuts
+        << ", FillRate: " << m.FillRate() << ", DefragmentatedBytes:" << m.DefragmentatedBytes() << ")" << std::endl;
+}
+
+void SSHM_BackgroundCompactionPutTest()
+{
+    // Gaps of erased entries are too small for the new values. Put does not wait for the compaction thread,
+    // it returns NilIndex and keeps the old value until compaction makes a gap.
+    TBackgroundCompactedStrStrHashMap<> m(1'000'000, 4096);
+    int count = 0;
+    try {
+        for (; ; ++count) {
+            while (m.Put(std::to_string(count), std::string(1000, static_cast<char>(count))) == m.NilIndex) {
+                std::this_thread::yield();
+            }
         }
+    } catch (const std::runtime_error&) { // No space.
     }
-    for (int i = 0; i < 94; i += 2) {
+    verify(count > 500);
+    for (int i = 0; i < count; i += 2) {
         verify(m.Erase(std::to_string(i)));
     }
-    for (int i = 100; i < 120; ++i) {
-        auto val = m.PutUnitialized(std::to_string(i), 20000).first;
-        for (auto& e : val) {
-            e = i;
+    uint64_t noGapPuts = 0;
+    for (int i = 0; i < count / 4; ++i) {
+        const std::string key = "large" + std::to_string(i);
+        while (m.Put(key, std::string(1500, 'l')) == m.NilIndex) {
+            ++noGapPuts;
+            std::this_thread::yield();
         }
     }
-    for (int i = 1; i < 94; i += 2) {
-        auto val = m.Get(std::to_string(i)).first;
-        for (auto& e : val) {
-            verify(e == i);
-        }
+    verify(m.DefragmentatedBytes() > 0);
+    auto guard = m.Read();
+    for (int i = 1; i < count - 1; i += 2) {
+        auto val = m.Get(guard, std::to_string(i));
+        verify(val.size() == 1000 && val[999] == static_cast<char>(i));
     }
+    std::cerr << "Background-compaction-put " << "(NoGapPuts: " << noGapPuts << ")" << std::endl;
+}
 
-    m.Clear();
+void SSHM_BackgroundCompactionGuardTest()
+{
+    // A value read under a guard stays intact while the same thread replaces it many times and compaction runs.
+    // Its space is reused only after the guard is gone.
+    TBackgroundCompactedStrStrHashMap<> m(1'000'000, 4096);
+    for (int i = 0; i < 50; ++i) {
+        verify(m.Put(std::to_string(i), std::string(1000, static_cast<char>(i))) != m.NilIndex);
+    }
+    {
+        auto guard = m.Read();
+        auto val = m.Get(guard, "7");
+        verify(val.size() == 1000);
+        for (int round = 0; round < 5; ++round) {
+            for (int i = 0; i < 50; ++i) {
+                while (m.Put(std::to_string(i), std::string(500 + round * 20, 'r')) == m.NilIndex) {
+                    std::this_thread::yield();
+                }
+            }
+        }
+        verify(m.RetiredCount() >= 50 * 5); // Nothing retired under the guard is reused.
+        for (char e : val) {
+            verify(e == static_cast<char>(7));
+        }
+        verify(m.Get(guard, "7").size() == 500 + 4 * 20);
+        // Fits the buffer without the retired entries, but they are still visible. The old value stays.
+        verify(m.Put("7", std::string(900'000, 'l')) == m.NilIndex);
+        verify(m.Get(guard, "7").size() == 500 + 4 * 20);
+    }
+    verify(m.Put("after", "guard") != m.NilIndex);
+    verify(m.RetiredCount() < 50);
 }
 
-void SSHM_StressTest()
+// Thread-safe TStrStrHashMap for multi-core serving. Every shard owns a slice of the buffer
+// (one large allocation), its own hash table and its own lock.
+// Shard is selected by high bits of the 56-bit key hash: buckets inside a shard use low bits, so they stay independent.
+template <typename THasher = std::hash<std::string_view>>
+class TShardedStrStrHashMap
 {
-    srand(45);
-    TStrStrHashMap m(1'000'000'000);
-    const int N = 4500000;
-    std::vector<bool> filled(N, false);
-    std::vector<std::string> keys(N);
-    std::vector<char> valueData(1'000'000);
-    for (auto& c : valueData) {
-        c = rand() % 100;
+public:
+    using TMap = TStrStrHashMap<THasher>;
+    using TIndex = typename TMap::TIndex;
+    using TValue = typename TMap::TValue;
+
+    // `shardsCount` must be a power of two, every shard gets `bufferSize / shardsCount` bytes.
+    TShardedStrStrHashMap(uint64_t bufferSize, uint64_t shardsCount, uint64_t defragmentationBytesPerAllocation = 0, THasher hasher = THasher())
+        : ShardsCount_(shardsCount)
+        , Hasher_(hasher)
+    {
+        if (shardsCount == 0 || (shardsCount & (shardsCount - 1)) != 0 || shardsCount > (1ull << KeyHashBits)) {
+            throw std::runtime_error("shards count must be a power of two");
+        }
+        ShardBits_ = __builtin_ctzll(shardsCount);
+        Shards_ = std::make_unique<std::optional<TShard>[]>(shardsCount);
+        for (uint64_t i = 0; i < shardsCount; ++i) {
+            Shards_[i].emplace(bufferSize / shardsCount, defragmentationBytesPerAllocation, hasher);
+        }
     }
-    std::vector<std::string_view> values(N);
-    for (int i = 0; i < N; ++i) {
-        keys[i] = std::to_string(i);
-        keys[i].resize(keys[i].size() + rand() % 10);
-        int valueSize = rand() % 200;
-        if (rand() % 10 == 0) {
-            valueSize = rand() % 2000;
+
+    // Throws "no space" from the shard storage, as TStrStrHashMap::Put does.
+    void Put(std::string_view key, std::string_view value)
+    {
+        const uint64_t keyHash = Hasher_(key) & TMap::KeyHashMask;
+        auto& shard = GetShard(keyHash);
+        std::lock_guard lock(shard.Mutex);
+        shard.Map.Put(key, keyHash, value);
+    }
+
+    // Value is valid only inside `func`: it is called under the shard lock,
+    // after the lock is released any Put to the shard may move it.
+    template <typename TFunc>
+    bool Get(std::string_view key, TFunc&& func)
+    {
+        const uint64_t keyHash = Hasher_(key) & TMap::KeyHashMask;
+        auto& shard = GetShard(keyHash);
+        std::lock_guard lock(shard.Mutex);
+        auto [val, idx] = shard.Map.Get(key, keyHash);
+        if (val.data() == nullptr) {
+            return false;
         }
-        if (rand() % 400 == 0) {
-            valueSize = rand() % 20000;
+        func(val);
+        return true;
+    }
+
+    bool Erase(std::string_view key)
+    {
+        const uint64_t keyHash = Hasher_(key) & TMap::KeyHashMask;
+        auto& shard = GetShard(keyHash);
+        std::lock_guard lock(shard.Mutex);
+        return shard.Map.Erase(key, keyHash);
+    }
+
+    // Compacts shards one by one, every one for about `byteBudget` moved bytes.
+    // Busy shards are skipped, so idle threads do not stall serving ones.
+    bool DoHeavyWork(uint64_t byteBudget)
+    {
+        bool hasWork = false;
+        for (uint64_t i = 0; i < ShardsCount_; ++i) {
+            std::unique_lock lock(Shards_[i]->Mutex, std::try_to_lock);
+            hasWork |= !lock.owns_lock() || Shards_[i]->Map.DoHeavyWork(byteBudget);
         }
-        if (rand() % 5000 == 0) {
-            valueSize = rand() % 200000;
+        return hasWork;
+    }
+
+    uint64_t ElementsCount()
+    {
+        uint64_t count = 0;
+        for (uint64_t i = 0; i < ShardsCount_; ++i) {
+            std::lock_guard lock(Shards_[i]->Mutex);
+            count += Shards_[i]->Map.ElementsCount();
         }
-        values[i] = std::string_view{valueData.begin(), valueData.end()}.substr(rand() % (valueData.size() - valueSize), valueSize);
+        return count;
     }
 
+    double FillRate()
     {
-        auto start = Now();
-        for (int i = 0; i < N * 3; ++i) {
-            const int j = rand() % N;
-            if (rand() % 4 > 0) {
-                m.Put(keys[j], values[j]);
-                filled[j] = true;
-            } else {
-                auto [val, idx] = m.Get(keys[j]);
-                if (val.data() != nullptr) {
-                    verify(filled[j]);
-                    verify(val == values[j]);
-                } else {
-                    verify(!filled[j]);
-                }
-                m.Erase(keys[j]);
-                filled[j] = false;
-            }
+        double fillRate = 0;
+        for (uint64_t i = 0; i < ShardsCount_; ++i) {
+            std::lock_guard lock(Shards_[i]->Mutex);
+            fillRate += Shards_[i]->Map.FillRate();
         }
-        std::cerr << "Put-Erase " << "(Time: " << Now() - start << ", FillRate: " << m.FillRate()
-            << ", Rss: " << Rss() << ", DefragmentatedBytes:" << m.DefragmentatedBytes() << ")" << std::endl;
+        return fillRate / ShardsCount_; // Shards are of equal size.
     }
+
+    uint64_t DefragmentatedBytes()
     {
-        auto start = Now();
-        for (int i = 0; i < 3000000; ++i) {
-            const int j = rand() % N;
-            auto [val, idx] = m.Get(keys[j]);
+        uint64_t bytes = 0;
+        for (uint64_t i = 0; i < ShardsCount_; ++i) {
+            std::lock_guard lock(Shards_[i]->Mutex);
+            bytes += Shards_[i]->Map.DefragmentatedBytes();
         }
-        std::cerr << "Get " << "(Time: " << Now() - start << ", FillRate: " << m.FillRate() << ", Rss: " << Rss() << ")" << std::endl;
+        return bytes;
     }
-    // Change pattern.
+
+private:
+    static constexpr int KeyHashBits = 56;
+
+    struct alignas(64) TShard // Own cache line, so locks of neighbour shards do not share it.
     {
-        auto start = Now();
-        int J = 10;
-        uint64_t sz = 0;
-        for (int i = 0; i < N; ++i) {
-            if (filled[i]) {
-                if (rand() % J != 0) {
-                    sz += m.Get(keys[i]).first.size();
-                    m.Erase(keys[i]);
-                    filled[i] = false;
-                    if (rand() % (J - 1) == 0) {
-                        m.Put(keys[i], std::string_view{valueData.begin(), valueData.end()}.substr(0, sz));
-                        sz = 0;
-                    }
+        TShard(uint64_t bufferSize, uint64_t defragmentationBytesPerAllocation, THasher hasher)
+            : Map(bufferSize, defragmentationBytesPerAllocation, std::move(hasher))
+        { }
+
+        std::mutex Mutex;
+        TMap Map;
+    };
+
+    TShard& GetShard(uint64_t keyHash)
+    {
+        return *Shards_[ShardBits_ == 0 ? 0 : keyHash >> (KeyHashBits - ShardBits_)];
+    }
+
+private:
+    const uint64_t ShardsCount_;
+    [[no_unique_address]] THasher Hasher_;
+    int ShardBits_ = 0;
+    std::unique_ptr<std::optional<TShard>[]> Shards_;
+};
+
+void SSHM_ShardedTest()
+{
+    constexpr int N = 200000;
+    constexpr int ThreadsCount = 4;
+    TShardedStrStrHashMap<> m(100'000'000, 16);
+
+    std::vector<std::string> keys(N);
+    for (int i = 0; i < N; ++i) {
+        keys[i] = std::to_string(i);
+    }
+
+    // Every thread owns keys `j % ThreadsCount == t`, so it knows what must be in the map.
+    auto start = Now();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < ThreadsCount; ++t) {
+        threads.emplace_back([&, t] {
+            std::vector<bool> filled(N, false);
+            std::string value;
+            uint64_t rnd = t;
+            for (int i = 0; i < N; ++i) {
+                rnd = rnd * 6364136223846793005ull + 1442695040888963407ull;
+                const int j = (rnd >> 33) % (N / ThreadsCount) * ThreadsCount + t;
+                const int op = (rnd >> 20) % 4;
+                if (op == 0) {
+                    verify(m.Erase(keys[j]) == filled[j]);
+                    filled[j] = false;
+                } else if (op == 1) {
+                    const bool found = m.Get(keys[j], [&](TShardedStrStrHashMap<>::TValue val) {
+                        for (auto& e : val) {
+                            verify(e == static_cast<char>(j));
+                        }
+                    });
+                    verify(found == filled[j]);
+                } else {
+                    value.assign((rnd >> 40) % 300, static_cast<char>(j));
+                    m.Put(keys[j], value);
+                    filled[j] = true;
                 }
             }
-
-        }
-        std::cerr << "Change-pattern " << "(J: " << J << ", Time: " << Now() - start << ", FillRate: " << m.FillRate()
-            << ", Rss: " << Rss() << ", DefragmentatedBytes:" << m.DefragmentatedBytes() << ")" << std::endl;
+        });
     }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    while (m.DoHeavyWork(1 << 20)) {
+    }
+    std::cerr << "Sharded " << "(Threads: " << ThreadsCount << ", Time: " << Now() - start
+        << ", Elements: " << m.ElementsCount() << ", FillRate: " << m.FillRate()
+        << ", DefragmentatedBytes:" << m.DefragmentatedBytes() << ")" << std::endl;
 }
 
-void test_bitmask()
+template <int N>
+void test_bitmask(int step)
 {
-    constexpr int N = 1024;
     auto mask = TBitMask<N>();
-    for (int i = 0; i < N; ++i) {
+    for (int i = 0; i < N; i += step) {
         verify(mask.Find(i) == -1);
         mask.Set(i);
         for (int j = 0; j <= i; ++j) {
@@ -970,9 +4765,14 @@ void test_bitmask()
         for (int j = i + 1; j < N; ++j) {
             verify(mask.Find(j) == -1);
         }
+        // Another bit in the same block keeps the block nonempty.
+        mask.Set(i ^ 1);
+        mask.Reset(i ^ 1);
+        verify(mask.Find(0) == i);
         mask.Reset(i);
     }
-
+    mask.Set(N - 1);
+    verify(mask.Find(0) == N - 1 && mask.Find(N - 1) == N - 1);
 }
 
 void test_rank()
@@ -981,6 +4781,18 @@ void test_rank()
     for (int i = 0; i < 1000000; ++i) {
         verify(GetRank(i) <= GetRank(i + 1));
     }
+    verify(GetRank(1040) == GetRank(1087) && GetRank(1087) < GetRank(1088));
+
+    // 64 classes in [64 B, 4 KB), 4 classes from 64 KB.
+    using TFine = TLogSizeClasses<4, 6, 2>;
+    for (int i = 0; i < 1000000; ++i) {
+        verify(TFine::Get(i) <= TFine::Get(i + 1));
+    }
+    verify(TFine::Get(1040) == TFine::Get(1055) && TFine::Get(1055) < TFine::Get(1056));
+    verify(TFine::Get(63) < TFine::Get(64) && TFine::Get(64) < TFine::Get(65));
+    verify(TFine::Get(4095) < TFine::Get(4096) && TFine::Get(4096) == TFine::Get(4351));
+    verify(TFine::Get(65536) == TFine::Get(81919) && TFine::Get(81919) < TFine::Get(81920));
+    verify(TFine::Get(200'000'000'000) - TFine::Get(4096) < GetRank(200'000'000'000) - GetRank(4096));
 }
 
 void show_rank()
@@ -1002,16 +4814,208 @@ void show_rank()
     }
 }
 
+#ifndef EXPERIMENT_NO_MAIN
+// Random Get over a buffer much larger than TLB reach of 4 KB pages. Index and Positions_ are in the usual heap.
+void BenchmarkHugePages(std::string_view name, TBufferOptions options)
+{
+    constexpr uint64_t BufferSize = 1ull << 30;
+    constexpr uint64_t GetsCount = 10'000'000;
+    auto start = Now();
+    TStrStrHashMap<std::hash<std::string_view>, TNoEviction, TBlobStringsStorage> m(
+        TBlobStringsStorage(BufferSize, 0, options));
+    const auto constructionTime = Now() - start;
+    const auto constructionRss = Rss();
+
+    const std::string value(100, 'v');
+    uint64_t keysCount = 0;
+    while (m.FillRate() < 0.9) {
+        m.Put(std::to_string(keysCount++), value);
+    }
+    srand(45);
+    uint64_t sum = 0;
+    start = Now();
+    for (uint64_t i = 0; i < GetsCount; ++i) {
+        sum += m.Get(std::to_string((rand() * 1ull * RAND_MAX + rand()) % keysCount)).first[0];
+    }
+    const auto getTime = Now() - start;
+    verify(sum == GetsCount * 'v');
+    std::cerr << name << " (ConstructionTime: " << constructionTime << ", ConstructionRss: " << constructionRss
+        << ", Elements: " << keysCount << ", GetTime: " << getTime << ", Rss: " << Rss() << ")" << std::endl;
+}
+
+// Restart time: Load maps the buffer, so it is about reading the index, and pages come on the first access.
+void BenchmarkSnapshot()
+{
+    constexpr uint64_t BufferSize = 1ull << 30;
+    constexpr uint64_t GetsCount = 1'000'000;
+    const std::string path = "benchmark_snapshot.bin";
+    uint64_t keysCount = 0;
+    double saveTime = 0;
+    {
+        TStrStrHashMap<> m(BufferSize);
+        const std::string value(100, 'v');
+        while (m.FillRate() < 0.9) {
+            m.Put(std::to_string(keysCount++), value);
+        }
+        const auto start = Now();
+        m.Save(path);
+        saveTime = Now() - start;
+    }
+    TStrStrHashMap<> m(100'000);
+    auto start = Now();
+    m.Load(path);
+    const auto loadTime = Now() - start;
+    const auto loadRss = Rss();
+    srand(45);
+    uint64_t sum = 0;
+    start = Now();
+    for (uint64_t i = 0; i < GetsCount; ++i) {
+        sum += m.Get(std::to_string((rand() * 1ull * RAND_MAX + rand()) % keysCount)).first[0];
+    }
+    const auto getTime = Now() - start;
+    verify(sum == GetsCount * 'v');
+    std::remove(path.c_str());
+    std::cerr << "Snapshot (Elements: " << keysCount << ", SaveTime: " << saveTime << ", LoadTime: " << loadTime
+        << ", LoadRss: " << loadRss << ", FirstGetsTime: " << getTime << ", Rss: " << Rss() << ")" << std::endl;
+}
+
+// Random lookups in a map much larger than caches, one by one and in batches.
+void BenchmarkMultiGet()
+{
+    constexpr uint64_t BufferSize = 1ull << 30;
+    constexpr uint64_t GetsCount = 10'000'000;
+    TStrStrHashMap<> m(BufferSize);
+    const std::string value(100, 'v');
+    uint64_t keysCount = 0;
+    while (m.FillRate() < 0.9) {
+        m.Put(std::to_string(keysCount++), value);
+    }
+    srand(45);
+    std::vector<std::string> keys(1 << 20);
+    for (auto& key : keys) {
+        key = std::to_string((rand() * 1ull * RAND_MAX + rand()) % keysCount);
+    }
+    std::vector<std::string_view> keyViews(keys.begin(), keys.end());
+
+    uint64_t sum = 0;
+    auto start = Now();
+    for (uint64_t i = 0; i < GetsCount; ++i) {
+        sum += m.Get(keyViews[i % keyViews.size()]).first[0];
+    }
+    const auto getTime = Now() - start;
+    verify(sum == GetsCount * 'v');
+    std::cerr << "Get (Elements: " << keysCount << ", Time: " << getTime << ")" << std::endl;
+
+    for (uint64_t batchSize : {4, 16, 64}) {
+        std::vector<std::pair<TStrStrHashMap<>::TValue, TStrStrHashMap<>::TIndex>> results(batchSize);
+        sum = 0;
+        start = Now();
+        for (uint64_t i = 0; i < GetsCount; i += batchSize) {
+            const uint64_t offset = i % keyViews.size();
+            m.MultiGet(std::span(keyViews).subspan(offset, batchSize), results);
+            for (const auto& [val, idx] : results) {
+                sum += val[0];
+            }
+        }
+        verify(sum == GetsCount * 'v');
+        std::cerr << "MultiGet (BatchSize: " << batchSize << ", Time: " << Now() - start << ")" << std::endl;
+    }
+}
+
+// Memory per entry and throughput for 8-32 byte values, in the blob storage and in slots.
+template <typename TMap>
+void BenchmarkSmallValues(std::string_view name, TMap& m)
+{
+    constexpr uint64_t Count = 5'000'000;
+    std::vector<std::string> keys(Count);
+    for (uint64_t i = 0; i < Count; ++i) {
+        keys[i] = std::to_string(i * 7919);
+    }
+    const std::string value(32, 'v');
+    const auto startRss = Rss();
+    auto start = Now();
+    for (uint64_t i = 0; i < Count; ++i) {
+        m.Put(keys[i], std::string_view(value).substr(0, 8 + i % 25));
+    }
+    const auto putTime = Now() - start;
+    const auto bytesPerEntry = (Rss() - startRss) * 1e6 / Count;
+    srand(45);
+    uint64_t sum = 0;
+    start = Now();
+    for (uint64_t i = 0; i < Count; ++i) {
+        sum += m.Get(keys[(rand() * 1ull * RAND_MAX + rand()) % Count]).first[0];
+    }
+    const auto getTime = Now() - start;
+    verify(sum == Count * 'v');
+    std::cerr << name << " (Elements: " << m.ElementsCount() << ", BytesPerEntry: " << bytesPerEntry
+        << ", PutTime: " << putTime << ", GetTime: " << getTime << ")" << std::endl;
+}
+
 int main()
 {
     std::cerr << RunDesc << "\nStart tests" << std::endl;
     test_rank();
-    test_bitmask();
+    test_bitmask<1024>(1);
+    test_bitmask<64 * 64 * 2 + 100>(61);
+    MB_FileMappingTest();
     SS_SimpleTest();
+    SS_CompactPositionsTest();
+    SS_NarrowHeaderTest();
+    SS_DefragmentationWindowTest();
+    SS_FitPolicyTest<TFitPolicy::Segregated>();
+    SS_FitPolicyTest<TFitPolicy::ExactRank>();
+    SS_FitPolicyTest<TFitPolicy::BestFit>();
+    SS_SizeClassesTest();
+    SS_IncrementalDefragmentationTest();
+    SS_PinnedAllocateTest();
     SSHM_SimpleTest();
+    test_hasher();
+    SSHM_EvictionTest();
+    SSHM_ClockEvictionTest();
+    SSHM_EvictOnCompactionTest();
+    SSHM_GdsfEvictionTest();
+    SSHM_AdmissionTest();
+    SSHM_AdmissionManyVictimsTest();
+    SSHM_PinnedValueTest(0);
+    SSHM_PinnedValueTest(1000);
+    SSHM_SnapshotTest();
+    SSHM_MultiGetTest();
+    SSHM_SmallSlotsTest();
+    SSHM_OneBlockTest();
+    SSHM_IncrementalRehashTest();
+    SSHM_BackgroundCompactionTest();
+    SSHM_BackgroundCompactionPutTest();
+    SSHM_BackgroundCompactionGuardTest();
+    SSHM_ShardedTest();
     SSHM_StressTest();
     std::cerr << "Finish tests" << std::endl;
+    BenchmarkHugePages("SmallPages-Prefault", {.HugePages = THugePages::None, .Prefault = true}); // As std::vector.
+    BenchmarkHugePages("SmallPages", {.HugePages = THugePages::None});
+    BenchmarkHugePages("TransparentHugePages", {.HugePages = THugePages::Transparent});
+    BenchmarkHugePages("TransparentHugePages-Prefault", {.HugePages = THugePages::Transparent, .Prefault = true});
+    BenchmarkHugePages("ExplicitHugePages", {.HugePages = THugePages::Explicit});
+    BenchmarkSnapshot();
+    BenchmarkMultiGet();
+    {
+        TStrStrHashMap<std::hash<std::string_view>, TNoEviction, TBlobStringsStorage> blob(1ull << 30);
+        BenchmarkSmallValues("SmallValues-Blob", blob);
+    }
+    {
+        TStrStrHashMap<std::hash<std::string_view>, TNoEviction, TCompactBlobStringsStorage> blob(1ull << 30);
+        BenchmarkSmallValues("SmallValues-CompactBlob", blob);
+    }
+    {
+        using TMap = TStrStrHashMap<std::hash<std::string_view>, TNoEviction, TCompactBlobStringsStorage>;
+        auto oneBlock = TMap::OneBlock(1ull << 30, 6'000'000);
+        BenchmarkSmallValues("SmallValues-OneBlock", oneBlock);
+    }
+    {
+        using TStorage = TSmallSlotsStringsStorage<>;
+        TStrStrHashMap<std::hash<std::string_view>, TNoEviction, TStorage> slots(TStorage(64 << 20, 1ull << 30, 64));
+        BenchmarkSmallValues("SmallValues-Slots", slots);
+    }
     // show_rank();
     std::cerr << "Finish" << std::endl;
     return 0;
 }
+#endif
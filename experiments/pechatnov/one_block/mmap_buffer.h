@@ -0,0 +1,168 @@
+#pragma once
+
+// Anonymous mmap buffer for storages instead of std::vector<char>, that zero-fills the whole buffer up front.
+// Pages are faulted lazily, so startup does not depend on the buffer size and RSS grows with use.
+// Can also map a file region, that is how snapshots are loaded.
+// Storages include it, so translation units that include several experiments into namespaces
+// must include it first (see trace_replay).
+
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+enum class THugePages
+{
+    None,
+    Transparent, // madvise(MADV_HUGEPAGE), works if THP mode is "madvise" or "always".
+    Explicit, // MAP_HUGETLB from the preallocated pool (vm.nr_hugepages), Transparent if the pool is short.
+};
+
+struct TBufferOptions
+{
+    THugePages HugePages = THugePages::Transparent;
+    // Faults all pages in the constructor, so requests never wait for the kernel. For latency critical nodes.
+    bool Prefault = false;
+};
+
+class TMmapBuffer
+{
+public:
+    static constexpr uint64_t HugePageSize = 2 << 20;
+
+    TMmapBuffer() = default;
+
+    TMmapBuffer(uint64_t size, TBufferOptions options = TBufferOptions())
+        : Size_(size)
+    {
+#ifdef MAP_HUGETLB
+        if (options.HugePages == THugePages::Explicit) {
+            MappedSize_ = (size + HugePageSize - 1) / HugePageSize * HugePageSize;
+            Map(MAP_HUGETLB);
+            if (Base_ != nullptr) {
+                Data_ = Base_;
+                HugePages_ = THugePages::Explicit;
+            }
+        }
+#endif
+        if (Base_ == nullptr) {
+            // One more huge page to align the start, otherwise the kernel can not use huge pages for the first one.
+            MappedSize_ = size + (options.HugePages == THugePages::None ? 0 : HugePageSize);
+            Map(0);
+            if (Base_ == nullptr) {
+                throw std::runtime_error("mmap failed");
+            }
+            Data_ = Base_;
+#ifdef MADV_HUGEPAGE
+            if (options.HugePages != THugePages::None) {
+                const uint64_t base = reinterpret_cast<uint64_t>(Base_);
+                Data_ = Base_ + ((base + HugePageSize - 1) / HugePageSize * HugePageSize - base);
+                if (madvise(Base_, MappedSize_, MADV_HUGEPAGE) == 0) {
+                    HugePages_ = THugePages::Transparent;
+                }
+            }
+#endif
+        }
+        if (options.Prefault) {
+            Prefault();
+        }
+    }
+
+    // Private writable mapping of a file region, e.g. of a snapshot. Pages are read from the page cache on first access
+    // and writes never reach the file. `offset` must be a multiple of the page size.
+    // Throws if the file is shorter than the region, access past the end of file would be SIGBUS.
+    TMmapBuffer(int fd, uint64_t offset, uint64_t size)
+        : Size_(size)
+        , MappedSize_(size)
+    {
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            throw std::runtime_error("fstat failed");
+        }
+        const uint64_t fileSize = st.st_size;
+        if (offset > fileSize || size > fileSize - offset) {
+            throw std::runtime_error("file is shorter than the mapped region");
+        }
+        void* data = mmap(nullptr, MappedSize_, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, offset);
+        if (data == MAP_FAILED) {
+            throw std::runtime_error("mmap of file failed");
+        }
+        Base_ = static_cast<char*>(data);
+        Data_ = Base_;
+    }
+
+    TMmapBuffer(TMmapBuffer&& other)
+        : Base_(std::exchange(other.Base_, nullptr))
+        , Data_(std::exchange(other.Data_, nullptr))
+        , Size_(std::exchange(other.Size_, 0))
+        , MappedSize_(std::exchange(other.MappedSize_, 0))
+        , HugePages_(other.HugePages_)
+    { }
+
+    TMmapBuffer& operator=(TMmapBuffer&& other)
+    {
+        if (this != &other) {
+            Unmap();
+            Base_ = std::exchange(other.Base_, nullptr);
+            Data_ = std::exchange(other.Data_, nullptr);
+            Size_ = std::exchange(other.Size_, 0);
+            MappedSize_ = std::exchange(other.MappedSize_, 0);
+            HugePages_ = other.HugePages_;
+        }
+        return *this;
+    }
+
+    ~TMmapBuffer()
+    {
+        Unmap();
+    }
+
+    char* data()
+    {
+        return Data_;
+    }
+
+    uint64_t size() const
+    {
+        return Size_;
+    }
+
+    // What was actually granted, it may be less than requested.
+    THugePages HugePages() const
+    {
+        return HugePages_;
+    }
+
+private:
+    void Map(int flags)
+    {
+        void* data = mmap(nullptr, MappedSize_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+        Base_ = data == MAP_FAILED ? nullptr : static_cast<char*>(data);
+    }
+
+    void Unmap()
+    {
+        if (Base_ != nullptr) {
+            munmap(Base_, MappedSize_);
+        }
+    }
+
+    // MAP_POPULATE would fault small pages before madvise, so pages are touched instead.
+    void Prefault()
+    {
+        const uint64_t pageSize = sysconf(_SC_PAGESIZE);
+        for (uint64_t offset = 0; offset < Size_; offset += pageSize) {
+            static_cast<volatile char*>(Data_)[offset] = 0;
+        }
+    }
+
+private:
+    char* Base_ = nullptr;
+    char* Data_ = nullptr;
+    uint64_t Size_ = 0;
+    uint64_t MappedSize_ = 0;
+    THugePages HugePages_ = THugePages::None;
+};
@@ -0,0 +1,423 @@
+// Open-addressing index with 7-bit hash tags (Swiss table) over one_block storage.
+// Chained TStrStrHashMap reads `Positions_` and the entry header in `Data_` on every chain hop.
+// Here a group of 16 tags (32 with AVX2, e.g. -march=native) is compared at once, and only tag matches touch `Data_`.
+
+#ifndef EXPERIMENT_NO_MAIN
+#define EXPERIMENT_NO_MAIN
+#define SWISS_INDEX_MAIN
+#endif
+
+#include "../one_block/main.cpp"
+
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+class TSwissStrStrHashMap
+{
+public:
+    using TIndex = TStringsStorage::TIndex;
+    using TValue = TStringsStorage::TValue;
+    static inline constexpr TIndex NilIndex = TStringsStorage::NilIndex;
+    static inline constexpr TValue NilValue = TStringsStorage::NilValue;
+
+    TSwissStrStrHashMap(uint64_t bufferSize, uint64_t defragmentationBytesPerAllocation = 0)
+        : Storage_(bufferSize, defragmentationBytesPerAllocation)
+    {
+        Groups_.assign(1, TGroup{});
+    }
+
+    // Same hash as TStrStrHashMap<>, so both maps can be compared on the same keys.
+    static uint64_t Hash(std::string_view key)
+    {
+        return std::hash<std::string_view>{}(key) & TStrStrHashMap<>::KeyHashMask;
+    }
+
+    std::pair<TValue, TIndex> PutUnitialized(std::string_view key, uint64_t valueSize)
+    {
+        const uint64_t keyHash = Hash(key);
+        EraseSlot(FindSlot(keyHash, key)); // Remove old element if exists.
+
+        if ((FullSlotsCount_ + DeletedSlotsCount_ + 1) * 8 > Groups_.size() * TGroup::Size * 7) {
+            // Grow only if full slots take more than a half of the max load (7/16), otherwise just drop tombstones.
+            Rehash((FullSlotsCount_ + 1) * 2 * 8 > Groups_.size() * TGroup::Size * 7 ? Groups_.size() * 2 : Groups_.size());
+        }
+
+        auto [sval, idx] = Storage_.Allocate(CalculateSize(key.size(), valueSize));
+        THeader& header = GetHeader(sval);
+        header.KeyHash = keyHash;
+        header.KeySize = key.size();
+        std::memcpy(sval.data() + sizeof(THeader), key.data(), header.KeySize);
+
+        InsertSlot(keyHash, idx);
+
+        return {GetValue(sval), idx};
+    }
+
+    std::pair<TValue, TIndex> Put(std::string_view key, std::string_view value)
+    {
+        auto [val, idx] = PutUnitialized(key, value.size());
+        std::memcpy(val.data(), value.data(), value.size());
+        return {val, idx};
+    }
+
+    std::pair<TValue, TIndex> Get(std::string_view key)
+    {
+        const TSlot slot = FindSlot(Hash(key), key);
+        if (slot.Group == nullptr) {
+            return {NilValue, NilIndex};
+        }
+        const TIndex idx = slot.Group->Indexes[slot.Position];
+        return {Get(idx), idx};
+    }
+
+    TValue Get(TIndex index)
+    {
+        auto svalue = Storage_.Get(index);
+        if (svalue.data() == nullptr) {
+            return NilValue;
+        }
+        return GetValue(svalue);
+    }
+
+    bool Erase(std::string_view key)
+    {
+        return EraseSlot(FindSlot(Hash(key), key));
+    }
+
+    bool Erase(TIndex index)
+    {
+        auto sval = Storage_.Get(index);
+        if (sval.data() == nullptr) {
+            return false;
+        }
+        const bool success = EraseSlot(FindSlot(GetHeader(sval).KeyHash, index));
+        assert(success);
+        return success;
+    }
+
+    void Clear()
+    {
+        Storage_.Clear();
+        Groups_.assign(1, TGroup{});
+        FullSlotsCount_ = 0;
+        DeletedSlotsCount_ = 0;
+    }
+
+    uint64_t ElementsCount()
+    {
+        return Storage_.ElementsCount();
+    }
+
+    double FillRate()
+    {
+        return Storage_.FillRate();
+    }
+
+    uint64_t DefragmentatedBytes()
+    {
+        return Storage_.DefragmentatedBytes();
+    }
+
+    bool DoHeavyWork(uint64_t byteBudget)
+    {
+        return Storage_.DoHeavyWork(byteBudget);
+    }
+
+    // Tags and indexes. Entry headers have no links.
+    uint64_t IndexBytes()
+    {
+        return Groups_.capacity() * sizeof(TGroup);
+    }
+
+private:
+    struct __attribute__ ((__packed__, __aligned__(alignof(TIndex)))) THeader
+    {
+        uint64_t KeyHash : 56;
+        uint64_t KeySize : 40;
+    };
+    static_assert(alignof(THeader) == 4);
+    static_assert(sizeof(THeader) == 12); // Not invariant, just check.
+
+    // Control byte: tag (low 7 bits of the key hash) if full, negative otherwise.
+    static constexpr int8_t EmptyCtrl = -128;
+    static constexpr int8_t DeletedCtrl = -2;
+
+    // Tags and indexes of one group are neighbours, so a hit costs at most two cache lines before `Data_`
+    // (three for 32-wide groups).
+#ifdef __AVX2__
+    struct alignas(32) TGroup
+    {
+        static constexpr int Size = 32;
+#else
+    struct alignas(16) TGroup
+    {
+        static constexpr int Size = 16;
+#endif
+
+        int8_t Ctrl[Size];
+        TIndex Indexes[Size];
+
+        TGroup()
+        {
+            std::memset(Ctrl, EmptyCtrl, Size);
+        }
+
+        // Bit i is set if Ctrl[i] == ctrl.
+        uint32_t Match(int8_t ctrl) const
+        {
+#if defined(__AVX2__)
+            const __m256i ctrls = _mm256_load_si256(reinterpret_cast<const __m256i*>(Ctrl));
+            return _mm256_movemask_epi8(_mm256_cmpeq_epi8(ctrls, _mm256_set1_epi8(ctrl)));
+#elif defined(__SSE2__)
+            const __m128i ctrls = _mm_load_si128(reinterpret_cast<const __m128i*>(Ctrl));
+            return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrls, _mm_set1_epi8(ctrl)));
+#else
+            uint32_t mask = 0;
+            for (int i = 0; i < Size; ++i) {
+                mask |= static_cast<uint32_t>(Ctrl[i] == ctrl) << i;
+            }
+            return mask;
+#endif
+        }
+
+        uint32_t MatchEmptyOrDeleted() const
+        {
+#if defined(__AVX2__)
+            return _mm256_movemask_epi8(_mm256_load_si256(reinterpret_cast<const __m256i*>(Ctrl))); // Sign bits.
+#elif defined(__SSE2__)
+            return _mm_movemask_epi8(_mm_load_si128(reinterpret_cast<const __m128i*>(Ctrl))); // Sign bits.
+#else
+            uint32_t mask = 0;
+            for (int i = 0; i < Size; ++i) {
+                mask |= static_cast<uint32_t>(Ctrl[i] < 0) << i;
+            }
+            return mask;
+#endif
+        }
+    };
+    static_assert(sizeof(TGroup) == TGroup::Size * 5); // Not invariant, just check.
+
+    struct TSlot
+    {
+        TGroup* Group = nullptr;
+        int Position = 0;
+    };
+
+    static int8_t GetTag(uint64_t keyHash)
+    {
+        return keyHash & 0x7F;
+    }
+
+    uint64_t CalculateSize(uint64_t keySize, uint64_t valueSize)
+    {
+        return sizeof(THeader) + keySize + valueSize;
+    }
+
+    THeader& GetHeader(TValue svalue)
+    {
+        return *reinterpret_cast<THeader*>(svalue.data());
+    }
+
+    std::string_view GetKey(TValue svalue)
+    {
+        auto s = svalue.subspan(sizeof(THeader), GetHeader(svalue).KeySize);
+        return {s.data(), s.size()};
+    }
+
+    TValue GetValue(TValue svalue)
+    {
+        return svalue.subspan(sizeof(THeader) + GetHeader(svalue).KeySize);
+    }
+
+    // Triangular probing over groups, visits all of them since the count is a power of two.
+    // Stops on the first group with an empty slot: insertion never skips one.
+    template <typename TIsTarget>
+    TSlot Probe(uint64_t keyHash, TIsTarget&& isTarget)
+    {
+        const uint64_t mask = Groups_.size() - 1;
+        const int8_t tag = GetTag(keyHash);
+        uint64_t groupIdx = (keyHash >> 7) & mask;
+        for (uint64_t step = 1; ; ++step) {
+            TGroup& group = Groups_[groupIdx];
+            for (uint32_t match = group.Match(tag); match != 0; match &= match - 1) {
+                const int position = __builtin_ctz(match);
+                if (isTarget(group.Indexes[position])) {
+                    return {&group, position};
+                }
+            }
+            if (group.Match(EmptyCtrl) != 0) {
+                return {};
+            }
+            groupIdx = (groupIdx + step) & mask;
+        }
+    }
+
+    TSlot FindSlot(uint64_t keyHash, std::string_view key)
+    {
+        return Probe(keyHash, [&](TIndex idx) {
+            auto sval = Storage_.Get(idx);
+            return GetHeader(sval).KeyHash == keyHash && key == GetKey(sval);
+        });
+    }
+
+    TSlot FindSlot(uint64_t keyHash, TIndex index)
+    {
+        return Probe(keyHash, [&](TIndex idx) {
+            return idx == index;
+        });
+    }
+
+    bool EraseSlot(TSlot slot)
+    {
+        if (slot.Group == nullptr) {
+            return false;
+        }
+        verify(Storage_.Free(slot.Group->Indexes[slot.Position]));
+        // Empty would cut probe sequences passing through the group, unless the group has another empty slot already.
+        slot.Group->Ctrl[slot.Position] = slot.Group->Match(EmptyCtrl) != 0 ? EmptyCtrl : DeletedCtrl;
+        DeletedSlotsCount_ += slot.Group->Ctrl[slot.Position] == DeletedCtrl;
+        --FullSlotsCount_;
+        return true;
+    }
+
+    void InsertSlot(uint64_t keyHash, TIndex idx)
+    {
+        const uint64_t mask = Groups_.size() - 1;
+        uint64_t groupIdx = (keyHash >> 7) & mask;
+        for (uint64_t step = 1; ; ++step) {
+            TGroup& group = Groups_[groupIdx];
+            if (const uint32_t match = group.MatchEmptyOrDeleted(); match != 0) {
+                const int position = __builtin_ctz(match);
+                DeletedSlotsCount_ -= group.Ctrl[position] == DeletedCtrl;
+                group.Ctrl[position] = GetTag(keyHash);
+                group.Indexes[position] = idx;
+                ++FullSlotsCount_;
+                return;
+            }
+            groupIdx = (groupIdx + step) & mask;
+        }
+    }
+
+    void Rehash(uint64_t groupsCount)
+    {
+        auto oldGroups = std::move(Groups_);
+        Groups_.assign(groupsCount, TGroup{});
+        FullSlotsCount_ = 0;
+        DeletedSlotsCount_ = 0;
+        for (auto& group : oldGroups) {
+            for (int i = 0; i < TGroup::Size; ++i) {
+                if (group.Ctrl[i] >= 0) {
+                    InsertSlot(GetHeader(Storage_.Get(group.Indexes[i])).KeyHash, group.Indexes[i]);
+                }
+            }
+        }
+    }
+
+private:
+    TStringsStorage Storage_;
+    // Overhead per one element is sizeof(TGroup) / TGroup::Size / loadFactor = 5.7..11.4 bytes,
+    // chained index costs 4 in HashTable_ + 4 in the header.
+    std::vector<TGroup> Groups_;
+    uint64_t FullSlotsCount_ = 0;
+    uint64_t DeletedSlotsCount_ = 0;
+};
+
+void SWHM_SimpleTest()
+{
+    TSwissStrStrHashMap m(1000000);
+    m.Put("key1", "value1");
+    verify(m.Get("key1").first == "value1"sv);
+    auto [val2, idx2] = m.Put("key2", "value2");
+    verify(m.Get("key2").first == "value2"sv);
+    verify(m.Erase("key1"));
+    verify(m.Get("key1").first.data() == nullptr);
+    verify(!m.Erase("key1"));
+    verify(m.Erase(idx2));
+    verify(m.Get("key2").first.data() == nullptr);
+    verify(!m.Erase(idx2));
+
+    for (int i = 0; i < 94; ++i) {
+        auto val = m.PutUnitialized(std::to_string(i), 10000).first;
+        for (auto& e : val) {
+            e = i;
+        }
+    }
+    for (int i = 0; i < 94; i += 2) {
+        verify(m.Erase(std::to_string(i)));
+    }
+    for (int i = 0; i < 94; ++i) {
+        auto val = m.Get(std::to_string(i)).first;
+        verify((val.data() == nullptr) == (i % 2 == 0));
+        for (auto& e : val) {
+            verify(e == i);
+        }
+    }
+    m.Clear();
+    verify(m.ElementsCount() == 0);
+}
+
+// Random Put/Erase/Get against std::unordered_map, many tombstones and rehashes.
+void SWHM_RandomTest()
+{
+    srand(45);
+    TSwissStrStrHashMap m(10'000'000);
+    std::unordered_map<std::string, std::string> expected;
+    for (int i = 0; i < 300000; ++i) {
+        const std::string key = std::to_string(rand() % 20000);
+        const int op = rand() % 3;
+        if (op == 0) {
+            verify(m.Erase(key) == (expected.erase(key) == 1));
+        } else if (op == 1) {
+            const std::string value(rand() % 50, 'a' + rand() % 26);
+            m.Put(key, value);
+            expected[key] = value;
+        } else {
+            auto val = m.Get(key).first;
+            auto it = expected.find(key);
+            verify((val.data() != nullptr) == (it != expected.end()));
+            verify(it == expected.end() || val == it->second);
+        }
+        verify(m.ElementsCount() == expected.size());
+    }
+}
+
+// Get latency of chained and Swiss indexes on the same keys, half of lookups miss.
+template <typename TMap>
+void BenchmarkGet(std::string_view name, const std::vector<std::string>& keys, uint64_t gets)
+{
+    TMap m(1'000'000'000);
+    std::string value;
+    for (size_t i = 0; i < keys.size(); i += 2) { // Odd keys are misses.
+        value.assign(8 + i % 25, 'v');
+        m.Put(keys[i], value);
+    }
+    auto start = Now();
+    uint64_t found = 0;
+    uint64_t j = 0;
+    for (uint64_t i = 0; i < gets; ++i) {
+        j = (j * 6364136223846793005ull + 1442695040888963407ull);
+        found += m.Get(keys[(j >> 33) % keys.size()]).first.data() != nullptr;
+    }
+    std::cerr << name << " (Time: " << Now() - start << ", Found: " << found
+        << ", IndexBytesPerElement: " << static_cast<double>(m.IndexBytes()) / m.ElementsCount() << ")" << std::endl;
+}
+
+#ifdef SWISS_INDEX_MAIN
+int main()
+{
+    std::cerr << RunDesc << "\nStart tests" << std::endl;
+    SWHM_SimpleTest();
+    SWHM_RandomTest();
+    std::cerr << "Finish tests" << std::endl;
+
+    std::vector<std::string> keys(8'000'000);
+    for (size_t i = 0; i < keys.size(); ++i) {
+        keys[i] = std::to_string(i);
+    }
+    BenchmarkGet<TStrStrHashMap<>>("Chained-Get", keys, 10'000'000);
+    BenchmarkGet<TSwissStrStrHashMap>("Swiss-Get", keys, 10'000'000);
+    std::cerr << "Finish" << std::endl;
+    return 0;
+}
+#endif
@@ -0,0 +1,714 @@
+// Replays production logs of format `<epoch> <keyHash> <keyLen> <valueLen>` (one event per line)
+// against every storage variant. For every event: Get, Erase on hit, Put.
+// Target metric is byte cache hit (successReturnedBytes / totalBytes).
+
+// All standard headers are included here first:
+// experiment sources are textually included into namespaces below and must not open std headers there.
+#include <iostream>
+#include <chrono>
+#include <vector>
+#include <deque>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <map>
+#include <memory>
+#include <new>
+#include <cstring>
+#include <cstdio>
+#include <cassert>
+#include <optional>
+#include <stdexcept>
+#include <algorithm>
+#include <bit>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <utility>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+#if defined(__APPLE__) && defined(__MACH__)
+#include <mach/mach.h>
+#else
+#include <unistd.h>
+#endif
+#include <sys/wait.h>
+#include "../one_block/wyhash.h"
+#include "../one_block/mmap_buffer.h"
+
+#define EXPERIMENT_NO_MAIN
+
+namespace NOneBlock {
+#include "../one_block/main.cpp"
+}
+
+namespace NOneBlockTrivial {
+#define TRIVIAL_STORAGE
+#include "../one_block/main.cpp"
+#undef TRIVIAL_STORAGE
+}
+
+namespace NSwissIndex {
+#include "../swiss_index/main.cpp"
+}
+
+namespace NEpochStorage {
+#include "../epoch_storage/main.cpp"
+}
+
+namespace NBoundedLatency {
+#include "../bounded_latency/main.cpp"
+}
+
+namespace NDkudimov {
+#include "../../../dkudimov/experiments/int.h"
+}
+
+using NOneBlock::Now;
+using NOneBlock::Rss;
+
+struct TEvent
+{
+    uint64_t Epoch;
+    uint64_t KeyHash;
+    uint32_t KeySize;
+    uint32_t ValueSize;
+};
+
+std::vector<TEvent> ReadTrace(const char* path)
+{
+    FILE* f = std::strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!f) {
+        throw std::runtime_error(std::string("can not open ") + path);
+    }
+    std::vector<TEvent> events;
+    unsigned long long epoch, keyHash, keySize, valueSize;
+    while (fscanf(f, "%llu %llu %llu %llu", &epoch, &keyHash, &keySize, &valueSize) == 4) {
+        events.push_back({epoch, keyHash, static_cast<uint32_t>(keySize), static_cast<uint32_t>(valueSize)});
+    }
+    if (f != stdin) {
+        fclose(f);
+    }
+    return events;
+}
+
+// Synthetic trace with value sizes distributed as in SSHM_StressTest. Useful when no production log is at hand.
+void GenerateTrace(uint64_t eventsCount, uint64_t keysCount, uint64_t epochLength)
+{
+    srand(45);
+    std::vector<uint32_t> keySizes(keysCount);
+    std::vector<uint32_t> valueSizes(keysCount);
+    for (uint64_t i = 0; i < keysCount; ++i) {
+        keySizes[i] = std::to_string(i).size() + rand() % 10;
+        int valueSize = rand() % 200;
+        if (rand() % 10 == 0) {
+            valueSize = rand() % 2000;
+        }
+        if (rand() % 400 == 0) {
+            valueSize = rand() % 20000;
+        }
+        if (rand() % 5000 == 0) {
+            valueSize = rand() % 200000;
+        }
+        valueSizes[i] = valueSize;
+    }
+    for (uint64_t i = 0; i < eventsCount; ++i) {
+        // Half of requests go to the hottest tenth of keys.
+        const uint64_t hotKeysCount = std::max<uint64_t>(keysCount / 10, 1);
+        const uint64_t j = rand() % 2 ? rand() % hotKeysCount : rand() % keysCount;
+        const uint64_t keyHash = std::hash<uint64_t>{}(j * 0x9E3779B97F4A7C15ull) & ((1ull << 56) - 1);
+        printf("%llu %llu %u %u\n", static_cast<unsigned long long>(i / epochLength + 1),
+            static_cast<unsigned long long>(keyHash), keySizes[j], valueSizes[j]);
+    }
+}
+
+// Key bytes are the key hash repeated up to key length.
+// Keys shorter than the hash are widened so distinct hashes never collide.
+std::string_view MakeKey(const TEvent& event, std::string& buffer)
+{
+    buffer.resize(std::max<size_t>(event.KeySize, sizeof(event.KeyHash)));
+    for (size_t i = 0; i < buffer.size(); i += sizeof(event.KeyHash)) {
+        std::memcpy(buffer.data() + i, &event.KeyHash, std::min(buffer.size() - i, sizeof(event.KeyHash)));
+    }
+    return buffer;
+}
+
+// Non-zero `DefragmentationBytesPerAllocation` enables resumable compaction: bounded inside Put and continued in Idle.
+template <typename TMap, uint64_t DefragmentationBytesPerAllocation = 0>
+class TStrStrHashMapReplayer
+{
+public:
+    // Erase releases space, so the driver can make room by dropping the oldest entries.
+    static constexpr bool CanEvict = true;
+
+    TStrStrHashMapReplayer(uint64_t bufferSize)
+        : Map_(MakeMap(bufferSize))
+    { }
+
+    void Idle()
+    {
+        if constexpr (DefragmentationBytesPerAllocation != 0) {
+            Map_.DoHeavyWork(DefragmentationBytesPerAllocation * IdleWorkMultiplier);
+        }
+    }
+
+    std::optional<uint64_t> Get(std::string_view key)
+    {
+        auto [val, idx] = Map_.Get(key);
+        if (val.data() == nullptr) {
+            return std::nullopt;
+        }
+        return val.size();
+    }
+
+    void Erase(std::string_view key)
+    {
+        Map_.Erase(key);
+    }
+
+    bool Put(std::string_view key, std::string_view value, uint64_t)
+    {
+        try {
+            if (Map_.Put(key, value).second == TMap::NilIndex) {
+                ++NotAdmittedCount_; // Rejected by an admission filter, not retried with driver evictions.
+                return false;
+            }
+        } catch (const std::runtime_error&) { // No space.
+            return false;
+        }
+        return true;
+    }
+
+    uint64_t NotAdmittedCount()
+    {
+        return NotAdmittedCount_;
+    }
+
+    double FillRate()
+    {
+        return Map_.FillRate();
+    }
+
+    uint64_t DefragmentatedBytes()
+    {
+        return Map_.DefragmentatedBytes();
+    }
+
+private:
+    static constexpr uint64_t IdleWorkMultiplier = 4;
+
+    static TMap MakeMap(uint64_t bufferSize)
+    {
+        if constexpr (DefragmentationBytesPerAllocation != 0) {
+            return TMap(bufferSize, DefragmentationBytesPerAllocation);
+        } else {
+            return TMap(bufferSize);
+        }
+    }
+
+private:
+    TMap Map_;
+    uint64_t NotAdmittedCount_ = 0;
+};
+
+// GDSF tuned for byte hit rate, for replayers that construct policies by default.
+struct TByteGdsfEviction : NOneBlock::TGdsfEviction
+{
+    TByteGdsfEviction()
+        : NOneBlock::TGdsfEviction(1)
+    { }
+};
+
+// Default map with another choice of free gaps or size classes in the storage.
+template <NOneBlock::TFitPolicy FitPolicy, typename TSizeClasses = NOneBlock::TLogSizeClasses<>>
+using TFitPolicyMap = NOneBlock::TStrStrHashMap<std::hash<std::string_view>, NOneBlock::TNoEviction,
+    NOneBlock::TBasicBlobStringsStorage<int64_t, 38, 38, 32, FitPolicy, TSizeClasses>>;
+
+// Compaction runs on its own thread, Get only enters a reclamation epoch for the lookup.
+class TBackgroundCompactedReplayer
+{
+public:
+    static constexpr bool CanEvict = true;
+
+    TBackgroundCompactedReplayer(uint64_t bufferSize)
+        : Map_(bufferSize, 64 << 10)
+    { }
+
+    void Idle()
+    { }
+
+    std::optional<uint64_t> Get(std::string_view key)
+    {
+        auto guard = Map_.Read();
+        auto val = Map_.Get(guard, key);
+        if (val.data() == nullptr) {
+            return std::nullopt;
+        }
+        return val.size();
+    }
+
+    void Erase(std::string_view key)
+    {
+        Map_.Erase(key);
+    }
+
+    bool Put(std::string_view key, std::string_view value, uint64_t)
+    {
+        try {
+            if (Map_.Put(key, value) == Map_.NilIndex) {
+                ++NotAdmittedCount_; // No free gap until the compaction thread makes one, evictions would not help.
+                return false;
+            }
+        } catch (const std::runtime_error&) { // No space.
+            return false;
+        }
+        return true;
+    }
+
+    uint64_t NotAdmittedCount()
+    {
+        return NotAdmittedCount_;
+    }
+
+    double FillRate()
+    {
+        return Map_.FillRate();
+    }
+
+    uint64_t DefragmentatedBytes()
+    {
+        return Map_.DefragmentatedBytes();
+    }
+
+private:
+    NOneBlock::TBackgroundCompactedStrStrHashMap<> Map_;
+    uint64_t NotAdmittedCount_ = 0;
+};
+
+// Every shard gets an equal slice of the buffer, so the hit rate shows the cost of static partitioning.
+class TShardedReplayer
+{
+public:
+    static constexpr bool CanEvict = true;
+
+    TShardedReplayer(uint64_t bufferSize)
+        : Map_(bufferSize, ShardsCount)
+    { }
+
+    void Idle()
+    { }
+
+    std::optional<uint64_t> Get(std::string_view key)
+    {
+        uint64_t size = 0;
+        if (!Map_.Get(key, [&](NOneBlock::TShardedStrStrHashMap<>::TValue val) { size = val.size(); })) {
+            return std::nullopt;
+        }
+        return size;
+    }
+
+    void Erase(std::string_view key)
+    {
+        Map_.Erase(key);
+    }
+
+    bool Put(std::string_view key, std::string_view value, uint64_t)
+    {
+        try {
+            Map_.Put(key, value);
+        } catch (const std::runtime_error&) { // No space.
+            return false;
+        }
+        return true;
+    }
+
+    double FillRate()
+    {
+        return Map_.FillRate();
+    }
+
+    uint64_t DefragmentatedBytes()
+    {
+        return Map_.DefragmentatedBytes();
+    }
+
+private:
+    static constexpr uint64_t ShardsCount = 16;
+
+    NOneBlock::TShardedStrStrHashMap<> Map_;
+};
+
+class TStateCacheReplayer
+{
+public:
+    // Space of erased entries is never reused by the prototype, so eviction does not help.
+    static constexpr bool CanEvict = false;
+
+    TStateCacheReplayer(uint64_t bufferSize)
+        : Cache_(bufferSize, 3, Cleaner_)
+    { }
+
+    std::optional<uint64_t> Get(std::string_view key)
+    {
+        auto val = Cache_.Get(key);
+        if (!val) {
+            return std::nullopt;
+        }
+        return val->size();
+    }
+
+    void Erase(std::string_view)
+    { } // TStateCache has no Erase, Put overwrites.
+
+    void Idle()
+    { }
+
+    bool Put(std::string_view key, std::string_view value, uint64_t epoch)
+    {
+        try {
+            Cache_.Insert(key, value, epoch);
+        } catch (const std::runtime_error&) { // No space.
+            return false;
+        }
+        return true;
+    }
+
+    double FillRate()
+    {
+        return 1.0 - static_cast<double>(Cache_.FreeSpace()) / Cache_.TotalSpace();
+    }
+
+    uint64_t DefragmentatedBytes()
+    {
+        return 0;
+    }
+
+private:
+    NDkudimov::TCleaner Cleaner_;
+    NDkudimov::TStateCache Cache_;
+};
+
+// Same LRA by epochs as TStateCacheReplayer, epochs are dropped whole from their own segments.
+class TEpochStateCacheReplayer
+{
+public:
+    // Expired epochs are dropped inside Insert, the driver must not evict mandatory ones.
+    static constexpr bool CanEvict = false;
+
+    TEpochStateCacheReplayer(uint64_t bufferSize)
+        : Cache_(bufferSize, 3, 64 << 10)
+    { }
+
+    std::optional<uint64_t> Get(std::string_view key)
+    {
+        auto val = Cache_.Get(key);
+        if (!val) {
+            return std::nullopt;
+        }
+        return val->size();
+    }
+
+    void Erase(std::string_view key)
+    {
+        Cache_.Erase(key);
+    }
+
+    void Idle()
+    { }
+
+    bool Put(std::string_view key, std::string_view value, uint64_t epoch)
+    {
+        try {
+            Cache_.Insert(key, value, epoch);
+        } catch (const std::runtime_error&) { // No space.
+            return false;
+        }
+        return true;
+    }
+
+    double FillRate()
+    {
+        return Cache_.FillRate();
+    }
+
+    uint64_t DefragmentatedBytes()
+    {
+        return Cache_.DefragmentatedBytes();
+    }
+
+private:
+    NEpochStorage::TEpochStateCache<> Cache_;
+};
+
+struct TLatencyStats
+{
+    std::vector<uint32_t> Nanoseconds;
+
+    void Add(std::chrono::steady_clock::duration d)
+    {
+        Nanoseconds.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(d).count());
+    }
+
+    double Percentile(double p)
+    {
+        if (Nanoseconds.empty()) {
+            return 0;
+        }
+        auto it = Nanoseconds.begin() + std::min<size_t>(Nanoseconds.size() * p, Nanoseconds.size() - 1);
+        std::nth_element(Nanoseconds.begin(), it, Nanoseconds.end());
+        return *it / 1000.0;
+    }
+
+    friend std::ostream& operator<<(std::ostream& out, TLatencyStats& stats)
+    {
+        return out << stats.Percentile(0.5) << "/" << stats.Percentile(0.99) << "/" << stats.Percentile(0.999);
+    }
+};
+
+// Rss is of the whole process, ReplayerRss is its growth since before the replayer was built, so without the trace.
+template <typename TReplayer>
+void ReplayInProcess(std::string_view name, const std::vector<TEvent>& events, std::string_view valueData, uint64_t bufferSize)
+{
+    using TClock = std::chrono::steady_clock;
+
+    const double rssBefore = Rss();
+    TReplayer replayer(bufferSize);
+    std::deque<size_t> insertionOrder; // Event indexes of inserted entries, the oldest first.
+    std::string keyBuffer;
+    std::string evictKeyBuffer;
+    TLatencyStats getLatency;
+    TLatencyStats putLatency;
+    getLatency.Nanoseconds.reserve(events.size());
+    putLatency.Nanoseconds.reserve(events.size());
+    uint64_t totalBytes = 0;
+    uint64_t successReturnedBytes = 0;
+    uint64_t evictedCount = 0;
+    uint64_t rejectedCount = 0;
+    TClock::duration idleTime{};
+    // Puts rejected by an admission filter are neither stored nor retried.
+    auto notAdmittedCount = [&]() -> uint64_t {
+        if constexpr (requires { replayer.NotAdmittedCount(); }) {
+            return replayer.NotAdmittedCount();
+        } else {
+            return 0;
+        }
+    };
+
+    const auto start = TClock::now();
+    for (size_t i = 0; i < events.size(); ++i) {
+        const TEvent& event = events[i];
+        const auto key = MakeKey(event, keyBuffer);
+        const auto value = valueData.substr(0, event.ValueSize);
+
+        const auto getStart = TClock::now();
+        const auto found = replayer.Get(key);
+        const auto getFinish = TClock::now();
+        getLatency.Add(getFinish - getStart);
+
+        totalBytes += event.ValueSize;
+        if (found) {
+            successReturnedBytes += *found;
+            replayer.Erase(key);
+        }
+        const uint64_t notAdmittedBefore = notAdmittedCount();
+        bool inserted = replayer.Put(key, value, event.Epoch);
+        while (!inserted && TReplayer::CanEvict && !insertionOrder.empty() && notAdmittedCount() == notAdmittedBefore) {
+            // FIFO by insertion. Entry may be already erased or overwritten, then Erase is a no-op or drops a newer copy.
+            replayer.Erase(MakeKey(events[insertionOrder.front()], evictKeyBuffer));
+            insertionOrder.pop_front();
+            ++evictedCount;
+            inserted = replayer.Put(key, value, event.Epoch);
+        }
+        putLatency.Add(TClock::now() - getFinish);
+
+        if (inserted) {
+            insertionOrder.push_back(i);
+        } else if (notAdmittedCount() == notAdmittedBefore) {
+            ++rejectedCount;
+        }
+        const auto idleStart = TClock::now();
+        replayer.Idle(); // Emulates idle time between requests, so it is not in OpsPerSec.
+        idleTime += TClock::now() - idleStart;
+    }
+    const auto time = std::chrono::duration<double>(TClock::now() - start).count();
+    const auto idleSeconds = std::chrono::duration<double>(idleTime).count();
+    const auto requestSeconds = time - idleSeconds;
+
+    std::cerr << name << " (Events: " << events.size() << ", Time: " << time << ", IdleTime: " << idleSeconds
+        << ", OpsPerSec: " << (requestSeconds > 0 ? events.size() / requestSeconds : 0)
+        << ", ByteHitRate: " << (totalBytes ? static_cast<double>(successReturnedBytes) / totalBytes : 0)
+        << ", Evicted: " << evictedCount << ", Rejected: " << rejectedCount << ", NotAdmitted: " << notAdmittedCount()
+        << ", GetLatencyUs p50/p99/p999: " << getLatency
+        << ", PutLatencyUs p50/p99/p999: " << putLatency
+        << ", FillRate: " << replayer.FillRate() << ", Rss: " << Rss() << ", ReplayerRss: " << Rss() - rssBefore
+        << ", DefragmentatedBytes: " << replayer.DefragmentatedBytes() << ")" << std::endl;
+}
+
+// Every variant runs in a forked process, otherwise memory that an earlier variant freed and the allocator kept
+// would be in the RSS of later ones. The trace is read once before forks.
+template <typename TReplayer>
+void Replay(std::string_view name, const std::vector<TEvent>& events, std::string_view valueData, uint64_t bufferSize)
+{
+    std::cerr.flush();
+    const pid_t pid = fork();
+    if (pid < 0) {
+        throw std::runtime_error("fork failed");
+    }
+    if (pid == 0) {
+        int code = 0;
+        try {
+            ReplayInProcess<TReplayer>(name, events, valueData, bufferSize);
+        } catch (const std::exception& e) {
+            std::cerr << name << " failed: " << e.what() << std::endl;
+            code = 1;
+        }
+        std::cerr.flush();
+        _exit(code);
+    }
+    int status = 0;
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        std::cerr << name << " did not finish" << std::endl;
+    }
+}
+
+// Hash throughput on keys of the trace, so on its key length distribution.
+template <typename THasher>
+void BenchmarkHasher(std::string_view name, const std::vector<std::string>& keys, uint64_t rounds)
+{
+    THasher hasher;
+    uint64_t sum = 0; // Keeps hashing from being optimized out.
+    const auto start = std::chrono::steady_clock::now();
+    for (uint64_t round = 0; round < rounds; ++round) {
+        for (const auto& key : keys) {
+            sum += hasher(key);
+        }
+    }
+    const auto time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << name << " (NsPerKey: " << static_cast<double>(time) / (keys.size() * rounds) << ", Sum: " << sum << ")" << std::endl;
+}
+
+void BenchmarkHashers(const std::vector<TEvent>& events)
+{
+    std::vector<std::string> keys;
+    keys.reserve(events.size());
+    uint64_t keysBytes = 0;
+    std::string keyBuffer;
+    for (const auto& event : events) {
+        keys.emplace_back(MakeKey(event, keyBuffer));
+        keysBytes += keys.back().size();
+    }
+    const uint64_t rounds = std::max<uint64_t>(1, 10'000'000 / std::max<size_t>(keys.size(), 1));
+    std::cerr << "Keys (Count: " << keys.size() << ", AverageSize: " << static_cast<double>(keysBytes) / std::max<size_t>(keys.size(), 1) << ")" << std::endl;
+    BenchmarkHasher<std::hash<std::string_view>>("std::hash", keys, rounds);
+    BenchmarkHasher<NOneBlock::TWyHasher>("wyhash", keys, rounds);
+    BenchmarkHasher<NOneBlock::TIdentityHasher>("identity", keys, rounds);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc >= 2 && std::string_view(argv[1]) == "--generate") {
+        if (argc < 4) {
+            std::cerr << "Usage: " << argv[0] << " --generate <events> <keys> [epoch-length]" << std::endl;
+            return 1;
+        }
+        GenerateTrace(std::stoull(argv[2]), std::stoull(argv[3]), argc > 4 ? std::stoull(argv[4]) : 100000);
+        return 0;
+    }
+    if (argc >= 3 && std::string_view(argv[1]) == "--benchmark-hashers") {
+        BenchmarkHashers(ReadTrace(argv[2]));
+        return 0;
+    }
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <trace-file|-> [buffer-size] [variant...]\n"
+            << "       " << argv[0] << " --benchmark-hashers <trace-file|->\n"
+            << "Variants: one_block, one_block_wyhash, one_block_identity, one_block_lru, one_block_lru_tinylfu, one_block_gdsf, one_block_gdsf_bytes, one_block_clock, one_block_exact_fit, one_block_best_fit, one_block_fine_ranks, one_block_incremental, one_block_background, one_block_sharded, one_block_swiss, one_block_trivial, epoch_storage, bounded_latency, dkudimov (default: all)." << std::endl;
+        return 1;
+    }
+    const uint64_t bufferSize = argc > 2 ? std::stoull(argv[2]) : 1'000'000'000;
+    std::vector<std::string_view> variants(argv + std::min(argc, 3), argv + argc);
+    auto enabled = [&](std::string_view variant) {
+        return variants.empty() || std::find(variants.begin(), variants.end(), variant) != variants.end();
+    };
+
+    const auto events = ReadTrace(argv[1]);
+    uint32_t maxValueSize = 0;
+    for (const auto& event : events) {
+        maxValueSize = std::max(maxValueSize, event.ValueSize);
+    }
+    std::string valueData(maxValueSize, '\0');
+    for (auto& c : valueData) {
+        c = rand() % 100;
+    }
+    std::cerr << "Trace (Events: " << events.size() << ", BufferSize: " << bufferSize << ")" << std::endl;
+
+    if (enabled("one_block")) {
+        Replay<TStrStrHashMapReplayer<NOneBlock::TStrStrHashMap<>>>("one_block", events, valueData, bufferSize);
+    }
+    if (enabled("one_block_wyhash")) {
+        Replay<TStrStrHashMapReplayer<NOneBlock::TStrStrHashMap<NOneBlock::TWyHasher>>>("one_block_wyhash", events, valueData, bufferSize);
+    }
+    if (enabled("one_block_identity")) {
+        // Keys start with the key hash of the log.
+        Replay<TStrStrHashMapReplayer<NOneBlock::TStrStrHashMap<NOneBlock::TIdentityHasher>>>("one_block_identity", events, valueData, bufferSize);
+    }
+    if (enabled("one_block_lru")) {
+        // Map evicts by itself, so the driver never drops entries.
+        Replay<TStrStrHashMapReplayer<NOneBlock::TStrStrHashMap<std::hash<std::string_view>, NOneBlock::TLruEviction>>>(
+            "one_block_lru", events, valueData, bufferSize);
+    }
+    if (enabled("one_block_lru_tinylfu")) {
+        Replay<TStrStrHashMapReplayer<NOneBlock::TStrStrHashMap<std::hash<std::string_view>, NOneBlock::TTinyLfuAdmission<>>>>(
+            "one_block_lru_tinylfu", events, valueData, bufferSize);
+    }
+    if (enabled("one_block_gdsf")) {
+        Replay<TStrStrHashMapReplayer<NOneBlock::TStrStrHashMap<std::hash<std::string_view>, NOneBlock::TGdsfEviction>>>(
+            "one_block_gdsf", events, valueData, bufferSize);
+    }
+    if (enabled("one_block_gdsf_bytes")) {
+        Replay<TStrStrHashMapReplayer<NOneBlock::TStrStrHashMap<std::hash<std::string_view>, TByteGdsfEviction>>>(
+            "one_block_gdsf_bytes", events, valueData, bufferSize);
+    }
+    if (enabled("one_block_clock")) {
+        Replay<TStrStrHashMapReplayer<NOneBlock::TStrStrHashMap<std::hash<std::string_view>, NOneBlock::TClockEviction>>>(
+            "one_block_clock", events, valueData, bufferSize);
+    }
+    if (enabled("one_block_exact_fit")) {
+        Replay<TStrStrHashMapReplayer<TFitPolicyMap<NOneBlock::TFitPolicy::ExactRank>>>("one_block_exact_fit", events, valueData, bufferSize);
+    }
+    if (enabled("one_block_best_fit")) {
+        Replay<TStrStrHashMapReplayer<TFitPolicyMap<NOneBlock::TFitPolicy::BestFit>>>("one_block_best_fit", events, valueData, bufferSize);
+    }
+    if (enabled("one_block_fine_ranks")) {
+        using TFineRanksMap = TFitPolicyMap<NOneBlock::TFitPolicy::Segregated, NOneBlock::TLogSizeClasses<4, 6, 2>>;
+        Replay<TStrStrHashMapReplayer<TFineRanksMap>>("one_block_fine_ranks", events, valueData, bufferSize);
+    }
+    if (enabled("one_block_incremental")) {
+        Replay<TStrStrHashMapReplayer<NOneBlock::TStrStrHashMap<>, 64 << 10>>("one_block_incremental", events, valueData, bufferSize);
+    }
+    if (enabled("one_block_background")) {
+        Replay<TBackgroundCompactedReplayer>("one_block_background", events, valueData, bufferSize);
+    }
+    if (enabled("one_block_sharded")) {
+        Replay<TShardedReplayer>("one_block_sharded", events, valueData, bufferSize);
+    }
+    if (enabled("one_block_swiss")) {
+        Replay<TStrStrHashMapReplayer<NSwissIndex::TSwissStrStrHashMap>>("one_block_swiss", events, valueData, bufferSize);
+    }
+    if (enabled("one_block_trivial")) {
+        // Trivial storage ignores buffer size, so it shows the hit rate of an unbounded cache.
+        Replay<TStrStrHashMapReplayer<NOneBlockTrivial::TStrStrHashMap<>>>("one_block_trivial", events, valueData, bufferSize);
+    }
+    if (enabled("bounded_latency")) {
+        Replay<TStrStrHashMapReplayer<NBoundedLatency::TStrStrHashMap>>("bounded_latency", events, valueData, bufferSize);
+    }
+    if (enabled("epoch_storage")) {
+        Replay<TEpochStateCacheReplayer>("epoch_storage", events, valueData, bufferSize);
+    }
+    if (enabled("dkudimov")) {
+        Replay<TStateCacheReplayer>("dkudimov", events, valueData, bufferSize);
+    }
+    return 0;
+}